@@ -0,0 +1,259 @@
+#ifndef __TF_ALLOC__
+#define __TF_ALLOC__
+
+#include <atomic>
+#include <string>
+#include <sqlite3.h>
+
+/// Where an allocation came from.
+enum TFAllocSource
+{
+   TF_ALLOC_CPP,        ///< operator new.
+   TF_ALLOC_SQLITE,     ///< SQLite's memory allocator.
+
+   TF_ALLOC_SOURCE_COUNT
+};
+
+/**
+ * Counts allocations and the bytes allocated per stage of a transfer.
+ *
+ * The counting is fed by a replacement of the global operator new (see
+ * transferFaces.cpp) and by a shim around SQLite's allocator installed with
+ * installSQLiteHooks(). Both call record(), which does nothing until
+ * enable() is called, so the hooks cost one relaxed load when profiling is
+ * off.
+ *
+ * record() never allocates. The object relies on the zero initialisation of
+ * globals, it may be called before its constructor ran.
+ */
+class TFAllocations
+{
+public:
+   static const int MAX_STAGES = 16;      ///< The number of stages tracked.
+
+protected:
+   std::atomic<bool> enabled;                                              ///< Flag to count at all.
+   std::atomic<int> current;                                               ///< The stage running.
+   std::atomic<long long> counts[MAX_STAGES][TF_ALLOC_SOURCE_COUNT];       ///< Allocations per stage.
+   std::atomic<long long> bytes[MAX_STAGES][TF_ALLOC_SOURCE_COUNT];        ///< Bytes allocated per stage.
+   std::atomic<long long> totalCount;                                      ///< All allocations.
+   std::atomic<long long> totalBytes;                                      ///< All bytes allocated.
+   std::string names[MAX_STAGES];                                          ///< The names of the stages.
+   int stageCount;                                                         ///< The number of stages named.
+
+   /// SQLite's original allocator.
+   static ::sqlite3_mem_methods &sqliteMethods(void)
+   {
+      static ::sqlite3_mem_methods methods;
+      return methods;
+   }
+
+   /// The instance the SQLite shim reports to.
+   static TFAllocations *&sqliteTracker(void)
+   {
+      static TFAllocations *tracker = NULL;
+      return tracker;
+   }
+
+   static void *sqliteMalloc(int size)
+   {
+      void *memory = sqliteMethods().xMalloc(size);
+      if (memory) {
+         sqliteTracker()->record(TF_ALLOC_SQLITE, size);
+      }
+      return memory;
+   }
+
+   static void *sqliteRealloc(void *memory, int size)
+   {
+      // Only the growth is new memory, the old block was counted before.
+      int oldSize = memory ? sqliteMethods().xSize(memory) : 0;
+      void *result = sqliteMethods().xRealloc(memory, size);
+      if (result && size > oldSize) {
+         sqliteTracker()->record(TF_ALLOC_SQLITE, size - oldSize);
+      }
+      return result;
+   }
+
+public:
+   /**
+    * Constructor.
+    *
+    * Stage 0 collects everything allocated outside a named stage.
+    */
+   TFAllocations()
+   {
+      names[0] = "other";
+      stageCount = 1;
+   }
+
+   /**
+    * Switches counting on or off.
+    *
+    * @param on   Flag whether to count.
+    */
+   void enable(bool on) { enabled.store(on, std::memory_order_relaxed); }
+
+   /**
+    * Checks whether allocations are counted.
+    *
+    * @return @c true if counting.
+    */
+   bool isEnabled(void) const { return enabled.load(std::memory_order_relaxed); }
+
+   /**
+    * Counts one allocation for the current stage.
+    *
+    * @param source  Where the allocation came from.
+    * @param size    The number of bytes allocated.
+    */
+   void record(TFAllocSource source, size_t size)
+   {
+      if (!enabled.load(std::memory_order_relaxed)) {
+         return;
+      }
+
+      int stage = current.load(std::memory_order_relaxed);
+      counts[stage][source].fetch_add(1, std::memory_order_relaxed);
+      bytes[stage][source].fetch_add(size, std::memory_order_relaxed);
+      totalCount.fetch_add(1, std::memory_order_relaxed);
+      totalBytes.fetch_add(size, std::memory_order_relaxed);
+   }
+
+   /**
+    * Forgets all counts, the current stage stays.
+    *
+    * Does not lock, so it is safe to call in a child process after fork().
+    */
+   void reset(void)
+   {
+      for (int stage = 0; stage < MAX_STAGES; ++stage) {
+         for (int source = 0; source < TF_ALLOC_SOURCE_COUNT; ++source) {
+            counts[stage][source] = 0;
+            bytes[stage][source] = 0;
+         }
+      }
+      totalCount = 0;
+      totalBytes = 0;
+   }
+
+   /**
+    * Finds the index of a stage, adding it if it is new.
+    *
+    * @param name The name of the stage ("": outside any stage).
+    * @return The index of the stage, 0 if there are too many stages.
+    */
+   int stageIndex(const std::string &name)
+   {
+      if (name == "") {
+         return 0;
+      }
+      for (int stage = 0; stage < stageCount; ++stage) {
+         if (names[stage] == name) {
+            return stage;
+         }
+      }
+      if (stageCount == MAX_STAGES) {
+         return 0;
+      }
+      names[stageCount] = name;
+      return stageCount++;
+   }
+
+   /**
+    * Marks the start of a new stage, ending the current one.
+    *
+    * @param name The name of the stage ("" to end the current stage only).
+    */
+   void stage(const std::string &name)
+   {
+      int index = stageIndex(name);
+      current.store(index, std::memory_order_relaxed);
+   }
+
+   /**
+    * Adds counts collected elsewhere, e.g. by a shard worker.
+    *
+    * @param stage   The index of the stage.
+    * @param source  Where the allocations came from.
+    * @param count   The number of allocations.
+    * @param size    The number of bytes allocated.
+    */
+   void add(int stage, TFAllocSource source, long long count, long long size)
+   {
+      counts[stage][source].fetch_add(count, std::memory_order_relaxed);
+      bytes[stage][source].fetch_add(size, std::memory_order_relaxed);
+      totalCount.fetch_add(count, std::memory_order_relaxed);
+      totalBytes.fetch_add(size, std::memory_order_relaxed);
+   }
+
+   /**
+    * The number of stages named so far (including "other").
+    *
+    * @return The number of stages.
+    */
+   int stages(void) const { return stageCount; }
+
+   /**
+    * The name of a stage.
+    *
+    * @param stage The index of the stage.
+    * @return The name.
+    */
+   const std::string &stageName(int stage) const { return names[stage]; }
+
+   /**
+    * The number of allocations of a stage.
+    *
+    * @param stage   The index of the stage.
+    * @param source  Where the allocations came from.
+    * @return The number of allocations.
+    */
+   long long countOf(int stage, TFAllocSource source) const { return counts[stage][source].load(std::memory_order_relaxed); }
+
+   /**
+    * The bytes allocated in a stage.
+    *
+    * @param stage   The index of the stage.
+    * @param source  Where the allocations came from.
+    * @return The number of bytes.
+    */
+   long long bytesOf(int stage, TFAllocSource source) const { return bytes[stage][source].load(std::memory_order_relaxed); }
+
+   /**
+    * The number of allocations so far, from all stages and sources.
+    *
+    * @return The number of allocations.
+    */
+   long long count(void) const { return totalCount.load(std::memory_order_relaxed); }
+
+   /**
+    * The bytes allocated so far, from all stages and sources.
+    *
+    * @return The number of bytes.
+    */
+   long long size(void) const { return totalBytes.load(std::memory_order_relaxed); }
+
+   /**
+    * Installs a shim around SQLite's allocator that reports to this object.
+    *
+    * Must be called before SQLite is used for the first time.
+    *
+    * @return @c true on success, @c false if SQLite was already initialised.
+    */
+   bool installSQLiteHooks(void)
+   {
+      if (SQLITE_OK != ::sqlite3_config(SQLITE_CONFIG_GETMALLOC, &sqliteMethods())) {
+         return false;
+      }
+
+      ::sqlite3_mem_methods methods = sqliteMethods();
+      methods.xMalloc = sqliteMalloc;
+      methods.xRealloc = sqliteRealloc;
+      sqliteTracker() = this;
+      return SQLITE_OK == ::sqlite3_config(SQLITE_CONFIG_MALLOC, &methods);
+   }
+
+};
+
+#endif
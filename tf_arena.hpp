@@ -0,0 +1,164 @@
+#ifndef __TF_ARENA__
+#define __TF_ARENA__
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/**
+ * A monotonic arena for data that lives for one image only.
+ *
+ * Memory is handed out from one buffer by bumping an offset and is never
+ * freed individually; reset() makes all of it available again in O(1).
+ * Requests that do not fit into the buffer go to malloc(). On the next
+ * reset() the buffer is enlarged by what overflowed, so after the first few
+ * images the arena does not call malloc() anymore.
+ */
+class TFArena
+{
+protected:
+   char *buffer;                    ///< The buffer memory is taken from.
+   size_t capacity;                 ///< The size of the buffer.
+   size_t used;                     ///< The bytes of the buffer handed out.
+   std::vector<void *> overflow;    ///< Blocks that did not fit into the buffer.
+   size_t overflowBytes;            ///< The size of these blocks.
+
+public:
+   /**
+    * Constructor.
+    *
+    * @param initialSize   The size of the buffer to start with.
+    */
+   TFArena(size_t initialSize = 16384)
+   : buffer(NULL), capacity(0), used(0), overflowBytes(0)
+   {
+      buffer = (char *) ::malloc(initialSize);
+      capacity = buffer ? initialSize : 0;
+      overflow.reserve(16);
+   }
+
+   /**
+    * Destructor.
+    */
+   ~TFArena()
+   {
+      release();
+      ::free(buffer);
+   }
+
+   /**
+    * Hands out memory.
+    *
+    * @param size       The number of bytes needed.
+    * @param alignment  The alignment needed (a power of two).
+    * @return The memory.
+    * @throws std::bad_alloc if there is no memory left.
+    */
+   void *allocate(size_t size, size_t alignment)
+   {
+      size_t offset = (used + alignment - 1) & ~(alignment - 1);
+      if (offset + size <= capacity) {
+         used = offset + size;
+         return buffer + offset;
+      }
+
+      void *memory = ::malloc(size ? size : 1);
+      if (!memory) {
+         throw std::bad_alloc();
+      }
+      overflow.push_back(memory);
+      overflowBytes += size + alignment;
+      return memory;
+   }
+
+   /**
+    * Makes all memory handed out available again.
+    *
+    * Nothing allocated from the arena may be used afterwards.
+    */
+   void reset(void)
+   {
+      if (overflowBytes > 0) {
+         release();
+         size_t grown = capacity + overflowBytes;
+         char *larger = (char *) ::realloc(buffer, grown);
+         if (larger) {
+            buffer = larger;
+            capacity = grown;
+         }
+      }
+      used = 0;
+   }
+
+   /**
+    * The size of the buffer.
+    *
+    * @return The size in bytes.
+    */
+   size_t size(void) const { return capacity; }
+
+protected:
+   /**
+    * Frees the blocks that did not fit into the buffer.
+    */
+   void release(void)
+   {
+      for (void *memory : overflow) {
+         ::free(memory);
+      }
+      overflow.clear();
+      overflowBytes = 0;
+   }
+};
+
+/**
+ * An allocator for standard containers that takes its memory from a
+ * TFArena. Deallocation does nothing, the arena frees everything at once.
+ */
+template <typename T>
+class TFArenaAllocator
+{
+public:
+   typedef T value_type;
+
+   TFArena *arena;      ///< The arena memory comes from.
+
+   /**
+    * Constructor.
+    *
+    * @param from The arena to take memory from.
+    */
+   TFArenaAllocator(TFArena &from)
+   : arena(&from)
+   {
+   }
+
+   /**
+    * Converting constructor, used by containers to allocate their nodes.
+    *
+    * @param other   The allocator to copy the arena from.
+    */
+   template <typename U>
+   TFArenaAllocator(const TFArenaAllocator<U> &other)
+   : arena(other.arena)
+   {
+   }
+
+   T *allocate(size_t n)
+   {
+      return (T *) arena->allocate(n * sizeof(T), alignof(T));
+   }
+
+   void deallocate(T *, size_t)
+   {
+   }
+
+   template <typename U>
+   bool operator==(const TFArenaAllocator<U> &other) const { return arena == other.arena; }
+
+   template <typename U>
+   bool operator!=(const TFArenaAllocator<U> &other) const { return arena != other.arena; }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef __TF_ESTIMATE__
+#define __TF_ESTIMATE__
+
+#include <algorithm>
+
+/// What a transfer run would do, as counted by a dry run.
+typedef struct {
+   long long images;             ///< Lightroom images looked at.
+   long long matched;            ///< Images found in Aperture.
+   long long imagesWithFaces;    ///< Images that get faces.
+   long long faces;              ///< Faces to create.
+   long long namedFaces;         ///< Faces with a name (they get a keyword).
+   long long oldFaces;           ///< Faces of Lightroom to remove first.
+   long long keywords;           ///< Keywords to create (people and tags).
+   long long links;              ///< Keywords to assign to images.
+   long long stacks;             ///< Stacks to create.
+   long long stackedImages;      ///< Images in these stacks.
+   long long gpsUpdates;         ///< Images whose GPS location is rewritten.
+   long long xmpBytes;           ///< Bytes of XMP rewritten for them.
+   long long cooccurrences;      ///< Distinct keyword pairs of the co-occurrence table.
+   long long cooccurrenceWrites; ///< Keyword pairs written, once per image they are on.
+   long long collections;        ///< Collections to create, their set included.
+   long long collectionImages;   ///< Images to add to these collections.
+   long long ratings;            ///< Ratings found in Aperture, staged in a temporary table.
+   long long ratingUpdates;      ///< Images whose rating, pick flag or color label changes.
+   long long clearedRows;        ///< Rows of keywords, stacks and collections removed up front.
+} tfestimatecounts;
+
+/**
+ * Turns the counts of a dry run into the time, row writes and journal size
+ * of the real run.
+ *
+ * The dry run does all reads of the real run, so their time is measured
+ * rather than estimated; only the writes are priced. The costs per write
+ * were measured with -L and -I on a catalog of about 30000 images on an SSD,
+ * the time of commit() included. Slower storage makes the real run slower.
+ */
+class TFEstimate
+{
+public:
+   // Microseconds per operation.
+   static constexpr double COST_CLEARED_ROW = 1.5;     ///< Removing a row with a bulk DELETE.
+   static constexpr double COST_OLD_FACE = 12.0;       ///< Removing a face and its data.
+   static constexpr double COST_FACE = 45.0;           ///< Creating a face, its cluster and data.
+   static constexpr double COST_KEYWORD = 30.0;        ///< Creating a keyword.
+   static constexpr double COST_LINK = 35.0;           ///< Assigning a keyword, popularity included.
+   static constexpr double COST_STACK = 20.0;          ///< Creating a stack.
+   static constexpr double COST_STACKED_IMAGE = 10.0;  ///< Adding an image to a stack.
+   static constexpr double COST_GPS = 60.0;            ///< Rewriting a location and its XMP.
+   static constexpr double COST_XMP_BYTE = 0.02;       ///< Parsing and writing a byte of XMP.
+   static constexpr double COST_COOCCURRENCE = 15.0;   ///< Writing a co-occurrence pair.
+   static constexpr double COST_COLLECTION = 25.0;     ///< Creating a collection.
+   static constexpr double COST_COLLECTED_IMAGE = 5.0; ///< Adding an image to a collection.
+   static constexpr double COST_STAGED_RATING = 2.0;   ///< Staging a rating, in memory.
+   static constexpr double COST_RATING = 15.0;         ///< Rewriting the rating of an image.
+   static constexpr double COST_JOURNAL_PAGE = 8.0;    ///< Writing a page to the journal.
+
+   static const int ROW_BYTES = 64;   ///< Average size of a row written, indices included.
+
+   tfestimatecounts counts;           ///< What the run would do.
+
+   /**
+    * Constructor.
+    */
+   TFEstimate()
+   {
+      counts = tfestimatecounts();
+   }
+
+   /**
+    * The rows the run inserts.
+    *
+    * @return The number of rows.
+    */
+   long long insertedRows(void) const
+   {
+      // Cluster, face, face data and face history, plus the keyword of the
+      // face for named faces. A link is the assignment and its popularity.
+      return counts.faces * 4 + counts.namedFaces + counts.keywords + counts.links * 2 +
+             counts.stacks + counts.stackedImages + counts.cooccurrences +
+             counts.collections + counts.collectionImages;
+   }
+
+   /**
+    * The rows the run updates in place.
+    *
+    * @return The number of rows.
+    */
+   long long updatedRows(void) const
+   {
+      // The popularity increment per link, the EXIF and XMP rows per location,
+      // the count of a co-occurrence pair on each image after its first, the
+      // image per changed rating.
+      return counts.links + counts.gpsUpdates * 2 + (counts.cooccurrenceWrites - counts.cooccurrences) +
+             counts.ratingUpdates;
+   }
+
+   /**
+    * The rows the run deletes.
+    *
+    * @return The number of rows.
+    */
+   long long deletedRows(void) const
+   {
+      // Face, cluster and face data per old face, the history per image.
+      return counts.clearedRows + counts.oldFaces * 3 + counts.imagesWithFaces;
+   }
+
+   /**
+    * The size of the journal the run leaves until its commit.
+    *
+    * A rollback journal keeps the original of every page changed, each page
+    * once and at most all of the catalog; a write-ahead log also gets the
+    * pages the catalog grows by. Rows inserted and removed in bulk are
+    * packed into pages, rows updated in place are scattered, one page each.
+    *
+    * @param pageSize     The page size of the catalog.
+    * @param pageCount    The pages of the catalog.
+    * @param wal          Flag whether the catalog is in WAL mode.
+    * @return The size in bytes.
+    */
+   long long journalBytes(long long pageSize, long long pageCount, bool wal) const
+   {
+      if (pageSize <= 0) {
+         return 0;
+      }
+
+      long long rowsPerPage = std::max(1LL, pageSize / ROW_BYTES);
+      long long changed = deletedRows() / rowsPerPage + updatedRows() + counts.xmpBytes / pageSize;
+      long long added = insertedRows() / rowsPerPage;
+      long long pages = std::min(changed, pageCount);
+      if (wal) {
+         pages += added;
+      }
+      // Plus the header of the journal.
+      return (pages + 1) * pageSize;
+   }
+
+   /**
+    * The predicted wall time of the run.
+    *
+    * @param readSeconds   The time the dry run took for its reads.
+    * @param journal       The size of the journal in bytes.
+    * @param pageSize      The page size of the catalog.
+    * @return The time in seconds.
+    */
+   double seconds(double readSeconds, long long journal, long long pageSize) const
+   {
+      double micros = counts.clearedRows * COST_CLEARED_ROW +
+                      counts.oldFaces * COST_OLD_FACE +
+                      counts.faces * COST_FACE +
+                      counts.keywords * COST_KEYWORD +
+                      counts.links * COST_LINK +
+                      counts.stacks * COST_STACK +
+                      counts.stackedImages * COST_STACKED_IMAGE +
+                      counts.gpsUpdates * COST_GPS +
+                      counts.xmpBytes * COST_XMP_BYTE +
+                      counts.cooccurrenceWrites * COST_COOCCURRENCE +
+                      counts.collections * COST_COLLECTION +
+                      counts.collectionImages * COST_COLLECTED_IMAGE +
+                      counts.ratings * COST_STAGED_RATING +
+                      counts.ratingUpdates * COST_RATING;
+      if (pageSize > 0) {
+         micros += (journal / pageSize) * COST_JOURNAL_PAGE;
+      }
+      return readSeconds + micros / 1e6;
+   }
+};
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef __TF_HISTOGRAM__
+#define __TF_HISTOGRAM__
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/**
+ * A histogram of durations (or any other non-negative values) with
+ * logarithmic buckets, in the spirit of HdrHistogram.
+ *
+ * Each power of two is split into 16 linear sub-buckets, so every recorded
+ * value is known with a relative error below 1/16 while the histogram covers
+ * the whole 64 bit range with less than 1000 counters.
+ */
+class TFHistogram
+{
+public:
+   static const int SUB_BUCKET_BITS = 4;                       ///< log2 of the sub-buckets per power of two.
+   static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;        ///< Sub-buckets per power of two.
+   static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;   ///< Number of buckets.
+
+protected:
+   std::vector<long long> counts;   ///< The number of values per bucket.
+   long long total;                 ///< The number of values recorded.
+   unsigned long long maximum;      ///< The largest value recorded.
+   double sum;                      ///< The sum of all values recorded.
+
+public:
+   /**
+    * Constructor.
+    */
+   TFHistogram()
+   : counts(BUCKETS, 0), total(0), maximum(0), sum(0)
+   {
+   }
+
+   /**
+    * Finds the bucket a value belongs to.
+    *
+    * @param value   The value.
+    * @return The index of the bucket.
+    */
+   static int bucketOf(unsigned long long value)
+   {
+      if (value < SUB_BUCKETS) {
+         return (int) value;
+      }
+
+      int exponent = 63 - __builtin_clzll(value);
+      int shift = exponent - SUB_BUCKET_BITS;
+      return (shift + 1) * SUB_BUCKETS + (int) ((value >> shift) - SUB_BUCKETS);
+   }
+
+   /**
+    * The smallest value that belongs to a bucket.
+    *
+    * @param bucket  The index of the bucket.
+    * @return The lowest value of the bucket.
+    */
+   static unsigned long long lowestOf(int bucket)
+   {
+      if (bucket < SUB_BUCKETS) {
+         return bucket;
+      }
+
+      int shift = bucket / SUB_BUCKETS - 1;
+      return ((unsigned long long) (SUB_BUCKETS + bucket % SUB_BUCKETS)) << shift;
+   }
+
+   /**
+    * The largest value that belongs to a bucket.
+    *
+    * @param bucket  The index of the bucket.
+    * @return The highest value of the bucket.
+    */
+   static unsigned long long highestOf(int bucket)
+   {
+      if (bucket < SUB_BUCKETS) {
+         return bucket;
+      }
+
+      int shift = bucket / SUB_BUCKETS - 1;
+      return lowestOf(bucket) + (1ULL << shift) - 1;
+   }
+
+   /**
+    * Records a value.
+    *
+    * @param value   The value to record.
+    */
+   void record(unsigned long long value)
+   {
+      counts[bucketOf(value)]++;
+      total++;
+      sum += value;
+      maximum = std::max(maximum, value);
+   }
+
+   /**
+    * Adds the values of a bucket, e.g. when merging histograms.
+    *
+    * @param bucket  The index of the bucket.
+    * @param count   The number of values in the bucket.
+    */
+   void add(int bucket, long long count)
+   {
+      if (bucket < 0 || bucket >= BUCKETS || count <= 0) {
+         return;
+      }
+
+      counts[bucket] += count;
+      total += count;
+      sum += (double) (lowestOf(bucket) + highestOf(bucket)) / 2 * count;
+      maximum = std::max(maximum, highestOf(bucket));
+   }
+
+   /**
+    * The number of values in a bucket.
+    *
+    * @param bucket  The index of the bucket.
+    * @return The number of values.
+    */
+   long long countOf(int bucket) const { return counts[bucket]; }
+
+   /**
+    * The number of values recorded.
+    *
+    * @return The number of values.
+    */
+   long long count(void) const { return total; }
+
+   /**
+    * The largest value recorded.
+    *
+    * @return The largest value.
+    */
+   unsigned long long max(void) const { return maximum; }
+
+   /**
+    * The mean of all values recorded.
+    *
+    * @return The mean, 0 if nothing was recorded.
+    */
+   double mean(void) const { return total ? sum / total : 0; }
+
+   /**
+    * Finds the value below which the given share of all values lies.
+    *
+    * @param percentile The percentile (0-100).
+    * @return The highest value of the bucket the percentile falls into
+    *         (but never more than the largest value recorded).
+    */
+   unsigned long long percentile(double percentile) const
+   {
+      long long wanted = (long long) (percentile / 100.0 * total + 0.5);
+      wanted = std::max(wanted, 1LL);
+
+      long long seen = 0;
+      for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+         seen += counts[bucket];
+         if (seen >= wanted) {
+            return std::min(highestOf(bucket), maximum);
+         }
+      }
+
+      return maximum;
+   }
+};
+
+/**
+ * Keeps the N entries with the largest values seen so far.
+ */
+template <typename T>
+class TFSlowest
+{
+protected:
+   size_t size;                                       ///< The number of entries to keep.
+   std::vector<std::pair<unsigned long long, T>> entries;   ///< Min-heap of the entries.
+
+   static bool greater(const std::pair<unsigned long long, T> &a,
+                       const std::pair<unsigned long long, T> &b)
+   {
+      return a.first > b.first;
+   }
+
+public:
+   /**
+    * Constructor.
+    *
+    * @param n The number of entries to keep.
+    */
+   TFSlowest(size_t n = 0)
+   : size(n)
+   {
+   }
+
+   /**
+    * Changes the number of entries to keep and forgets all entries.
+    *
+    * @param n The number of entries to keep.
+    */
+   void reset(size_t n)
+   {
+      size = n;
+      entries.clear();
+   }
+
+   /**
+    * Checks whether an entry with the given value would be kept. Use this to
+    * avoid building entries that are thrown away anyway.
+    *
+    * @param value The value.
+    * @return @c true if add() would keep the entry.
+    */
+   bool qualifies(unsigned long long value) const
+   {
+      return entries.size() < size || (size > 0 && value > entries.front().first);
+   }
+
+   /**
+    * Adds an entry, if it is among the N largest.
+    *
+    * @param value The value.
+    * @param entry The entry.
+    */
+   void add(unsigned long long value, const T &entry)
+   {
+      if (!qualifies(value)) {
+         return;
+      }
+
+      entries.push_back(std::make_pair(value, entry));
+      std::push_heap(entries.begin(), entries.end(), greater);
+      if (entries.size() > size) {
+         std::pop_heap(entries.begin(), entries.end(), greater);
+         entries.pop_back();
+      }
+   }
+
+   /**
+    * The entries kept, largest value first.
+    *
+    * @return The entries.
+    */
+   std::vector<std::pair<unsigned long long, T>> sorted(void) const
+   {
+      std::vector<std::pair<unsigned long long, T>> result(entries);
+      std::sort(result.begin(), result.end(), greater);
+      return result;
+   }
+};
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef __TF_INTERN__
+#define __TF_INTERN__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+
+/**
+ * A pool of interned strings: each distinct string is stored once and is
+ * known by a 32 bit handle.
+ *
+ * The strings live in one contiguous region of address space, reserved up
+ * front and filled from the start, so they never move and reading a string
+ * by its handle needs no lock. Each is stored as its length, its hash, the
+ * bytes and a NUL, 4 byte aligned; the handle is its offset / 4. Handle 0 is
+ * the empty string. An open addressing hash table of handles finds strings
+ * already in the pool; only intern() locks.
+ *
+ * Nothing is ever removed, so only strings that repeat belong here (names
+ * of people and keywords, stack UUIDs), not ones unique per image. When the
+ * region is full, new strings become the empty string and isExhausted()
+ * tells; the run has to check it before it keeps its results.
+ */
+class TFStringPool
+{
+public:
+   static const size_t RESERVED = (size_t) 1 << 32;   ///< Address space taken (4 GB, handles could address 16 GB).
+
+protected:
+   /// What precedes the bytes of a string.
+   struct entry
+   {
+      uint32_t length;
+      uint32_t hash;
+   };
+
+   char *base;                      ///< The start of the region.
+   size_t used;                     ///< Bytes of the region in use.
+   size_t reserved;                 ///< Bytes of the region.
+   std::vector<uint32_t> index;     ///< Handles by hash, 0: free (a power of two).
+   size_t count;                    ///< Strings in the pool (without the empty one).
+   std::mutex mutex;                ///< Protects everything above but base.
+   std::atomic<bool> exhausted;     ///< Flag whether a string did not fit anymore.
+
+   static uint32_t hashOf(const char *text, size_t length)
+   {
+      // FNV-1a
+      uint32_t hash = 2166136261u;
+      for (size_t i = 0; i < length; ++i) {
+         hash = (hash ^ (unsigned char) text[i]) * 16777619u;
+      }
+      return hash;
+   }
+
+   const entry &entryOf(uint32_t handle) const
+   {
+      return *(const entry *) (base + (size_t) handle * 4);
+   }
+
+   /**
+    * Doubles the hash table. The lock must be held.
+    */
+   void grow(void)
+   {
+      std::vector<uint32_t> larger(index.size() * 2, 0);
+      for (uint32_t handle : index) {
+         if (handle) {
+            size_t slot = entryOf(handle).hash & (larger.size() - 1);
+            while (larger[slot]) {
+               slot = (slot + 1) & (larger.size() - 1);
+            }
+            larger[slot] = handle;
+         }
+      }
+      index.swap(larger);
+   }
+
+public:
+   /**
+    * Constructor.
+    *
+    * @param size   The address space to reserve; pages are only used once
+    *               strings are stored in them.
+    */
+   TFStringPool(size_t size = RESERVED)
+   : base(NULL), used(0), reserved(0), index(4096, 0), count(0), exhausted(false)
+   {
+      void *region = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+      if (region != MAP_FAILED) {
+         base = (char *) region;
+         reserved = size;
+         // The empty string.
+         entry *empty = (entry *) base;
+         empty->length = 0;
+         empty->hash = hashOf("", 0);
+         used = sizeof(entry) + 4;
+      }
+   }
+
+   /**
+    * Destructor.
+    */
+   ~TFStringPool()
+   {
+      if (base) {
+         ::munmap(base, reserved);
+      }
+   }
+
+   /**
+    * The pool used by TFString.
+    *
+    * @return The pool.
+    */
+   static TFStringPool &global(void)
+   {
+      static TFStringPool pool;
+      return pool;
+   }
+
+   /**
+    * Finds or adds a string.
+    *
+    * @param text     The bytes of the string.
+    * @param length   The number of bytes.
+    * @return The handle of the string, 0 (the empty string) if the reserved
+    *         address space is used up, see isExhausted().
+    */
+   uint32_t intern(const char *text, size_t length)
+   {
+      if (length == 0) {
+         return 0;
+      }
+      uint32_t hash = hashOf(text, length);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      size_t slot = hash & (index.size() - 1);
+      while (index[slot]) {
+         const entry &e = entryOf(index[slot]);
+         if (e.hash == hash && e.length == length && 0 == ::memcmp(&e + 1, text, length)) {
+            return index[slot];
+         }
+         slot = (slot + 1) & (index.size() - 1);
+      }
+
+      size_t size = (sizeof(entry) + length + 1 + 3) & ~(size_t) 3;
+      if (!base || used + size > reserved) {
+         exhausted.store(true, std::memory_order_relaxed);
+         return 0;
+      }
+      entry *e = (entry *) (base + used);
+      e->length = (uint32_t) length;
+      e->hash = hash;
+      ::memcpy(e + 1, text, length);
+      ((char *) (e + 1))[length] = '\0';
+      uint32_t handle = (uint32_t) (used / 4);
+      used += size;
+
+      index[slot] = handle;
+      if (++count * 2 > index.size()) {
+         grow();
+      }
+      return handle;
+   }
+
+   /**
+    * Checks whether a string could not be added since the pool was created.
+    *
+    * @return @c true if strings were lost, @c false else.
+    */
+   bool isExhausted(void) const { return exhausted.load(std::memory_order_relaxed); }
+
+   /**
+    * The bytes of a string, followed by a NUL.
+    *
+    * @param handle  The handle of the string.
+    * @return The bytes.
+    */
+   const char *c_str(uint32_t handle) const
+   {
+      return base ? (const char *) (&entryOf(handle) + 1) : "";
+   }
+
+   /**
+    * The length of a string.
+    *
+    * @param handle  The handle of the string.
+    * @return The number of bytes.
+    */
+   size_t length(uint32_t handle) const
+   {
+      return base ? entryOf(handle).length : 0;
+   }
+
+   /**
+    * The number of distinct strings.
+    *
+    * @return The number of strings.
+    */
+   size_t size(void)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return count;
+   }
+
+   /**
+    * The bytes used for the strings.
+    *
+    * @return The number of bytes.
+    */
+   size_t bytes(void)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return used;
+   }
+
+   /**
+    * To be called in the child after fork().
+    */
+   void afterFork(void)
+   {
+      new (&mutex) std::mutex();
+   }
+};
+
+/**
+ * A string of the global TFStringPool: 4 bytes, copied and compared for
+ * equality as an integer.
+ *
+ * Ordering compares the bytes like std::string does, so maps keyed by
+ * TFString are iterated in the same order as with std::string keys.
+ */
+class TFString
+{
+protected:
+   uint32_t id;                     ///< The handle in the pool.
+
+public:
+   /**
+    * Constructor for the empty string.
+    */
+   TFString() : id(0) {}
+
+   /**
+    * Constructor, interns the string.
+    *
+    * @param text    The string.
+    */
+   explicit TFString(const std::string &text)
+   : id(TFStringPool::global().intern(text.data(), text.size()))
+   {
+   }
+
+   /**
+    * Constructor, interns the string.
+    *
+    * @param text    The bytes of the string.
+    * @param length  The number of bytes.
+    */
+   TFString(const char *text, size_t length)
+   : id(TFStringPool::global().intern(text, length))
+   {
+   }
+
+   uint32_t handle(void) const { return id; }
+   const char *c_str(void) const { return TFStringPool::global().c_str(id); }
+   size_t size(void) const { return TFStringPool::global().length(id); }
+   bool empty(void) const { return id == 0; }
+   std::string str(void) const { return std::string(c_str(), size()); }
+
+   bool operator==(const TFString &other) const { return id == other.id; }
+   bool operator!=(const TFString &other) const { return id != other.id; }
+   bool operator<(const TFString &other) const
+   {
+      if (id == other.id) {
+         return false;
+      }
+      size_t length = size();
+      size_t otherLength = other.size();
+      int result = ::memcmp(c_str(), other.c_str(), length < otherLength ? length : otherLength);
+      return result < 0 || (result == 0 && length < otherLength);
+   }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const TFString &string)
+{
+   return out.write(string.c_str(), string.size());
+}
+
+namespace std {
+   /// Hashes the handle, equal strings have equal handles.
+   template <>
+   struct hash<TFString>
+   {
+      size_t operator()(const TFString &string) const
+      {
+         return std::hash<uint32_t>()(string.handle());
+      }
+   };
+}
+
+#endif
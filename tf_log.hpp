@@ -0,0 +1,386 @@
+#ifndef __TF_LOG__
+#define __TF_LOG__
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+
+/// How much a run prints.
+enum TFLogLevel
+{
+   TF_LOG_QUIET,        ///< Errors and warnings only.
+   TF_LOG_SUMMARY,      ///< Stages and statistics.
+   TF_LOG_DETAIL        ///< A line per image, keyword and stack.
+};
+
+class TFLog;
+
+/**
+ * One message under construction. Collects everything streamed into it and
+ * hands it to the log when it goes out of scope, so a message built by
+ * several statements stays in one piece.
+ *
+ * Messages of a level the log does not print are never formatted.
+ */
+class TFLogLine
+{
+protected:
+   TFLog *log;                                  ///< The log to hand the message to (NULL: drop).
+   int stream;                                  ///< 0: standard output, 1: standard error.
+   std::unique_ptr<std::ostringstream> text;    ///< The message, created on first use.
+
+public:
+   /**
+    * Constructor.
+    *
+    * @param to      The log to write to, NULL to drop the message.
+    * @param target  0 for standard output, 1 for standard error.
+    */
+   TFLogLine(TFLog *to, int target)
+   : log(to), stream(target)
+   {
+   }
+
+   TFLogLine(TFLogLine &&other)
+   : log(other.log), stream(other.stream), text(std::move(other.text))
+   {
+      other.log = NULL;
+   }
+
+   /**
+    * Destructor.
+    *
+    * Hands the message to the log.
+    */
+   inline ~TFLogLine();
+
+   template <typename T>
+   TFLogLine &operator<<(const T &value)
+   {
+      if (log) {
+         if (!text) {
+            text.reset(new std::ostringstream());
+         }
+         *text << value;
+      }
+      return *this;
+   }
+
+   TFLogLine &operator<<(std::ostream &(*manipulator)(std::ostream &))
+   {
+      if (log) {
+         if (!text) {
+            text.reset(new std::ostringstream());
+         }
+         // std::endl only adds a newline here, the log decides when to flush.
+         manipulator(*text);
+      }
+      return *this;
+   }
+};
+
+/**
+ * The output of transferFaces.
+ *
+ * Messages go into a lock-free ring (a bounded multi-producer queue in the
+ * style of Dmitry Vyukov's) and a flusher thread writes them in batches, so
+ * printing a line never costs a system call nor waits for a slow terminal.
+ * When the ring is full, the producer waits for the flusher.
+ *
+ * As long as the flusher does not run (before start(), after stop() and in
+ * children after fork()), messages are written to the stream buffers right
+ * away, still without flushing them per line.
+ */
+class TFLog
+{
+public:
+   static const size_t CAPACITY = 4096;     ///< Messages the ring holds (a power of two).
+
+protected:
+   /// One entry of the ring.
+   typedef struct {
+      std::atomic<size_t> sequence;    ///< Tells producers and consumer whose turn it is.
+      int stream;                      ///< 0: standard output, 1: standard error.
+      std::string text;                ///< The message.
+   } slot;
+
+   std::unique_ptr<slot[]> slots;      ///< The ring.
+   std::atomic<size_t> enqueuePos;     ///< Next slot to write to.
+   size_t dequeuePos;                  ///< Next slot to read from (flusher only).
+   std::atomic<size_t> written;        ///< Messages written by the flusher.
+
+   std::atomic<int> level;             ///< The level of messages printed.
+   std::atomic<bool> running;          ///< Flag whether the flusher runs.
+   std::atomic<bool> stopping;         ///< Flag to stop the flusher.
+   std::thread flusher;                ///< Writes the messages.
+
+   std::mutex sinkMutex;               ///< Protects the stream buffers.
+   std::streambuf *sinks[2];           ///< Where standard output and error go.
+   int lastStream;                     ///< The stream written to last.
+
+   /**
+    * Writes a message to its stream buffer.
+    *
+    * When the stream changes, the other one is flushed first, so output and
+    * errors keep their order when both go to the same file.
+    *
+    * Must be called with sinkMutex held.
+    */
+   void write(int stream, const std::string &text)
+   {
+      if (stream != lastStream) {
+         sinks[lastStream]->pubsync();
+         lastStream = stream;
+      }
+      sinks[stream]->sputn(text.data(), text.size());
+   }
+
+   /**
+    * Takes one message from the ring.
+    *
+    * @param stream  Receives the stream of the message.
+    * @param text    Receives the message.
+    * @return @c true if there was a message, @c false if the ring is empty.
+    */
+   bool dequeue(int &stream, std::string &text)
+   {
+      slot &s = slots[dequeuePos & (CAPACITY - 1)];
+      if (s.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+         return false;
+      }
+      stream = s.stream;
+      text.swap(s.text);
+      s.text.clear();
+      s.sequence.store(dequeuePos + CAPACITY, std::memory_order_release);
+      dequeuePos++;
+      return true;
+   }
+
+   /**
+    * Writes all messages in the ring.
+    *
+    * @return The number of messages written.
+    */
+   size_t drain(void)
+   {
+      std::lock_guard<std::mutex> lock(sinkMutex);
+      size_t count = 0;
+      int stream;
+      std::string text;
+      while (dequeue(stream, text)) {
+         write(stream, text);
+         count++;
+      }
+      if (count) {
+         sinks[0]->pubsync();
+         sinks[1]->pubsync();
+         written.fetch_add(count, std::memory_order_release);
+      }
+      return count;
+   }
+
+   /**
+    * The flusher thread.
+    */
+   void flush_loop(void)
+   {
+      for (;;) {
+         if (drain() == 0) {
+            if (stopping.load(std::memory_order_acquire)) {
+               drain();
+               break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+         }
+      }
+   }
+
+public:
+   /**
+    * Constructor.
+    */
+   TFLog()
+   : slots(new slot[CAPACITY]), enqueuePos(0), dequeuePos(0), written(0),
+     level(TF_LOG_DETAIL), running(false), stopping(false)
+   {
+      for (size_t i = 0; i < CAPACITY; ++i) {
+         slots[i].sequence.store(i, std::memory_order_relaxed);
+      }
+      sinks[0] = std::cout.rdbuf();
+      sinks[1] = std::cerr.rdbuf();
+      lastStream = 0;
+   }
+
+   /**
+    * Destructor.
+    *
+    * Writes all pending messages.
+    */
+   ~TFLog()
+   {
+      stop();
+   }
+
+   /**
+    * Sets the level of the messages printed.
+    *
+    * @param printed The level.
+    */
+   void setLevel(TFLogLevel printed) { level.store(printed, std::memory_order_relaxed); }
+
+   /**
+    * Starts a message for standard output.
+    *
+    * @param messageLevel  The level of the message.
+    * @return The message to stream into.
+    */
+   TFLogLine out(TFLogLevel messageLevel)
+   {
+      return TFLogLine(messageLevel <= level.load(std::memory_order_relaxed) ? this : NULL, 0);
+   }
+
+   /**
+    * Starts a message (error or warning) for standard error. These are
+    * printed on every level.
+    *
+    * @return The message to stream into.
+    */
+   TFLogLine err(void)
+   {
+      return TFLogLine(this, 1);
+   }
+
+   /**
+    * Hands a finished message to the log.
+    *
+    * @param stream  0 for standard output, 1 for standard error.
+    * @param text    The message.
+    */
+   void push(int stream, std::string &&text)
+   {
+      if (!running.load(std::memory_order_acquire)) {
+         std::lock_guard<std::mutex> lock(sinkMutex);
+         write(stream, text);
+         return;
+      }
+
+      size_t pos = enqueuePos.load(std::memory_order_relaxed);
+      for (;;) {
+         slot &s = slots[pos & (CAPACITY - 1)];
+         size_t sequence = s.sequence.load(std::memory_order_acquire);
+         if (sequence == pos) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               s.stream = stream;
+               s.text = std::move(text);
+               s.sequence.store(pos + 1, std::memory_order_release);
+               return;
+            }
+         } else if (sequence < pos) {
+            // Full, wait for the flusher.
+            std::this_thread::yield();
+            pos = enqueuePos.load(std::memory_order_relaxed);
+         } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+         }
+      }
+   }
+
+   /**
+    * Starts the flusher thread.
+    */
+   void start(void)
+   {
+      if (running) {
+         return;
+      }
+      stopping = false;
+      running = true;
+      flusher = std::thread(&TFLog::flush_loop, this);
+   }
+
+   /**
+    * Stops the flusher thread and writes all pending messages.
+    */
+   void stop(void)
+   {
+      if (running) {
+         stopping = true;
+         flusher.join();
+         running = false;
+         // Threads that saw the log still running may have queued messages
+         // after the last drain of the flusher, or are about to.
+         while (dequeuePos != enqueuePos.load(std::memory_order_acquire)) {
+            if (drain() == 0) {
+               std::this_thread::yield();
+            }
+         }
+      }
+      std::lock_guard<std::mutex> lock(sinkMutex);
+      sinks[0]->pubsync();
+      sinks[1]->pubsync();
+   }
+
+   /**
+    * Waits until all messages handed to the log so far are written.
+    */
+   void flush(void)
+   {
+      if (running) {
+         size_t target = enqueuePos.load(std::memory_order_acquire);
+         while (written.load(std::memory_order_acquire) < target) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+         }
+      }
+      std::lock_guard<std::mutex> lock(sinkMutex);
+      sinks[0]->pubsync();
+      sinks[1]->pubsync();
+   }
+
+   /**
+    * Sends the output somewhere else, e.g. to a client of the server.
+    * Pending messages are written to the old destination first.
+    *
+    * @param out  Stream buffer for standard output (NULL: std::cout's).
+    * @param err  Stream buffer for standard error (NULL: std::cerr's).
+    */
+   void redirect(std::streambuf *out, std::streambuf *err)
+   {
+      flush();
+      std::lock_guard<std::mutex> lock(sinkMutex);
+      sinks[0] = out ? out : std::cout.rdbuf();
+      sinks[1] = err ? err : std::cerr.rdbuf();
+   }
+
+   /**
+    * To be called in the child after fork(). The flusher does not exist
+    * there, so the child writes its messages itself. Call flush() before
+    * fork(), else pending messages are lost for the child.
+    */
+   void afterFork(void)
+   {
+      // The thread object belongs to the parent; forget it without joining.
+      new (&flusher) std::thread();
+      running = false;
+      enqueuePos = dequeuePos;
+      for (size_t pos = dequeuePos; pos < dequeuePos + CAPACITY; ++pos) {
+         slots[pos & (CAPACITY - 1)].sequence.store(pos, std::memory_order_relaxed);
+         slots[pos & (CAPACITY - 1)].text.clear();
+      }
+      new (&sinkMutex) std::mutex();
+   }
+};
+
+TFLogLine::~TFLogLine()
+{
+   if (log && text) {
+      log->push(stream, text->str());
+   }
+}
+
+#endif
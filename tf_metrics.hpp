@@ -0,0 +1,307 @@
+#ifndef __TF_METRICS__
+#define __TF_METRICS__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <sqlite3.h>
+
+/// The counters maintained by TFMetrics.
+enum TFCounter
+{
+   TF_IMAGES_SCANNED,         ///< Lightroom images looked at.
+   TF_IMAGES_MATCHED,         ///< Lightroom images found in Aperture.
+   TF_IMAGES_WITHOUT_FACES,   ///< Lightroom images without faces in Aperture.
+   TF_FACES_INSERTED,         ///< Faces created in Lightroom.
+   TF_UNKNOWN_FACES,          ///< Faces without a name.
+   TF_KEYWORDS_CREATED,       ///< Keywords created in Lightroom.
+   TF_LINKS_INSERTED,         ///< Keywords assigned to images.
+   TF_STACKS_CREATED,         ///< Stacks created in Lightroom.
+   TF_GPS_REWRITES,           ///< Images whose GPS location was updated.
+   TF_FALLBACK_MATCHES,       ///< Master lookups that fell back to the date only.
+   TF_XMP_BYTES,              ///< Bytes of XMP rewritten.
+   TF_IMAGES_PREFETCHED,      ///< Images whose Aperture data was prefetched in time.
+   TF_COLLECTIONS_CREATED,    ///< Collections created from Aperture albums.
+   TF_COLLECTION_IMAGES,      ///< Images added to these collections.
+   TF_RATINGS_UPDATED,        ///< Images whose rating, flag or label changed.
+   TF_DUPLICATE_FACES,        ///< Duplicate faces of Aperture dropped, per image processed.
+
+   TF_COUNTER_COUNT
+};
+
+/**
+ * Counters and gauges of a transfer run, written in the text format of the
+ * Prometheus node_exporter textfile collector.
+ *
+ * Counters are plain atomics and cheap enough for the per-image code.
+ * Stage durations are measured by calling stage() whenever a new stage of
+ * the transfer begins.
+ */
+class TFMetrics
+{
+protected:
+   std::atomic<long long> counters[TF_COUNTER_COUNT];    ///< The counters.
+
+   std::mutex mutex;                            ///< Protects everything below.
+   std::map<std::string, double> durations;     ///< Seconds spent per stage.
+   std::string currentStage;                    ///< The stage running ("": none).
+   std::chrono::steady_clock::time_point stageStart;  ///< When it started.
+
+   std::thread writer;                          ///< Writes the file periodically.
+   std::condition_variable writerWakeup;        ///< Wakes the writer to stop.
+   bool stopWriting;                            ///< Flag to stop the writer.
+   std::string path;                            ///< The file to write.
+
+   /**
+    * Adds the time spent in the current stage to its duration.
+    *
+    * Must be called with the mutex held.
+    */
+   void closeStage(void)
+   {
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (currentStage != "") {
+         durations[currentStage] += std::chrono::duration<double>(now - stageStart).count();
+      }
+      stageStart = now;
+   }
+
+public:
+   /**
+    * Constructor.
+    */
+   TFMetrics()
+   : stopWriting(false)
+   {
+      resetCounters();
+   }
+
+   /**
+    * Destructor.
+    *
+    * Stops the writer, writing the file one last time.
+    */
+   ~TFMetrics()
+   {
+      stopWriter();
+   }
+
+   /**
+    * Sets all counters to zero.
+    *
+    * Does not lock, so it is safe to call in a child process after fork().
+    */
+   void resetCounters(void)
+   {
+      for (int i = 0; i < TF_COUNTER_COUNT; ++i) {
+         counters[i] = 0;
+      }
+   }
+
+   /**
+    * Sets all counters to zero and forgets the stage durations.
+    */
+   void reset(void)
+   {
+      resetCounters();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      durations.clear();
+      currentStage = "";
+   }
+
+   /**
+    * Increments a counter.
+    *
+    * @param counter The counter to increment.
+    * @param by      The value to add.
+    */
+   void increment(TFCounter counter, long long by = 1)
+   {
+      counters[counter].fetch_add(by, std::memory_order_relaxed);
+   }
+
+   /**
+    * Reads a counter.
+    *
+    * @param counter The counter to read.
+    * @return The current value.
+    */
+   long long value(TFCounter counter)
+   {
+      return counters[counter].load(std::memory_order_relaxed);
+   }
+
+   /**
+    * Marks the start of a new stage, ending the current one.
+    *
+    * @param name The name of the stage ("" to end the current stage only).
+    */
+   void stage(const std::string &name)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      closeStage();
+      currentStage = name;
+   }
+
+   /**
+    * The name of a counter, as used in the textfile.
+    *
+    * @param counter The counter.
+    * @return The name of the metric.
+    */
+   static const char *name(TFCounter counter)
+   {
+      static const char *names[TF_COUNTER_COUNT] = {
+         "transferfaces_images_scanned_total",
+         "transferfaces_images_matched_total",
+         "transferfaces_images_without_faces_total",
+         "transferfaces_faces_inserted_total",
+         "transferfaces_unknown_faces_total",
+         "transferfaces_keywords_created_total",
+         "transferfaces_keyword_links_inserted_total",
+         "transferfaces_stacks_created_total",
+         "transferfaces_gps_rewrites_total",
+         "transferfaces_fallback_matches_total",
+         "transferfaces_xmp_bytes_rewritten_total",
+         "transferfaces_images_prefetched_total",
+         "transferfaces_collections_created_total",
+         "transferfaces_collection_images_inserted_total",
+         "transferfaces_ratings_updated_total",
+         "transferfaces_duplicate_faces_dropped_total"
+      };
+      return names[counter];
+   }
+
+   /**
+    * Formats all metrics in the Prometheus text format.
+    *
+    * @return The text to write.
+    */
+   std::string format(void)
+   {
+      static const char *help[TF_COUNTER_COUNT] = {
+         "Lightroom images scanned.",
+         "Lightroom images found in the Aperture library.",
+         "Lightroom images without faces in Aperture.",
+         "Faces inserted into the Lightroom catalog.",
+         "Faces without a name.",
+         "Keywords created in the Lightroom catalog.",
+         "Keywords assigned to images.",
+         "Stacks created in the Lightroom catalog.",
+         "Images whose GPS location was rewritten.",
+         "Aperture master lookups that had to fall back to the file date only.",
+         "Bytes of XMP metadata rewritten.",
+         "Images whose Aperture data was prefetched before they were processed.",
+         "Collections created from Aperture albums.",
+         "Images added to collections.",
+         "Images whose rating, pick flag or color label was updated.",
+         "Duplicate faces in Aperture that were dropped, counted per Lightroom image processed."
+      };
+
+      std::stringstream out;
+      for (int i = 0; i < TF_COUNTER_COUNT; ++i) {
+         out << "# HELP " << name((TFCounter) i) << " " << help[i] << "\n";
+         out << "# TYPE " << name((TFCounter) i) << " counter\n";
+         out << name((TFCounter) i) << " " << value((TFCounter) i) << "\n";
+      }
+
+      out << "# HELP transferfaces_stage_duration_seconds Time spent in each stage of the transfer.\n";
+      out << "# TYPE transferfaces_stage_duration_seconds gauge\n";
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         closeStage();
+         for (const std::pair<const std::string, double> &duration : durations) {
+            out << "transferfaces_stage_duration_seconds{stage=\"" << duration.first << "\"} " << duration.second << "\n";
+         }
+      }
+
+      out << "# HELP transferfaces_sqlite_memory_highwater_bytes Maximum memory used by SQLite.\n";
+      out << "# TYPE transferfaces_sqlite_memory_highwater_bytes gauge\n";
+      out << "transferfaces_sqlite_memory_highwater_bytes " << ::sqlite3_memory_highwater(0) << "\n";
+
+      return out.str();
+   }
+
+   /**
+    * Writes all metrics to a file. The file is replaced atomically, readers
+    * never see a partially written file.
+    *
+    * @param file The file to write.
+    * @return @c true on success, @c false else.
+    */
+   bool write(const std::string &file)
+   {
+      std::stringstream temporary;
+      temporary << file << ".tmp." << ::getpid();
+
+      std::string text = format();
+      FILE *output = ::fopen(temporary.str().c_str(), "w");
+      if (!output) {
+         return false;
+      }
+      bool success = (1 == ::fwrite(text.data(), text.size(), 1, output));
+      success = (0 == ::fclose(output)) && success;
+      if (!success || 0 != ::rename(temporary.str().c_str(), file.c_str())) {
+         ::unlink(temporary.str().c_str());
+         return false;
+      }
+
+      return true;
+   }
+
+   /**
+    * Starts a thread that writes the metrics file periodically.
+    *
+    * @param file      The file to write.
+    * @param interval  Seconds between two writes.
+    */
+   void startWriter(const std::string &file, int interval)
+   {
+      stopWriter();
+
+      path = file;
+      stopWriting = false;
+      writer = std::thread([this, interval]() {
+         std::unique_lock<std::mutex> lock(mutex);
+         while (!stopWriting) {
+            writerWakeup.wait_for(lock, std::chrono::seconds(interval));
+            if (stopWriting) {
+               break;
+            }
+            lock.unlock();
+            write(path);
+            lock.lock();
+         }
+      });
+   }
+
+   /**
+    * Stops the writer thread started by startWriter(). The file is written
+    * one last time.
+    */
+   void stopWriter(void)
+   {
+      if (!writer.joinable()) {
+         return;
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stopWriting = true;
+      }
+      writerWakeup.notify_all();
+      writer.join();
+
+      write(path);
+   }
+};
+
+#endif
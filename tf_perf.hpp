@@ -0,0 +1,237 @@
+#ifndef __TF_PERF__
+#define __TF_PERF__
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/// The hardware (and software) events counted by TFPerfCounters.
+enum TFPerfEvent
+{
+   TF_PERF_CYCLES,            ///< CPU cycles.
+   TF_PERF_INSTRUCTIONS,      ///< Instructions retired.
+   TF_PERF_CACHE_MISSES,      ///< Last level cache misses.
+   TF_PERF_BRANCH_MISSES,     ///< Mispredicted branches.
+   TF_PERF_PAGE_FAULTS,       ///< Page faults.
+
+   TF_PERF_EVENT_COUNT
+};
+
+/**
+ * Hardware performance counters, read at the boundaries of the stages of a
+ * transfer.
+ *
+ * Uses perf_event_open(2) and is therefore only available on Linux; open()
+ * fails everywhere else. The counters are inherited by child processes, so
+ * the work of shard workers is included in the stage that forked them.
+ */
+class TFPerfCounters
+{
+public:
+   /// The counts of one stage.
+   typedef struct {
+      std::string name;                                  ///< The name of the stage.
+      unsigned long long counts[TF_PERF_EVENT_COUNT];    ///< The counts per event.
+   } stagecounts;
+
+protected:
+   int fds[TF_PERF_EVENT_COUNT];                         ///< The counters (-1: not available).
+   unsigned long long last[TF_PERF_EVENT_COUNT];         ///< The counts when the current stage started.
+   std::string currentStage;                             ///< The stage running ("": none).
+   std::vector<stagecounts> stages;                      ///< The counts of all finished stages.
+
+   /**
+    * Reads a counter, scaled up if the kernel had to multiplex it.
+    *
+    * @param event The event to read.
+    * @return The count so far.
+    */
+   unsigned long long read(int event)
+   {
+#ifdef __linux__
+      unsigned long long values[3];   // value, time enabled, time running
+      if (fds[event] < 0 || (ssize_t) sizeof(values) != ::read(fds[event], values, sizeof(values))) {
+         return 0;
+      }
+      if (values[2] > 0 && values[2] < values[1]) {
+         return (unsigned long long) ((double) values[0] * values[1] / values[2]);
+      }
+      return values[0];
+#else
+      return 0;
+#endif
+   }
+
+public:
+   /**
+    * Constructor.
+    */
+   TFPerfCounters()
+   {
+      for (int event = 0; event < TF_PERF_EVENT_COUNT; ++event) {
+         fds[event] = -1;
+         last[event] = 0;
+      }
+   }
+
+   /**
+    * Destructor.
+    */
+   ~TFPerfCounters()
+   {
+      close();
+   }
+
+   /**
+    * Opens the counters for the calling process and its future children.
+    *
+    * Events the CPU or the kernel does not support are left out and
+    * reported as 0.
+    *
+    * @param error   The reason if nothing could be opened.
+    * @return @c true if at least one counter is available, @c false else.
+    */
+   bool open(std::string &error)
+   {
+      close();
+
+#ifdef __linux__
+      static const struct {
+         unsigned int type;
+         unsigned long long config;
+      } events[TF_PERF_EVENT_COUNT] = {
+         { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+         { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+         { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+         { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+         { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+      };
+
+      bool opened = false;
+      for (int event = 0; event < TF_PERF_EVENT_COUNT; ++event) {
+         struct ::perf_event_attr attr;
+         ::memset(&attr, 0, sizeof(attr));
+         attr.size = sizeof(attr);
+         attr.type = events[event].type;
+         attr.config = events[event].config;
+         attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+         attr.inherit = 1;
+         attr.exclude_kernel = 1;
+         attr.exclude_hv = 1;
+
+         fds[event] = (int) ::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+         if (fds[event] < 0) {
+            error = ::strerror(errno);
+         } else {
+            opened = true;
+         }
+      }
+      if (!opened) {
+         error = "perf_event_open() failed: " + error;
+         return false;
+      }
+
+      currentStage = "";
+      stages.clear();
+      return true;
+#else
+      error = "hardware counters are only available on Linux";
+      return false;
+#endif
+   }
+
+   /**
+    * Closes the counters.
+    */
+   void close(void)
+   {
+      for (int event = 0; event < TF_PERF_EVENT_COUNT; ++event) {
+         if (fds[event] >= 0) {
+            ::close(fds[event]);
+            fds[event] = -1;
+         }
+      }
+   }
+
+   /**
+    * Checks whether the counters are open.
+    *
+    * @return @c true if open() succeeded.
+    */
+   bool isOpen(void) const
+   {
+      for (int event = 0; event < TF_PERF_EVENT_COUNT; ++event) {
+         if (fds[event] >= 0) {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   /**
+    * Checks whether an event is counted.
+    *
+    * @param event The event.
+    * @return @c true if the counter could be opened.
+    */
+   bool has(TFPerfEvent event) const { return fds[event] >= 0; }
+
+   /**
+    * The name of an event, for reports.
+    *
+    * @param event The event.
+    * @return The name.
+    */
+   static const char *name(TFPerfEvent event)
+   {
+      static const char *names[TF_PERF_EVENT_COUNT] = {
+         "cycles", "instructions", "cache misses", "branch misses", "page faults"
+      };
+      return names[event];
+   }
+
+   /**
+    * Marks the start of a new stage, ending the current one.
+    *
+    * @param name The name of the stage ("" to end the current stage only).
+    */
+   void stage(const std::string &name)
+   {
+      if (!isOpen()) {
+         return;
+      }
+
+      unsigned long long now[TF_PERF_EVENT_COUNT];
+      for (int event = 0; event < TF_PERF_EVENT_COUNT; ++event) {
+         now[event] = read(event);
+      }
+
+      if (currentStage != "") {
+         stagecounts counts;
+         counts.name = currentStage;
+         for (int event = 0; event < TF_PERF_EVENT_COUNT; ++event) {
+            counts.counts[event] = now[event] - last[event];
+         }
+         stages.push_back(counts);
+      }
+
+      ::memcpy(last, now, sizeof(last));
+      currentStage = name;
+   }
+
+   /**
+    * The counts of all finished stages, in the order they ran.
+    *
+    * @return The counts.
+    */
+   const std::vector<stagecounts> &results(void) const { return stages; }
+};
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef __TF_PREFETCH__
+#define __TF_PREFETCH__
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs work for the items of a list ahead of the thread that processes
+ * them, in a thread of its own.
+ *
+ * The processing thread calls consume() whenever it starts with the next
+ * item. The prefetcher stays at most depth items ahead of it and skips items
+ * the processing thread already reached, so it never competes for the
+ * storage with reads that are needed right now.
+ */
+template <typename T>
+class TFPrefetcher
+{
+protected:
+   std::vector<T> items;                     ///< The items, in the order they will be processed.
+   std::function<void(const T &)> work;      ///< What to do ahead of time per item.
+   size_t depth;                             ///< How far to run ahead.
+
+   std::mutex mutex;                         ///< Protects everything below.
+   std::condition_variable wakeup;           ///< Signals progress or stop.
+   size_t next;                              ///< The next item to prefetch.
+   size_t consumed;                          ///< The items the processing thread started.
+   size_t prefetchedCount;                   ///< Items prefetched in time.
+   bool stopping;                            ///< Flag to stop the thread.
+   std::thread thread;                       ///< Does the prefetching.
+
+   /**
+    * The prefetch thread.
+    */
+   void run(void)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+         wakeup.wait(lock, [this]() { return stopping || next < consumed + depth; });
+         if (stopping) {
+            break;
+         }
+         if (next < consumed) {
+            next = consumed;
+         }
+         if (next >= items.size()) {
+            break;
+         }
+
+         size_t current = next++;
+         lock.unlock();
+         work(items[current]);
+         lock.lock();
+         if (current >= consumed) {
+            prefetchedCount++;
+         }
+      }
+   }
+
+public:
+   /**
+    * Constructor.
+    */
+   TFPrefetcher()
+   : depth(0), next(0), consumed(0), prefetchedCount(0), stopping(false)
+   {
+   }
+
+   /**
+    * Destructor.
+    */
+   ~TFPrefetcher()
+   {
+      stop();
+   }
+
+   /**
+    * Starts prefetching.
+    *
+    * @param list       The items, in the order they will be processed.
+    * @param ahead      How many items to run ahead (at least 1).
+    * @param prefetch   What to do for each item; called in the prefetch
+    *                   thread.
+    */
+   void start(const std::vector<T> &list, size_t ahead, std::function<void(const T &)> prefetch)
+   {
+      stop();
+
+      items = list;
+      work = prefetch;
+      depth = ahead ? ahead : 1;
+      next = 0;
+      consumed = 0;
+      prefetchedCount = 0;
+      stopping = false;
+      thread = std::thread(&TFPrefetcher::run, this);
+   }
+
+   /**
+    * Tells the prefetcher that the next item is being processed now.
+    */
+   void consume(void)
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         consumed++;
+      }
+      wakeup.notify_one();
+   }
+
+   /**
+    * Stops prefetching and waits for the thread.
+    */
+   void stop(void)
+   {
+      if (!thread.joinable()) {
+         return;
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stopping = true;
+      }
+      wakeup.notify_one();
+      thread.join();
+   }
+
+   /**
+    * The number of items prefetched before the processing thread reached
+    * them.
+    *
+    * @return The number of items.
+    */
+   size_t prefetched(void)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return prefetchedCount;
+   }
+};
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef __TF_PROGRESS__
+#define __TF_PROGRESS__
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Reports the progress of a run periodically from a thread of its own.
+ *
+ * The work itself is not touched: the reporter reads the counters through a
+ * callback once per interval, so the cost does not depend on the number of
+ * images. Rates are smoothed exponentially (time constant TIME_CONSTANT
+ * seconds) so a few slow images do not make the ETA jump around.
+ */
+class TFProgress
+{
+public:
+   static constexpr double TIME_CONSTANT = 30.0;     ///< Seconds over which rates are smoothed.
+
+   /// Reads the number of images and faces done so far.
+   typedef std::function<void(long long &images, long long &faces)> counterfunction;
+   /// Prints one report.
+   typedef std::function<void(const std::string &line)> printfunction;
+
+protected:
+   long long total;                    ///< The number of images to do.
+   bool json;                          ///< Flag to report JSON lines instead of text.
+   counterfunction read;               ///< Reads the counters.
+   printfunction print;                ///< Prints a report.
+
+   std::mutex mutex;                   ///< Protects everything below.
+   std::condition_variable wakeup;     ///< Wakes the reporter to stop.
+   bool stopping;                      ///< Flag to stop the reporter.
+   std::string currentStage;           ///< The stage running.
+   std::thread reporter;               ///< Reports periodically.
+
+   std::chrono::steady_clock::time_point started;   ///< When start() was called.
+   std::chrono::steady_clock::time_point last;      ///< When the last report was made.
+   long long lastImages;               ///< Images done at the last report.
+   long long lastFaces;                ///< Faces done at the last report.
+   double imageRate;                   ///< Smoothed images per second (< 0: none yet).
+   double faceRate;                    ///< Smoothed faces per second.
+
+   /**
+    * Makes one report.
+    *
+    * Must be called with the mutex held.
+    */
+   void report(void)
+   {
+      long long images = 0;
+      long long faces = 0;
+      read(images, faces);
+
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      double elapsed = std::chrono::duration<double>(now - started).count();
+      double dt = std::chrono::duration<double>(now - last).count();
+      if (dt > 0) {
+         double currentImageRate = (images - lastImages) / dt;
+         double currentFaceRate = (faces - lastFaces) / dt;
+         if (imageRate < 0) {
+            imageRate = currentImageRate;
+            faceRate = currentFaceRate;
+         } else {
+            double alpha = 1 - ::exp(-dt / TIME_CONSTANT);
+            imageRate += alpha * (currentImageRate - imageRate);
+            faceRate += alpha * (currentFaceRate - faceRate);
+         }
+      }
+      last = now;
+      lastImages = images;
+      lastFaces = faces;
+
+      double rate = imageRate > 0 ? imageRate : 0;
+      long long eta = -1;
+      if (images >= total) {
+         eta = 0;
+      } else if (rate > 0) {
+         eta = (long long) ((total - images) / rate);
+      }
+      const char *stage = currentStage != "" ? currentStage.c_str() : "done";
+
+      char line[512];
+      if (json) {
+         ::snprintf(line, sizeof(line),
+                    "{\"stage\":\"%s\",\"images_done\":%lld,\"images_total\":%lld,"
+                    "\"images_per_second\":%.2f,\"faces_per_second\":%.2f,"
+                    "\"eta_seconds\":%lld,\"elapsed_seconds\":%.0f}\n",
+                    stage, images, total, rate, faceRate > 0 ? faceRate : 0,
+                    eta, elapsed);
+      } else {
+         char remaining[32] = "unknown";
+         if (eta >= 0) {
+            ::snprintf(remaining, sizeof(remaining), "%lld:%02lld:%02lld", eta / 3600, eta / 60 % 60, eta % 60);
+         }
+         ::snprintf(line, sizeof(line),
+                    "Progress: %lld/%lld images (%.1f%%), %.1f images/s, %.1f faces/s, ETA %s, stage %s\n",
+                    images, total, total > 0 ? 100.0 * images / total : 100.0,
+                    rate, faceRate > 0 ? faceRate : 0, remaining, stage);
+      }
+      print(line);
+   }
+
+public:
+   /**
+    * Constructor.
+    */
+   TFProgress()
+   : total(0), json(false), stopping(false), lastImages(0), lastFaces(0), imageRate(-1), faceRate(0)
+   {
+   }
+
+   /**
+    * Destructor.
+    */
+   ~TFProgress()
+   {
+      stop();
+   }
+
+   /**
+    * Starts reporting.
+    *
+    * @param images     The number of images to do.
+    * @param interval   Seconds between two reports.
+    * @param asJson     Flag to report JSON lines instead of text.
+    * @param counters   Reads the counters.
+    * @param printer    Prints a report.
+    */
+   void start(long long images, int interval, bool asJson, counterfunction counters, printfunction printer)
+   {
+      stop();
+
+      total = images;
+      json = asJson;
+      read = counters;
+      print = printer;
+      stopping = false;
+      started = last = std::chrono::steady_clock::now();
+      lastImages = lastFaces = 0;
+      imageRate = -1;
+      faceRate = 0;
+      reporter = std::thread([this, interval]() {
+         std::unique_lock<std::mutex> lock(mutex);
+         while (!wakeup.wait_for(lock, std::chrono::seconds(interval), [this]() { return stopping; })) {
+            report();
+         }
+      });
+   }
+
+   /**
+    * Tells the reporter which stage runs.
+    *
+    * @param name The name of the stage.
+    */
+   void stage(const std::string &name)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      currentStage = name;
+   }
+
+   /**
+    * Stops reporting, with a last report.
+    */
+   void stop(void)
+   {
+      if (!reporter.joinable()) {
+         return;
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stopping = true;
+      }
+      wakeup.notify_all();
+      reporter.join();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      report();
+   }
+};
+
+#endif
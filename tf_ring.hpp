@@ -0,0 +1,175 @@
+#ifndef __TF_RING__
+#define __TF_RING__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A bounded ring of many producers and a single consumer, without locks on
+ * the way from a producer to the consumer.
+ *
+ * Same scheme as the ring of TFLog: each slot carries a sequence number that
+ * tells producers and the consumer whose turn it is. Producers claim a slot
+ * with a compare-and-swap on the enqueue position. Slots and both positions
+ * each sit on cache lines of their own, so producers filling neighbouring
+ * slots and the consumer emptying them do not invalidate each other's lines.
+ *
+ * A full ring blocks the producers until the consumer made room, so the
+ * memory used stays bounded however far the producers are ahead. The
+ * consumer takes everything available at once; it only sleeps when the ring
+ * is empty and is woken by the next producer.
+ */
+template <typename T>
+class TFRing
+{
+public:
+   static const size_t CACHE_LINE = 64;     ///< Size of a cache line.
+
+protected:
+   /// One entry of the ring.
+   struct slot
+   {
+      std::atomic<size_t> sequence;    ///< Tells producers and consumer whose turn it is.
+      T value;                         ///< The record.
+      char padding[CACHE_LINE];        ///< Keeps the next slot off our line.
+   };
+
+   size_t capacity;                    ///< Records the ring holds (a power of two).
+   std::unique_ptr<slot[]> slots;      ///< The ring.
+
+   char padding0[CACHE_LINE];
+   std::atomic<size_t> enqueuePos;     ///< Next slot to write to.
+   char padding1[CACHE_LINE];
+   size_t dequeuePos;                  ///< Next slot to read from (consumer only).
+   char padding2[CACHE_LINE];
+
+   std::atomic<bool> sleeping;         ///< Flag whether the consumer waits.
+   std::atomic<long long> stalls;      ///< Times a producer found the ring full.
+   std::mutex wakeMutex;               ///< Pairs with wake.
+   std::condition_variable wake;       ///< Wakes the consumer.
+
+public:
+   /**
+    * Constructor.
+    *
+    * @param minimum   The number of records the ring must hold at least,
+    *                  rounded up to a power of two.
+    */
+   TFRing(size_t minimum)
+   : capacity(2), enqueuePos(0), dequeuePos(0), sleeping(false), stalls(0)
+   {
+      while (capacity < minimum) {
+         capacity <<= 1;
+      }
+      slots.reset(new slot[capacity]);
+      for (size_t i = 0; i < capacity; ++i) {
+         slots[i].sequence.store(i, std::memory_order_relaxed);
+      }
+   }
+
+   /**
+    * Hands a record to the consumer, waiting while the ring is full.
+    *
+    * @param value   The record.
+    */
+   void push(T value)
+   {
+      size_t pos = enqueuePos.load(std::memory_order_relaxed);
+      bool stalled = false;
+      for (;;) {
+         slot &s = slots[pos & (capacity - 1)];
+         size_t sequence = s.sequence.load(std::memory_order_acquire);
+         if (sequence == pos) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               s.value = std::move(value);
+               s.sequence.store(pos + 1, std::memory_order_release);
+               break;
+            }
+         } else if (sequence < pos) {
+            // Full, wait for the consumer.
+            if (!stalled) {
+               stalls.fetch_add(1, std::memory_order_relaxed);
+               stalled = true;
+            }
+            std::this_thread::yield();
+            pos = enqueuePos.load(std::memory_order_relaxed);
+         } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+         }
+      }
+
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeping.load(std::memory_order_relaxed)) {
+         std::lock_guard<std::mutex> lock(wakeMutex);
+         wake.notify_one();
+      }
+   }
+
+   /**
+    * Takes the records available, without waiting.
+    *
+    * @param batch   Receives the records (appended).
+    * @param maximum The number of records to take at most.
+    * @return The number of records taken.
+    */
+   size_t tryPopBatch(std::vector<T> &batch, size_t maximum)
+   {
+      size_t count = 0;
+      while (count < maximum) {
+         slot &s = slots[dequeuePos & (capacity - 1)];
+         if (s.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+            break;
+         }
+         batch.push_back(std::move(s.value));
+         s.value = T();
+         s.sequence.store(dequeuePos + capacity, std::memory_order_release);
+         dequeuePos++;
+         count++;
+      }
+      return count;
+   }
+
+   /**
+    * Takes the records available, waiting for at least one.
+    *
+    * @param batch   Receives the records (appended).
+    * @param maximum The number of records to take at most.
+    * @return The number of records taken.
+    */
+   size_t popBatch(std::vector<T> &batch, size_t maximum)
+   {
+      size_t count;
+      while (0 == (count = tryPopBatch(batch, maximum))) {
+         std::unique_lock<std::mutex> lock(wakeMutex);
+         sleeping.store(true, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         // A producer that missed the flag has already published its record.
+         if (slots[dequeuePos & (capacity - 1)].sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+            wake.wait_for(lock, std::chrono::milliseconds(10));
+         }
+         sleeping.store(false, std::memory_order_relaxed);
+      }
+      return count;
+   }
+
+   /**
+    * The number of records the ring holds.
+    *
+    * @return The capacity.
+    */
+   size_t size(void) const { return capacity; }
+
+   /**
+    * The number of pushes that had to wait for room.
+    *
+    * @return The number of pushes.
+    */
+   long long stalled(void) const { return stalls.load(std::memory_order_relaxed); }
+};
+
+#endif
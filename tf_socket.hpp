@@ -0,0 +1,183 @@
+#ifndef __TF_SOCKET__
+#define __TF_SOCKET__
+
+#include <streambuf>
+#include <string>
+#include <deque>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * A stream buffer that writes to a file descriptor.
+ *
+ * Used to redirect std::cout and std::cerr to the client socket while a
+ * server job runs, so the client sees the same output a local run prints.
+ */
+class TFFdStreambuf : public std::streambuf
+{
+protected:
+   int fd;                 ///< The file descriptor to write to.
+   char buffer[4096];      ///< Output is collected here before it is written.
+   bool failed;            ///< Flag if writing to the descriptor failed.
+
+   /**
+    * Writes the collected output to the file descriptor.
+    *
+    * Once a write failed, e.g. because the peer went away or a send timeout
+    * (SO_SNDTIMEO) expired, all further output is discarded.
+    *
+    * @return @c true on success, @c false if the peer went away.
+    */
+   bool writeBuffer(void)
+   {
+      const char *data = pbase();
+      size_t size = pptr() - pbase();
+
+      while (!failed && size > 0) {
+         ssize_t written = ::write(fd, data, size);
+         if (written < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+            failed = true;
+         } else {
+            data += written;
+            size -= written;
+         }
+      }
+
+      setp(buffer, buffer + sizeof(buffer));
+      return !failed;
+   }
+
+   virtual int_type overflow(int_type ch)
+   {
+      if (!writeBuffer()) {
+         return traits_type::eof();
+      }
+      if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+         *pptr() = traits_type::to_char_type(ch);
+         pbump(1);
+      }
+      return traits_type::not_eof(ch);
+   }
+
+   virtual int sync(void)
+   {
+      return writeBuffer() ? 0 : -1;
+   }
+
+public:
+   /**
+    * Constructor.
+    *
+    * @param descriptor The file descriptor to write to (not closed by us).
+    */
+   TFFdStreambuf(int descriptor)
+   : fd(descriptor), failed(false)
+   {
+      setp(buffer, buffer + sizeof(buffer));
+   }
+
+   /**
+    * Destructor.
+    *
+    * Writes any pending output.
+    */
+   ~TFFdStreambuf()
+   {
+      sync();
+   }
+};
+
+/**
+ * Fills in the address of a UNIX domain socket.
+ *
+ * @param address The address to fill in.
+ * @param path    The path of the socket in the file system.
+ * @return @c true on success, @c false if the path is too long.
+ */
+inline bool tfSocketAddress(struct ::sockaddr_un &address, const std::string &path)
+{
+   ::memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (path.size() >= sizeof(address.sun_path)) {
+      return false;
+   }
+   ::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+   return true;
+}
+
+/**
+ * Reads one request from a socket. A request is a list of strings, each
+ * prefixed by '+' and terminated by NUL. The request ends with an empty
+ * string (a single NUL). The prefix allows to transfer empty strings.
+ *
+ * @param fd      The socket to read from.
+ * @param fields  The strings read.
+ * @return @c true if a complete request was read, @c false else.
+ */
+inline bool tfReadRequest(int fd, std::deque<std::string> &fields)
+{
+   std::string current;
+   char buffer[1024];
+
+   for (;;) {
+      ssize_t size = ::read(fd, buffer, sizeof(buffer));
+      if (size < 0 && errno == EINTR) {
+         continue;
+      }
+      if (size <= 0) {
+         return false;
+      }
+
+      for (ssize_t n = 0; n < size; ++n) {
+         if (buffer[n] != '\0') {
+            current += buffer[n];
+         } else if (current == "") {
+            return true;
+         } else {
+            fields.push_back(current.substr(1));
+            current = "";
+         }
+      }
+   }
+}
+
+/**
+ * Writes one request to a socket, see tfReadRequest().
+ *
+ * @param fd      The socket to write to.
+ * @param fields  The strings to send.
+ * @return @c true on success, @c false else.
+ */
+inline bool tfWriteRequest(int fd, const std::deque<std::string> &fields)
+{
+   std::string request;
+   for (const std::string &field : fields) {
+      request += '+';
+      request.append(field.c_str(), field.size() + 1);
+   }
+   request += '\0';
+
+   const char *data = request.data();
+   size_t size = request.size();
+   while (size > 0) {
+      ssize_t written = ::write(fd, data, size);
+      if (written < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      data += written;
+      size -= written;
+   }
+
+   return true;
+}
+
+#endif
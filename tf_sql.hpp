@@ -73,6 +73,23 @@ public:
       }
    }
 
+   /**
+    * Rewinds the statement to run it again, with all template parameters
+    * bound to NULL. Errors are cleared.
+    *
+    * Unlike reset(), the statement is kept and not prepared again.
+    */
+   void rewind(void)
+   {
+      if (!statement) {
+         return;
+      }
+      ::sqlite3_reset(statement);
+      ::sqlite3_clear_bindings(statement);
+      failed = false;
+      errorMsg = "";
+   }
+
    /**
     * Binds the given template parameter to NULL.
     *
@@ -111,6 +128,27 @@ public:
       return !failed;
    }
 
+   /**
+    * Binds the given template parameter to the given text.
+    *
+    * @param index   The index of the template parameter (1-based).
+    * @param text    The text (needs no terminating NUL).
+    * @param length  The length of the text in bytes.
+    * @return @c true on success, @c false when in error state.
+    */
+   bool bind(int index, const char *text, int length)
+   {
+      if (failed) return false;
+      if (!statement) return false;
+
+      if (SQLITE_OK != ::sqlite3_bind_text(statement, index, text, length, SQLITE_TRANSIENT)) {
+         failed = true;
+         errorMsg = ::sqlite3_errmsg(db);
+      }
+
+      return !failed;
+   }
+
    /**
     * Binds the given template parameter to the given value.
     *
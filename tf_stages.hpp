@@ -0,0 +1,195 @@
+#ifndef __TF_STAGES__
+#define __TF_STAGES__
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs the stages of a transfer as a small DAG.
+ *
+ * Each stage has two halves: compute() only reads (Aperture) and collects
+ * what the stage will write, apply() writes it to the catalog. The compute
+ * halves of all stages run concurrently on worker threads. The apply halves
+ * run one after the other on the thread that called run(), so there is a
+ * single writer; a stage is applied once its compute half is done and all
+ * stages it depends on are applied. Among the stages ready to be applied,
+ * the one added first goes first.
+ */
+class TFStageGraph
+{
+public:
+   /// One half of a stage; returns @c false on errors.
+   typedef std::function<bool(void)> stepfunction;
+   /// Called on the writer thread right before a stage is applied.
+   typedef std::function<void(const std::string &name)> applyfunction;
+
+protected:
+   /// A stage of the graph.
+   struct stagenode
+   {
+      std::string name;                   ///< The name, for reports.
+      std::vector<size_t> dependencies;   ///< Stages that must be applied before.
+      stepfunction compute;               ///< Collects the writes (worker thread).
+      stepfunction apply;                 ///< Does the writes (writer thread).
+      bool started;                       ///< Flag whether compute was started.
+      bool computed;                      ///< Flag whether compute is done.
+      bool succeeded;                     ///< The result of compute.
+      bool applied;                       ///< Flag whether apply is done.
+   };
+
+   std::vector<stagenode> stages;         ///< The stages, in the order added.
+
+   std::mutex mutex;                      ///< Protects the flags of the stages.
+   std::condition_variable computedOne;   ///< Signals a finished compute half.
+   bool cancelled;                        ///< Flag to start no more compute halves.
+
+   /**
+    * A worker thread: Computes stages until none is left.
+    */
+   void work(void)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+         size_t next = stages.size();
+         for (size_t n = 0; n < stages.size() && !cancelled; ++n) {
+            if (!stages[n].started) {
+               next = n;
+               break;
+            }
+         }
+         if (next == stages.size()) {
+            return;
+         }
+
+         stages[next].started = true;
+         lock.unlock();
+         bool result = !stages[next].compute || stages[next].compute();
+         lock.lock();
+         stages[next].computed = true;
+         stages[next].succeeded = result;
+         computedOne.notify_all();
+      }
+   }
+
+   /**
+    * Finds the next stage to apply.
+    *
+    * Must be called with the mutex held.
+    *
+    * @return The index of the stage or stages.size() if none is ready.
+    */
+   size_t nextToApply(void)
+   {
+      for (size_t n = 0; n < stages.size(); ++n) {
+         if (stages[n].applied || !stages[n].computed) {
+            continue;
+         }
+         bool ready = true;
+         for (size_t dependency : stages[n].dependencies) {
+            ready = ready && stages[dependency].applied;
+         }
+         if (ready) {
+            return n;
+         }
+      }
+      return stages.size();
+   }
+
+public:
+   /**
+    * Constructor.
+    */
+   TFStageGraph()
+   : cancelled(false)
+   {
+   }
+
+   /**
+    * Adds a stage.
+    *
+    * Dependencies must have been added before, so the graph has no cycles.
+    *
+    * @param name          The name of the stage.
+    * @param dependencies  The stages to apply before this one.
+    * @param compute       Collects the writes, on a worker thread (may be empty).
+    * @param apply         Does the writes, on the writer thread.
+    * @return The index of the stage, to depend on it.
+    */
+   size_t add(const std::string &name,
+              const std::vector<size_t> &dependencies,
+              stepfunction compute,
+              stepfunction apply)
+   {
+      stagenode stage;
+      stage.name = name;
+      for (size_t dependency : dependencies) {
+         if (dependency < stages.size()) {
+            stage.dependencies.push_back(dependency);
+         }
+      }
+      stage.compute = compute;
+      stage.apply = apply;
+      stage.started = false;
+      stage.computed = false;
+      stage.succeeded = false;
+      stage.applied = false;
+      stages.push_back(stage);
+      return stages.size() - 1;
+   }
+
+   /**
+    * Runs all stages.
+    *
+    * On the first failure no further compute half is started and nothing
+    * more is applied; computes already running are waited for.
+    *
+    * @param threads   The number of worker threads (at least 1).
+    * @param entering  Called before each stage is applied (may be empty).
+    * @return @c true if all stages succeeded, @c false else.
+    */
+   bool run(int threads, applyfunction entering)
+   {
+      std::vector<std::thread> workers;
+      int count = std::max(1, std::min(threads, (int) stages.size()));
+      for (int n = 0; n < count; ++n) {
+         workers.push_back(std::thread(&TFStageGraph::work, this));
+      }
+
+      bool result = true;
+      std::unique_lock<std::mutex> lock(mutex);
+      for (size_t done = 0; result && done < stages.size(); ++done) {
+         size_t next;
+         computedOne.wait(lock, [this, &next]() {
+            next = nextToApply();
+            return next < stages.size();
+         });
+
+         stagenode &stage = stages[next];
+         if (!stage.succeeded) {
+            result = false;
+            break;
+         }
+         lock.unlock();
+         if (entering) {
+            entering(stage.name);
+         }
+         result = stage.apply();
+         lock.lock();
+         stage.applied = true;
+      }
+      cancelled = !result;
+      lock.unlock();
+
+      for (std::thread &worker : workers) {
+         worker.join();
+      }
+      return result;
+   }
+};
+
+#endif
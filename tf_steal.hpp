@@ -0,0 +1,224 @@
+#ifndef __TF_STEAL__
+#define __TF_STEAL__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A thread pool with one task deque per worker and work stealing.
+ *
+ * A task submitted by a worker goes to the back of its own deque and the
+ * worker takes its next task from there, so the tasks of one image stay on
+ * one core while they are hot. An idle worker steals from the front of the
+ * other deques, which holds the oldest tasks. Tasks submitted from outside
+ * the pool are spread over the deques round-robin.
+ */
+class TFWorkStealingPool
+{
+public:
+   /// A task; gets the index of the worker running it.
+   typedef std::function<void(int worker)> task;
+
+protected:
+   /// The deque of one worker, padded so two of them share no cache line.
+   struct workerqueue
+   {
+      std::mutex mutex;          ///< Protects the tasks.
+      std::deque<task> tasks;    ///< Owner: back, thieves: front.
+      char padding[64];          ///< Keeps the next allocation off our line.
+   };
+
+   std::vector<std::unique_ptr<workerqueue>> queues;   ///< One per worker.
+   std::vector<std::thread> threads;                    ///< The workers.
+   std::atomic<long long> queued;      ///< Tasks in all deques.
+   std::atomic<long long> stolen;      ///< Tasks taken from another deque.
+   std::atomic<unsigned> nextQueue;    ///< For tasks from outside the pool.
+
+   std::mutex idleMutex;               ///< Protects stopping, pairs with idle.
+   std::condition_variable idle;       ///< Wakes idle workers.
+   bool stopping;                      ///< Flag to stop once all tasks ran.
+
+   /**
+    * The pool and worker index of the current thread.
+    */
+   static TFWorkStealingPool *&currentPool(void)
+   {
+      static thread_local TFWorkStealingPool *pool = NULL;
+      return pool;
+   }
+   static int &currentWorker(void)
+   {
+      static thread_local int worker = -1;
+      return worker;
+   }
+
+   /**
+    * Takes a task: the newest of the own deque, else the oldest of another.
+    *
+    * @param worker  The index of the worker.
+    * @param next    Receives the task.
+    * @return @c true if a task was taken.
+    */
+   bool take(int worker, task &next)
+   {
+      {
+         workerqueue &own = *queues[worker];
+         std::lock_guard<std::mutex> lock(own.mutex);
+         if (!own.tasks.empty()) {
+            next = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+         }
+      }
+
+      for (size_t n = 1; n < queues.size(); ++n) {
+         workerqueue &victim = *queues[(worker + n) % queues.size()];
+         std::lock_guard<std::mutex> lock(victim.mutex);
+         if (!victim.tasks.empty()) {
+            next = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            stolen.fetch_add(1, std::memory_order_relaxed);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   /**
+    * A worker thread.
+    *
+    * @param worker  The index of the worker.
+    */
+   void run(int worker)
+   {
+      currentPool() = this;
+      currentWorker() = worker;
+
+      task next;
+      for (;;) {
+         if (take(worker, next)) {
+            next(worker);
+            next = task();
+            continue;
+         }
+
+         std::unique_lock<std::mutex> lock(idleMutex);
+         idle.wait(lock, [this]() {
+            return stopping || queued.load(std::memory_order_relaxed) > 0;
+         });
+         if (stopping && queued.load(std::memory_order_relaxed) == 0) {
+            break;
+         }
+      }
+
+      currentPool() = NULL;
+      currentWorker() = -1;
+   }
+
+public:
+   /**
+    * Constructor.
+    */
+   TFWorkStealingPool()
+   : queued(0), stolen(0), nextQueue(0), stopping(false)
+   {
+   }
+
+   /**
+    * Destructor.
+    */
+   ~TFWorkStealingPool()
+   {
+      stop();
+   }
+
+   /**
+    * Starts the workers.
+    *
+    * @param count   The number of workers (at least 1).
+    */
+   void start(int count)
+   {
+      stop();
+
+      stopping = false;
+      stolen = 0;
+      queues.clear();
+      for (int n = 0; n < std::max(count, 1); ++n) {
+         queues.push_back(std::unique_ptr<workerqueue>(new workerqueue()));
+      }
+      for (int n = 0; n < (int) queues.size(); ++n) {
+         threads.push_back(std::thread(&TFWorkStealingPool::run, this, n));
+      }
+   }
+
+   /**
+    * Runs all tasks submitted so far and stops the workers.
+    */
+   void stop(void)
+   {
+      if (threads.empty()) {
+         return;
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(idleMutex);
+         stopping = true;
+      }
+      idle.notify_all();
+      for (std::thread &thread : threads) {
+         thread.join();
+      }
+      threads.clear();
+   }
+
+   /**
+    * Submits a task.
+    *
+    * @param work  The task.
+    */
+   void submit(task work)
+   {
+      int worker = currentWorker();
+      if (currentPool() != this) {
+         worker = nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+      }
+
+      {
+         workerqueue &queue = *queues[worker];
+         std::lock_guard<std::mutex> lock(queue.mutex);
+         queue.tasks.push_back(std::move(work));
+      }
+      {
+         // Under the lock, so a worker about to sleep cannot miss it.
+         std::lock_guard<std::mutex> lock(idleMutex);
+         queued.fetch_add(1, std::memory_order_relaxed);
+      }
+      idle.notify_one();
+   }
+
+   /**
+    * The number of workers.
+    *
+    * @return The number of workers.
+    */
+   int size(void) const { return (int) queues.size(); }
+
+   /**
+    * The number of tasks a worker took from the deque of another.
+    *
+    * @return The number of tasks.
+    */
+   long long steals(void) const { return stolen.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,396 @@
+#ifndef __TF_UUID__
+#define __TF_UUID__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+
+/**
+ * Creates random (version 4, RFC 4122) UUIDs for the id_global columns.
+ *
+ * The random bits come from ChaCha20, keyed once from the random source of
+ * the OS; each block of the cipher yields four UUIDs. UUIDs are written as
+ * 36 upper case characters (like uuid_unparse() on macOS) into buffers of
+ * the caller, without a terminating NUL.
+ *
+ * seed() makes the sequence reproducible, e.g. for catalogs that are
+ * compared between benchmark runs. Such UUIDs are only unique per seed.
+ */
+class TFUuidGenerator
+{
+public:
+   static const size_t LENGTH = 36;    ///< Characters of a UUID.
+
+protected:
+   uint32_t input[16];                 ///< Constants, key, block counter and nonce.
+   uint8_t block[64];                  ///< Output of the last block.
+   size_t used;                        ///< Bytes of the block taken.
+   bool keyed;                         ///< Flag whether the key was set.
+   bool seeded;                        ///< Flag whether the key came from seed().
+   std::mutex mutex;                   ///< Protects everything above.
+
+   static uint32_t rotate(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
+
+   static void quarterRound(uint32_t *x, int a, int b, int c, int d)
+   {
+      x[a] += x[b]; x[d] = rotate(x[d] ^ x[a], 16);
+      x[c] += x[d]; x[b] = rotate(x[b] ^ x[c], 12);
+      x[a] += x[b]; x[d] = rotate(x[d] ^ x[a], 8);
+      x[c] += x[d]; x[b] = rotate(x[b] ^ x[c], 7);
+   }
+
+   /**
+    * Computes the next block of the cipher.
+    */
+   void nextBlock(void)
+   {
+      uint32_t x[16];
+      for (int i = 0; i < 16; ++i) {
+         x[i] = input[i];
+      }
+      for (int round = 0; round < 10; ++round) {
+         quarterRound(x, 0, 4,  8, 12);
+         quarterRound(x, 1, 5,  9, 13);
+         quarterRound(x, 2, 6, 10, 14);
+         quarterRound(x, 3, 7, 11, 15);
+         quarterRound(x, 0, 5, 10, 15);
+         quarterRound(x, 1, 6, 11, 12);
+         quarterRound(x, 2, 7,  8, 13);
+         quarterRound(x, 3, 4,  9, 14);
+      }
+      for (int i = 0; i < 16; ++i) {
+         uint32_t v = x[i] + input[i];
+         block[4 * i]     = (uint8_t) v;
+         block[4 * i + 1] = (uint8_t) (v >> 8);
+         block[4 * i + 2] = (uint8_t) (v >> 16);
+         block[4 * i + 3] = (uint8_t) (v >> 24);
+      }
+      // 64 bit block counter.
+      if (++input[12] == 0) {
+         input[13]++;
+      }
+      used = 0;
+   }
+
+   /**
+    * Sets the key and starts over.
+    *
+    * @param key     The key, 8 words.
+    * @param nonce   Tells streams with the same key apart.
+    */
+   void setKey(const uint32_t *key, uint64_t nonce)
+   {
+      // "expand 32-byte k"
+      input[0] = 0x61707865;
+      input[1] = 0x3320646e;
+      input[2] = 0x79622d32;
+      input[3] = 0x6b206574;
+      for (int i = 0; i < 8; ++i) {
+         input[4 + i] = key[i];
+      }
+      input[12] = 0;
+      input[13] = 0;
+      input[14] = (uint32_t) nonce;
+      input[15] = (uint32_t) (nonce >> 32);
+      used = sizeof(block);
+      keyed = true;
+   }
+
+   /**
+    * Keys the cipher from the random source of the OS.
+    */
+   void randomKey(void)
+   {
+      std::random_device source;
+      uint32_t key[8];
+      for (int i = 0; i < 8; ++i) {
+         key[i] = source();
+      }
+      setKey(key, 0);
+      seeded = false;
+   }
+
+   /**
+    * Writes one UUID, the lock must be held.
+    *
+    * @param out  Receives LENGTH characters.
+    */
+   void generateLocked(char *out)
+   {
+      static const char hex[] = "0123456789ABCDEF";
+
+      if (!keyed) {
+         randomKey();
+      }
+      if (used + 16 > sizeof(block)) {
+         nextBlock();
+      }
+      uint8_t bytes[16];
+      for (int i = 0; i < 16; ++i) {
+         bytes[i] = block[used + i];
+      }
+      used += 16;
+
+      bytes[6] = (bytes[6] & 0x0f) | 0x40;   // Version 4
+      bytes[8] = (bytes[8] & 0x3f) | 0x80;   // Variant RFC 4122
+
+      for (int i = 0; i < 16; ++i) {
+         if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *out++ = '-';
+         }
+         *out++ = hex[bytes[i] >> 4];
+         *out++ = hex[bytes[i] & 0x0f];
+      }
+   }
+
+public:
+   /**
+    * Constructor. The key is taken from the OS on first use.
+    */
+   TFUuidGenerator()
+   : used(0), keyed(false), seeded(false)
+   {
+   }
+
+   /**
+    * Makes the UUIDs reproducible.
+    *
+    * @param value   The seed.
+    * @param stream  Tells sequences of the same seed apart (e.g. of shards).
+    */
+   void seed(uint64_t value, uint64_t stream = 0)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      uint32_t key[8] = {
+         (uint32_t) value, (uint32_t) (value >> 32), 0, 0, 0, 0, 0, 0
+      };
+      setKey(key, stream);
+      seeded = true;
+   }
+
+   /**
+    * Makes the UUIDs random again after seed(), e.g. for the next job of a
+    * server. A random key is kept.
+    */
+   void randomize(void)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (seeded) {
+         randomKey();
+      }
+   }
+
+   /**
+    * To be called in the child after fork(), so parent and child do not
+    * create the same UUIDs. A random key is replaced by a new one, a seeded
+    * one gets another stream.
+    *
+    * @param child   Tells the children of one parent apart (e.g. the shard).
+    */
+   void afterFork(uint64_t child)
+   {
+      new (&mutex) std::mutex();
+      if (!seeded) {
+         // Not keyed yet: the child takes its own key on first use.
+         if (keyed) {
+            randomKey();
+         }
+      } else {
+         input[12] = 0;
+         input[13] = 0;
+         input[14] = (uint32_t) (child + 1);
+         input[15] = (uint32_t) ((child + 1) >> 32);
+         used = sizeof(block);
+      }
+   }
+
+   /**
+    * Writes one UUID.
+    *
+    * @param out  Receives LENGTH characters (no terminating NUL).
+    */
+   void generate(char *out)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      generateLocked(out);
+   }
+
+   /**
+    * Writes many UUIDs.
+    *
+    * @param out     Receives count * LENGTH characters, one UUID after the other.
+    * @param count   The number of UUIDs.
+    */
+   void generate(char *out, size_t count)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < count; ++i) {
+         generateLocked(out + i * LENGTH);
+      }
+   }
+};
+
+/**
+ * An Aperture identifier (RKMaster.uuid, masterUuid, stackUuid) as 16 bytes,
+ * for keys of tables in memory: copied, compared and hashed as two integers.
+ *
+ * Aperture writes its UUIDs as 22 characters of base64 with '%' instead of
+ * '/'; UUIDs in the 36 character hex form are accepted as well. Both are
+ * parsed losslessly, toHex() gives a text form that parses back to the same
+ * key. Anything else is hashed into a key, so it still compares equal to
+ * itself. The empty string is the null key.
+ */
+struct TFUuidKey
+{
+   uint64_t high;    ///< The first 8 bytes, big endian.
+   uint64_t low;     ///< The last 8 bytes, big endian.
+
+   /**
+    * Parses an identifier.
+    *
+    * @param text    The identifier.
+    * @param length  Its length.
+    * @return The key.
+    */
+   static TFUuidKey fromText(const char *text, size_t length)
+   {
+      TFUuidKey key = { 0, 0 };
+      if (length == 0) {
+         return key;
+      }
+      if ((length == 22 && parseBase64(text, key)) ||
+          (length == 36 && parseHex(text, key))) {
+         return key;
+      }
+
+      // Two FNV-1a hashes with different bases.
+      key.high = 14695981039346656037ull;
+      key.low = 0x6c62272e07bb0142ull;
+      for (size_t i = 0; i < length; ++i) {
+         key.high = (key.high ^ (unsigned char) text[i]) * 1099511628211ull;
+         key.low = (key.low ^ (unsigned char) text[i]) * 1099511628211ull;
+      }
+      return key;
+   }
+
+   static TFUuidKey fromText(const std::string &text)
+   {
+      return fromText(text.data(), text.size());
+   }
+
+   /**
+    * The key as 36 hex characters (upper case, with dashes).
+    *
+    * @param out  Receives the characters (no terminating NUL).
+    */
+   void toHex(char *out) const
+   {
+      static const char hex[] = "0123456789ABCDEF";
+      for (int i = 0; i < 16; ++i) {
+         if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *out++ = '-';
+         }
+         uint8_t byte = (uint8_t) ((i < 8 ? high >> (56 - 8 * i) : low >> (120 - 8 * i)) & 0xff);
+         *out++ = hex[byte >> 4];
+         *out++ = hex[byte & 0x0f];
+      }
+   }
+
+   std::string toHex(void) const
+   {
+      char out[36];
+      toHex(out);
+      return std::string(out, sizeof(out));
+   }
+
+   bool isNull(void) const { return high == 0 && low == 0; }
+
+   bool operator==(const TFUuidKey &other) const { return high == other.high && low == other.low; }
+   bool operator!=(const TFUuidKey &other) const { return !(*this == other); }
+   bool operator<(const TFUuidKey &other) const
+   {
+      return high < other.high || (high == other.high && low < other.low);
+   }
+
+protected:
+   /// Appends 4 bits to the key, shifting the bits before to the left.
+   static void shiftIn(TFUuidKey &key, unsigned bits, int count)
+   {
+      key.high = (key.high << count) | (key.low >> (64 - count));
+      key.low = (key.low << count) | bits;
+   }
+
+   static bool parseBase64(const char *text, TFUuidKey &key)
+   {
+      for (int i = 0; i < 22; ++i) {
+         char c = text[i];
+         unsigned value;
+         if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+         } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+         } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+         } else if (c == '+') {
+            value = 62;
+         } else if (c == '%') {
+            value = 63;
+         } else {
+            return false;
+         }
+         if (i < 21) {
+            shiftIn(key, value, 6);
+         } else if (value & 0x0f) {
+            // The last character holds 2 bits, other ones would be lost.
+            return false;
+         } else {
+            shiftIn(key, value >> 4, 2);
+         }
+      }
+      return true;
+   }
+
+   static bool parseHex(const char *text, TFUuidKey &key)
+   {
+      for (int i = 0; i < 36; ++i) {
+         char c = text[i];
+         if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (c != '-') {
+               return false;
+            }
+            continue;
+         }
+         unsigned value;
+         if (c >= '0' && c <= '9') {
+            value = c - '0';
+         } else if (c >= 'A' && c <= 'F') {
+            value = c - 'A' + 10;
+         } else if (c >= 'a' && c <= 'f') {
+            value = c - 'a' + 10;
+         } else {
+            return false;
+         }
+         shiftIn(key, value, 4);
+      }
+      return true;
+   }
+};
+
+namespace std {
+   /// The bits of a UUID are random already.
+   template <>
+   struct hash<TFUuidKey>
+   {
+      size_t operator()(const TFUuidKey &key) const
+      {
+         return (size_t) (key.low ^ (key.high * 0x9e3779b97f4a7c15ull));
+      }
+   };
+}
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef __TF_VFS__
+#define __TF_VFS__
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+/// The I/O done on one database file.
+typedef struct {
+   long long reads;              ///< Calls to xRead.
+   long long bytesRead;          ///< Bytes read.
+   long long writes;             ///< Calls to xWrite.
+   long long bytesWritten;       ///< Bytes written.
+   long long syncs;              ///< Calls to xSync.
+   long long readAheads;         ///< Read-ahead hints given to the kernel.
+   long long readAheadBytes;     ///< Bytes covered by these hints.
+} tfiostats;
+
+/**
+ * A SQLite VFS that passes everything on to the default VFS, counting the
+ * I/O per database file on the way.
+ *
+ * When it sees a main database file being read sequentially (as in bulk
+ * scans, or when the backup API copies a database), it asks the kernel to
+ * read ahead a large window, so cold storage can stream at full bandwidth
+ * instead of serving one page per request.
+ *
+ * Statistics are kept per file name. Connections on other threads (prefetch,
+ * concurrent stages) count into the same statistics, so all updates hold a
+ * mutex and stats() returns a copy.
+ */
+class TFIoVfs
+{
+public:
+   static const int SEQUENTIAL_READS = 4;                   ///< Sequential reads before reading ahead.
+   static const sqlite3_int64 READ_AHEAD = 4 * 1024 * 1024; ///< The size of the read-ahead window.
+
+protected:
+   /// A file opened through the VFS.
+   typedef struct {
+      ::sqlite3_file base;          ///< Must come first, SQLite sees this.
+      ::sqlite3_file *real;         ///< The file of the default VFS (right behind this struct).
+      tfiostats *stats;             ///< Where to count.
+      int adviseFd;                 ///< Descriptor for read-ahead hints (-1: none).
+      sqlite3_int64 nextOffset;     ///< Where the next sequential read would start.
+      int sequential;               ///< The number of sequential reads in a row.
+      sqlite3_int64 advisedUntil;   ///< End of the window read ahead already.
+   } iofile;
+
+   static ::sqlite3_vfs *&base(void)
+   {
+      static ::sqlite3_vfs *vfs = NULL;
+      return vfs;
+   }
+
+   static std::map<std::string, tfiostats> &files(void)
+   {
+      static std::map<std::string, tfiostats> stats;
+      return stats;
+   }
+
+   static std::mutex &filesMutex(void)
+   {
+      static std::mutex mutex;
+      return mutex;
+   }
+
+   /// Flag whether the VFS could be registered.
+   static bool &registered(void)
+   {
+      static bool flag = false;
+      return flag;
+   }
+
+   static ::sqlite3_file *real(::sqlite3_file *file)
+   {
+      return ((iofile *) file)->real;
+   }
+
+   /**
+    * The statistics of a file, created on first use.
+    *
+    * @param file The name of the file.
+    * @return The statistics, only to be changed with filesMutex() held.
+    */
+   static tfiostats &statsOf(const std::string &file)
+   {
+      std::lock_guard<std::mutex> lock(filesMutex());
+      std::map<std::string, tfiostats>::iterator iter = files().find(file);
+      if (iter == files().end()) {
+         tfiostats empty;
+         ::memset(&empty, 0, sizeof(empty));
+         iter = files().insert(std::make_pair(file, empty)).first;
+      }
+      return iter->second;
+   }
+
+   /**
+    * Asks the kernel to read a range of a file into its cache.
+    *
+    * @param fd      The file.
+    * @param offset  Start of the range.
+    * @param length  Length of the range.
+    * @return @c true if the hint was given.
+    */
+   static bool adviseReadAhead(int fd, sqlite3_int64 offset, sqlite3_int64 length)
+   {
+#if defined(__APPLE__)
+      struct ::radvisory advice;
+      advice.ra_offset = offset;
+      advice.ra_count = (int) length;
+      return -1 != ::fcntl(fd, F_RDADVISE, &advice);
+#elif defined(POSIX_FADV_WILLNEED)
+      return 0 == ::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#else
+      return false;
+#endif
+   }
+
+   static int ioClose(::sqlite3_file *file)
+   {
+      iofile *f = (iofile *) file;
+      int result = f->real->pMethods ? f->real->pMethods->xClose(f->real) : SQLITE_OK;
+      if (f->adviseFd >= 0) {
+         ::close(f->adviseFd);
+      }
+      return result;
+   }
+
+   static int ioRead(::sqlite3_file *file, void *buffer, int amount, sqlite3_int64 offset)
+   {
+      iofile *f = (iofile *) file;
+      {
+         std::lock_guard<std::mutex> lock(filesMutex());
+         f->stats->reads++;
+         f->stats->bytesRead += amount;
+      }
+
+      if (f->adviseFd >= 0) {
+         f->sequential = (offset == f->nextOffset) ? f->sequential + 1 : 0;
+         f->nextOffset = offset + amount;
+         if (f->sequential >= SEQUENTIAL_READS && f->nextOffset + READ_AHEAD / 2 > f->advisedUntil) {
+            sqlite3_int64 from = std::max(f->advisedUntil, f->nextOffset);
+            if (adviseReadAhead(f->adviseFd, from, READ_AHEAD)) {
+               std::lock_guard<std::mutex> lock(filesMutex());
+               f->stats->readAheads++;
+               f->stats->readAheadBytes += READ_AHEAD;
+            }
+            f->advisedUntil = from + READ_AHEAD;
+         }
+      }
+
+      return f->real->pMethods->xRead(f->real, buffer, amount, offset);
+   }
+
+   static int ioWrite(::sqlite3_file *file, const void *buffer, int amount, sqlite3_int64 offset)
+   {
+      iofile *f = (iofile *) file;
+      {
+         std::lock_guard<std::mutex> lock(filesMutex());
+         f->stats->writes++;
+         f->stats->bytesWritten += amount;
+      }
+      return f->real->pMethods->xWrite(f->real, buffer, amount, offset);
+   }
+
+   static int ioTruncate(::sqlite3_file *file, sqlite3_int64 size)
+   {
+      return real(file)->pMethods->xTruncate(real(file), size);
+   }
+
+   static int ioSync(::sqlite3_file *file, int flags)
+   {
+      {
+         std::lock_guard<std::mutex> lock(filesMutex());
+         ((iofile *) file)->stats->syncs++;
+      }
+      return real(file)->pMethods->xSync(real(file), flags);
+   }
+
+   static int ioFileSize(::sqlite3_file *file, sqlite3_int64 *size)
+   {
+      return real(file)->pMethods->xFileSize(real(file), size);
+   }
+
+   static int ioLock(::sqlite3_file *file, int lock)
+   {
+      return real(file)->pMethods->xLock(real(file), lock);
+   }
+
+   static int ioUnlock(::sqlite3_file *file, int lock)
+   {
+      return real(file)->pMethods->xUnlock(real(file), lock);
+   }
+
+   static int ioCheckReservedLock(::sqlite3_file *file, int *result)
+   {
+      return real(file)->pMethods->xCheckReservedLock(real(file), result);
+   }
+
+   static int ioFileControl(::sqlite3_file *file, int op, void *arg)
+   {
+      return real(file)->pMethods->xFileControl(real(file), op, arg);
+   }
+
+   static int ioSectorSize(::sqlite3_file *file)
+   {
+      return real(file)->pMethods->xSectorSize(real(file));
+   }
+
+   static int ioDeviceCharacteristics(::sqlite3_file *file)
+   {
+      return real(file)->pMethods->xDeviceCharacteristics(real(file));
+   }
+
+   static int ioShmMap(::sqlite3_file *file, int page, int size, int extend, void volatile **memory)
+   {
+      return real(file)->pMethods->xShmMap(real(file), page, size, extend, memory);
+   }
+
+   static int ioShmLock(::sqlite3_file *file, int offset, int n, int flags)
+   {
+      return real(file)->pMethods->xShmLock(real(file), offset, n, flags);
+   }
+
+   static void ioShmBarrier(::sqlite3_file *file)
+   {
+      real(file)->pMethods->xShmBarrier(real(file));
+   }
+
+   static int ioShmUnmap(::sqlite3_file *file, int deleteFlag)
+   {
+      return real(file)->pMethods->xShmUnmap(real(file), deleteFlag);
+   }
+
+   static int ioFetch(::sqlite3_file *file, sqlite3_int64 offset, int amount, void **pointer)
+   {
+      return real(file)->pMethods->xFetch(real(file), offset, amount, pointer);
+   }
+
+   static int ioUnfetch(::sqlite3_file *file, sqlite3_int64 offset, void *pointer)
+   {
+      return real(file)->pMethods->xUnfetch(real(file), offset, pointer);
+   }
+
+   /**
+    * The methods of our files, for a given version of the real methods.
+    *
+    * @param version The iVersion of the methods of the default VFS.
+    * @return The methods.
+    */
+   static const ::sqlite3_io_methods *methods(int version)
+   {
+      static ::sqlite3_io_methods versions[3];
+      static std::once_flag once;
+      std::call_once(once, []() {
+         for (int i = 0; i < 3; ++i) {
+            ::sqlite3_io_methods &m = versions[i];
+            ::memset(&m, 0, sizeof(m));
+            m.iVersion = i + 1;
+            m.xClose = ioClose;
+            m.xRead = ioRead;
+            m.xWrite = ioWrite;
+            m.xTruncate = ioTruncate;
+            m.xSync = ioSync;
+            m.xFileSize = ioFileSize;
+            m.xLock = ioLock;
+            m.xUnlock = ioUnlock;
+            m.xCheckReservedLock = ioCheckReservedLock;
+            m.xFileControl = ioFileControl;
+            m.xSectorSize = ioSectorSize;
+            m.xDeviceCharacteristics = ioDeviceCharacteristics;
+            if (i >= 1) {
+               m.xShmMap = ioShmMap;
+               m.xShmLock = ioShmLock;
+               m.xShmBarrier = ioShmBarrier;
+               m.xShmUnmap = ioShmUnmap;
+            }
+            if (i >= 2) {
+               m.xFetch = ioFetch;
+               m.xUnfetch = ioUnfetch;
+            }
+         }
+      });
+      return &versions[std::min(std::max(version, 1), 3) - 1];
+   }
+
+   static int vfsOpen(::sqlite3_vfs *, const char *name, ::sqlite3_file *file, int flags, int *outFlags)
+   {
+      iofile *f = (iofile *) file;
+      ::memset(f, 0, sizeof(iofile));
+      f->real = (::sqlite3_file *) &f[1];
+      f->adviseFd = -1;
+
+      int result = base()->xOpen(base(), name, f->real, flags, outFlags);
+      if (result != SQLITE_OK || !f->real->pMethods) {
+         return result;
+      }
+
+      f->stats = &statsOf(name ? name : "(temporary)");
+      if (name && (flags & SQLITE_OPEN_MAIN_DB)) {
+         f->adviseFd = ::open(name, O_RDONLY);
+      }
+      file->pMethods = methods(f->real->pMethods->iVersion);
+      return SQLITE_OK;
+   }
+
+public:
+   /**
+    * The name the VFS is registered under.
+    *
+    * @return The name to pass to sqlite3_open_v2(), NULL (the default VFS,
+    *         nothing is counted) if registerVfs() failed.
+    */
+   static const char *name(void) { return registered() ? "tf-io" : NULL; }
+
+   /**
+    * Registers the VFS (not as the default). Calling this more than once
+    * does no harm.
+    *
+    * @return @c true on success, @c false else.
+    */
+   static bool registerVfs(void)
+   {
+      static ::sqlite3_vfs vfs;
+      if (registered()) {
+         return true;
+      }
+
+      base() = ::sqlite3_vfs_find(NULL);
+      if (!base()) {
+         return false;
+      }
+
+      vfs = *base();
+      vfs.szOsFile = sizeof(iofile) + base()->szOsFile;
+      vfs.zName = "tf-io";
+      vfs.pNext = NULL;
+      vfs.xOpen = vfsOpen;
+      registered() = SQLITE_OK == ::sqlite3_vfs_register(&vfs, 0);
+      return registered();
+   }
+
+   /**
+    * Adds to the statistics of a file, e.g. the I/O of a shard worker.
+    *
+    * @param file The name of the file.
+    * @param io   The I/O to add.
+    */
+   static void addStats(const std::string &file, const tfiostats &io)
+   {
+      tfiostats &stats = statsOf(file);
+      std::lock_guard<std::mutex> lock(filesMutex());
+      stats.reads += io.reads;
+      stats.bytesRead += io.bytesRead;
+      stats.writes += io.writes;
+      stats.bytesWritten += io.bytesWritten;
+      stats.syncs += io.syncs;
+      stats.readAheads += io.readAheads;
+      stats.readAheadBytes += io.readAheadBytes;
+   }
+
+   /**
+    * The statistics of all files.
+    *
+    * @return A copy of the statistics by file name.
+    */
+   static std::map<std::string, tfiostats> stats(void)
+   {
+      std::lock_guard<std::mutex> lock(filesMutex());
+      return files();
+   }
+
+   /**
+    * Sets all statistics to zero (files opened stay known).
+    */
+   static void resetStats(void)
+   {
+      std::lock_guard<std::mutex> lock(filesMutex());
+      for (std::pair<const std::string, tfiostats> &file : files()) {
+         ::memset(&file.second, 0, sizeof(file.second));
+      }
+   }
+};
+
+#endif
@@ -12,26 +12,62 @@
  *
  * Typical call:
  * ./transferFaces -l "Lightroom Catalog.lrcat" -a "Aperture Library.aplibrary" -k "Faces from Aperture"
+ *
+ * Shard mode (-j) needs SQLite's session extension, add to the compile command:
+ * -DSQLITE_ENABLE_SESSION -DSQLITE_ENABLE_PREUPDATE_HOOK
+ *
+ * Server mode (keeps the Aperture library in memory, jobs are sent with -c):
+ * ./transferFaces -a "Aperture Library.aplibrary" -S /tmp/transferFaces.sock
+ * ./transferFaces -c /tmp/transferFaces.sock -l "Lightroom Catalog.lrcat"
  */
 
 #include <iostream>
 #include <cstdlib>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
 #include <deque>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <string>
 #include <sqlite3.h>
-#include <uuid/uuid.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <climits>
+#include <csignal>
+#include <new>
+#include <memory>
 #include <CoreFoundation/CFString.h>
 #include "tf_sql.hpp"
+#include "tf_socket.hpp"
+#include "tf_metrics.hpp"
+#include "tf_histogram.hpp"
+#include "tf_perf.hpp"
+#include "tf_alloc.hpp"
+#include "tf_arena.hpp"
+#include "tf_vfs.hpp"
+#include "tf_prefetch.hpp"
+#include "tf_log.hpp"
+#include "tf_progress.hpp"
+#include "tf_estimate.hpp"
+#include "tf_stages.hpp"
+#include "tf_ring.hpp"
+#include "tf_steal.hpp"
+#include "tf_uuid.hpp"
+#include "tf_intern.hpp"
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 
+/// Everything printed goes through here.
+TFLog g_log;
 
 /// struct to store the data of a face
 typedef struct
@@ -47,11 +83,307 @@ typedef struct
    double tr_y;
 
    // The name of the person
-   std::string name;
+   TFString name;
+
+   // Flag whether the coordinates were converted for Lightroom already
+   bool oriented;
 } facedata;
 
-std::string g_keywordsRoot = "Faces from Aperture";
-std::string g_tagKeywordsRoot = "Tags from Aperture";
+/// The faces of one image, taken from the arena of the image. Only the list
+/// itself lives there; the names are interned TFStrings.
+typedef std::vector<facedata, TFArenaAllocator<facedata>> facelist;
+
+/// The keywords of one image while it is looked up, taken from the arena of
+/// the image like facelist.
+typedef std::deque<TFString, TFArenaAllocator<TFString>> keywordlist;
+
+/// Memory for data that is only needed while one image is transferred: its
+/// facelist and keywordlist. The file name, copy name, orientation and
+/// master UUID of the image stay std::string, as TFSql returns and binds
+/// them; they mostly fit into the string itself without allocating.
+TFArena g_imageArena;
+
+/// Counters of the current run, also the source of the statistics printed.
+TFMetrics g_metrics;
+/// Hardware counters per stage (only open with -P).
+TFPerfCounters g_perf;
+/// Allocations per stage (only counted with -A).
+TFAllocations g_allocations;
+/// Progress reports (only with -r or -R).
+TFProgress g_progress;
+/// The id_global values of new rows.
+TFUuidGenerator g_uuids;
+/// Images and faces done per shard worker, in memory shared with the workers.
+std::atomic<long long> *g_shardProgress = NULL;
+/// The slot of this shard worker in g_shardProgress.
+std::atomic<long long> *g_shardProgressSlot = NULL;
+
+/*
+ * Replacements of the global operator new and delete, to count allocations
+ * for the allocation profile (-A). They do not count anything unless
+ * g_allocations is enabled.
+ *
+ * operator delete is never inlined: GCC would otherwise see free() called
+ * on memory from operator new and warn (-Wmismatched-new-delete).
+ */
+void *operator new(std::size_t size)
+{
+   void *memory = ::malloc(size ? size : 1);
+   if (!memory) {
+      throw std::bad_alloc();
+   }
+   g_allocations.record(TF_ALLOC_CPP, size);
+   return memory;
+}
+
+void *operator new[](std::size_t size)
+{
+   return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+   void *memory = ::malloc(size ? size : 1);
+   if (memory) {
+      g_allocations.record(TF_ALLOC_CPP, size);
+   }
+   return memory;
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &nothrow) noexcept
+{
+   return operator new(size, nothrow);
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, const std::nothrow_t &) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory, const std::nothrow_t &) noexcept
+{
+   ::free(memory);
+}
+
+// C++14 calls the sized versions when the size is known.
+#if defined(__cpp_sized_deallocation)
+__attribute__((noinline)) void operator delete(void *memory, std::size_t) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory, std::size_t) noexcept
+{
+   ::free(memory);
+}
+#endif
+
+// C++17 calls the aligned versions for over-aligned types. They are replaced
+// as a whole, so memory is always released by the allocator it came from.
+#if defined(__cpp_aligned_new)
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+   void *memory = NULL;
+   if (0 != ::posix_memalign(&memory, std::max((std::size_t) alignment, sizeof(void *)), size ? size : 1)) {
+      return NULL;
+   }
+   g_allocations.record(TF_ALLOC_CPP, size);
+   return memory;
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+   void *memory = operator new(size, alignment, std::nothrow);
+   if (!memory) {
+      throw std::bad_alloc();
+   }
+   return memory;
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+   return operator new(size, alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &nothrow) noexcept
+{
+   return operator new(size, alignment, nothrow);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, std::align_val_t) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory, std::align_val_t) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, std::size_t, std::align_val_t) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory, std::size_t, std::align_val_t) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, std::align_val_t, const std::nothrow_t &) noexcept
+{
+   ::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory, std::align_val_t, const std::nothrow_t &) noexcept
+{
+   ::free(memory);
+}
+#endif
+
+/// The stages of a transfer, as selected with -o and -x.
+enum transferstage
+{
+   STAGE_FACES = 1 << 0,
+   STAGE_KEYWORDS = 1 << 1,
+   STAGE_STACKS = 1 << 2,
+   STAGE_GPS = 1 << 3,
+   STAGE_COOCCURRENCE = 1 << 4,
+   STAGE_ALBUMS = 1 << 5,
+   STAGE_RATINGS = 1 << 6,
+
+   STAGE_ALL = (1 << 7) - 1
+};
+
+/// The names of the stages, for the command line.
+const char *g_stageNames[] = {
+   "faces", "keywords", "stacks", "gps", "cooccurrence", "albums", "ratings"
+};
+
+std::string g_lightroomDBFile;
+std::string g_metricsFile;
+int g_metricsInterval;
+int g_slowestCount;
+bool g_perfCounters;
+bool g_allocationProfile;
+bool g_ioStats;
+int g_sqliteCacheMB;
+int g_prefetchDepth;
+TFLogLevel g_logLevel;
+int g_progressInterval;
+bool g_progressJson;
+bool g_estimateOnly;
+bool g_queueBenchmark;
+bool g_uuidSeeded;
+bool g_keywordTree;
+std::string g_sidecarDir;
+unsigned long long g_uuidSeed;
+std::string g_keywordsRoot;
+std::string g_tagKeywordsRoot;
+/// The collection set the albums of Aperture are recreated in.
+const std::string g_albumsCollectionSet = "Albums from Aperture";
+int g_shards;
+int g_stages;
+int g_stageThreads;
+int g_imageThreads;
+
+/**
+ * Sets all options that apply to one transfer run back to their defaults.
+ *
+ * Called once on startup and, in server mode, before each job is parsed so
+ * that no job inherits the options of the job before it.
+ */
+void resetRunOptions(void)
+{
+   g_lightroomDBFile = "./Lightroom Catalog.lrcat";
+   g_keywordsRoot = "Faces from Aperture";
+   g_tagKeywordsRoot = "Tags from Aperture";
+   g_shards = 1;
+   g_stages = STAGE_ALL;
+   g_stageThreads = 0;
+   g_imageThreads = 0;
+   g_metricsFile = "";
+   g_metricsInterval = 15;
+   g_slowestCount = 0;
+   g_perfCounters = false;
+   g_allocationProfile = false;
+   g_ioStats = false;
+   g_sqliteCacheMB = 0;
+   g_prefetchDepth = 0;
+   g_logLevel = TF_LOG_DETAIL;
+   g_progressInterval = 0;
+   g_progressJson = false;
+   g_estimateOnly = false;
+   g_queueBenchmark = false;
+   g_uuidSeeded = false;
+   g_keywordTree = false;
+   g_sidecarDir = "";
+   g_uuidSeed = 0;
+}
+
+/**
+ * Checks whether a stage of the transfer was selected.
+ *
+ * @param stage   The stage.
+ * @return @c true if the stage runs, @c false else.
+ */
+bool stageSelected(transferstage stage)
+{
+   return (g_stages & stage) != 0;
+}
+
+/**
+ * Checks whether names or keywords were lost because the pool of interned
+ * strings is full, and reports it.
+ *
+ * @return @c true if the results of the run are incomplete, @c false else.
+ */
+bool stringPoolExhausted(void)
+{
+   if (TFStringPool::global().isExhausted()) {
+      g_log.err() << "Too many distinct names and keywords: the string pool is full after "
+                  << TFStringPool::global().size() << " strings." << std::endl;
+      return true;
+   }
+   return false;
+}
+
+/**
+ * Parses a comma separated list of stage names.
+ *
+ * @param list     The list, e.g. "faces,gps".
+ * @param stages   Receives the stages of the list.
+ * @return @c true if all names are known, @c false else.
+ */
+bool parseStages(const std::string &list, int &stages)
+{
+   stages = 0;
+   std::stringstream stream(list);
+   std::string name;
+   while (std::getline(stream, name, ',')) {
+      int stage = 0;
+      for (int n = 0; n < (int) (sizeof(g_stageNames)/sizeof(const char *)); ++n) {
+         if (name == g_stageNames[n]) {
+            stage = 1 << n;
+         }
+      }
+      if (!stage) {
+         return false;
+      }
+      stages |= stage;
+   }
+   return stages != 0;
+}
 
 /**
  * Normalize a UTF-8 encoded string to use composed character form.
@@ -106,7 +438,7 @@ bool fixKeywordsUTF8(::sqlite3 *lightroomDB)
       std::string name = sql.column_str(2);
 
       if (name != "") {
-         std::cout << "Normalizing keyword \"" << name << "\"" << std::endl;
+         g_log.out(TF_LOG_DETAIL) << "Normalizing keyword \"" << name << "\"" << std::endl;
       }
 
       TFSql update(lightroomDB,
@@ -128,13 +460,13 @@ bool fixKeywordsUTF8(::sqlite3 *lightroomDB)
       update.step();
 
       if (update.hasFailed()) {
-         std::cerr << "Failed to update keyword to be in composed form: " << update.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to update keyword to be in composed form: " << update.getErrorMsg() << std::endl;
          return false;
       }
    }
 
    if (sql.hasFailed()) {
-      std::cerr << "Failed to update keywords to be in composed form: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to update keywords to be in composed form: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -161,16 +493,14 @@ int storeInt64(void *voidptr, int columnCount, char **columnTexts, char **column
  * Lightroom does not use IDs created by SQLite has a central ID counter that it
  * uses to find unique IDs.
  *
- * This method reads the current value, increments it by one and stores the new
- * value.
- * 
- * IMPROVE ME: Since we are the only one that writes to the database during face
- * transfer, we could handle this in memory and store the last value on exit.
+ * This method reads the current value, increments it by the number of IDs
+ * requested and stores the new value.
  *
  * @param lightroomDB   The handle of the lightroom database.
- * @return The next usable ID.
+ * @param count         The number of IDs to reserve.
+ * @return The first of the reserved IDs (or -1 on error).
  */
-::sqlite3_int64 getNextLocalID(::sqlite3 *lightroomDB) {
+::sqlite3_int64 reserveLocalIDs(::sqlite3 *lightroomDB, ::sqlite3_int64 count) {
    char *errorMsg = NULL;
    ::sqlite3_int64 id_local = -1;
    if (SQLITE_OK != ::sqlite3_exec(lightroomDB,
@@ -180,25 +510,68 @@ int storeInt64(void *voidptr, int columnCount, char **columnTexts, char **column
                                    storeInt64,
                                    (void *) &id_local,
                                    &errorMsg) || id_local < 0) {
-      std::cerr << "Failed to get next id_local: " << errorMsg << std::endl;
+      g_log.err() << "Failed to get next id_local: " << errorMsg << std::endl;
       sqlite3_free(errorMsg);
       return -1;
    }
-   if (SQLITE_OK != ::sqlite3_exec(lightroomDB,
-                                   "UPDATE Adobe_variablesTable "
-                                   "SET value = value + 1 "
-                                   "WHERE name = 'Adobe_entityIDCounter'",
-                                   NULL,
-                                   NULL,
-                                   &errorMsg)) {
-      std::cerr << "Failed to get next id_local: " << errorMsg << std::endl;
-      sqlite3_free(errorMsg);
+
+   TFSql sql(lightroomDB,
+             "UPDATE Adobe_variablesTable "
+             "SET value = value + ? "
+             "WHERE name = 'Adobe_entityIDCounter'");
+   sql.bind(1, count);
+   sql.step();
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to get next id_local: " << sql.getErrorMsg() << std::endl;
       return -1;
    }
 
    return id_local;
 }
 
+/// The next ID of the block set by setLocalIDBlock() (-1: no block in use).
+::sqlite3_int64 g_localIDBlockNext = -1;
+/// The first ID after the block set by setLocalIDBlock().
+::sqlite3_int64 g_localIDBlockEnd = -1;
+
+/**
+ * Makes getNextLocalID() hand out IDs from a block reserved beforehand by
+ * reserveLocalIDs() instead of using Lightroom's ID counter.
+ *
+ * Used by shard workers that must not touch the counter.
+ *
+ * @param first   The first ID of the block (-1 to use the counter again).
+ * @param end     The first ID after the block.
+ */
+void setLocalIDBlock(::sqlite3_int64 first, ::sqlite3_int64 end)
+{
+   g_localIDBlockNext = first;
+   g_localIDBlockEnd = end;
+}
+
+/**
+ * Returns the next free ID, either from Lightroom's ID counter or from the
+ * block set by setLocalIDBlock().
+ *
+ * IMPROVE ME: Since we are the only one that writes to the database during face
+ * transfer, we could handle this in memory and store the last value on exit.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @return The next usable ID.
+ */
+::sqlite3_int64 getNextLocalID(::sqlite3 *lightroomDB) {
+   if (g_localIDBlockNext < 0) {
+      return reserveLocalIDs(lightroomDB, 1);
+   }
+
+   if (g_localIDBlockNext >= g_localIDBlockEnd) {
+      g_log.err() << "Failed to get next id_local: Reserved block of IDs is exhausted" << std::endl;
+      return -1;
+   }
+
+   return g_localIDBlockNext++;
+}
+
 /** The Aperture importer of Lightroom creates a keyword for each person it
  * imports. It does not mark these as "persons" as it is done for keywords that
  * are created by Lightroom when you enter a new name for a detected face.
@@ -223,15 +596,31 @@ void fixApertureFaceTagToBePersons(::sqlite3 *lightroomDB, ::sqlite3_int64 faces
    sql.step();
 
    if (sql.hasFailed()) {
-      std::cerr << "Failed to fix face tags of aperture to be of type person: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to fix face tags of aperture to be of type person: " << sql.getErrorMsg() << std::endl;
    }
 }
 
+::sqlite3_int64 g_tags_keywords_root_id = -1;
+::sqlite3_int64 g_keywords_root_id = -1;
+std::string g_keywords_root_genealogy;
+
+/**
+ * Forgets the keyword root IDs cached by getTagRootKeywordId(),
+ * getRootKeywordId() and getRootKeywordGenealogy().
+ *
+ * The cached values belong to one Lightroom catalog. Server mode processes
+ * many catalogs in one process and has to call this before each job.
+ */
+void resetKeywordRootCache(void)
+{
+   g_tags_keywords_root_id = -1;
+   g_keywords_root_id = -1;
+   g_keywords_root_genealogy = "";
+}
+
 // TODO: Docu
 ::sqlite3_int64 getTagRootKeywordId(::sqlite3 *lightroomDB)
 {
-   static ::sqlite3_int64 g_tags_keywords_root_id = -1;
-
    if (g_tags_keywords_root_id >= 0) {
       return g_tags_keywords_root_id;
    }
@@ -248,7 +637,7 @@ void fixApertureFaceTagToBePersons(::sqlite3 *lightroomDB, ::sqlite3_int64 faces
       }
 
       if (sql.hasFailed()) {
-         std::cerr << "Failed to find tag keywords root: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to find tag keywords root: " << sql.getErrorMsg() << std::endl;
          return -1;
       }
    } else {
@@ -260,7 +649,7 @@ void fixApertureFaceTagToBePersons(::sqlite3 *lightroomDB, ::sqlite3_int64 faces
                                       storeInt64,
                                       (void *) &root_id,
                                       &errorMsg) || root_id < 0) {
-         std::cerr << "Failed to find keywords root: " << errorMsg << std::endl;
+         g_log.err() << "Failed to find keywords root: " << errorMsg << std::endl;
          sqlite3_free(errorMsg);
          return -1;
       }
@@ -283,8 +672,6 @@ void fixApertureFaceTagToBePersons(::sqlite3 *lightroomDB, ::sqlite3_int64 faces
  */
 ::sqlite3_int64 getRootKeywordId(::sqlite3 *lightroomDB)
 {
-   static ::sqlite3_int64 g_keywords_root_id = -1;
-
    if (g_keywords_root_id >= 0) {
       return g_keywords_root_id;
    }
@@ -301,7 +688,7 @@ void fixApertureFaceTagToBePersons(::sqlite3 *lightroomDB, ::sqlite3_int64 faces
       }
 
       if (sql.hasFailed()) {
-         std::cerr << "Failed to find keywords root: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to find keywords root: " << sql.getErrorMsg() << std::endl;
          return -1;
       }
 
@@ -315,7 +702,7 @@ void fixApertureFaceTagToBePersons(::sqlite3 *lightroomDB, ::sqlite3_int64 faces
                                       storeInt64,
                                       (void *) &root_id,
                                       &errorMsg) || root_id < 0) {
-         std::cerr << "Failed to find keywords root: " << errorMsg << std::endl;
+         g_log.err() << "Failed to find keywords root: " << errorMsg << std::endl;
          sqlite3_free(errorMsg);
          return -1;
       }
@@ -334,8 +721,6 @@ void fixApertureFaceTagToBePersons(::sqlite3 *lightroomDB, ::sqlite3_int64 faces
  */
 std::string getRootKeywordGenealogy(::sqlite3 *lightroomDB)
 {
-   static std::string g_keywords_root_genealogy;
-
    if (g_keywords_root_genealogy != "") {
       return g_keywords_root_genealogy;
    }
@@ -350,7 +735,7 @@ std::string getRootKeywordGenealogy(::sqlite3 *lightroomDB)
              "WHERE id_local = ?");
    sql.bind(1, root_id);
    if (!sql.step() || sql.hasFailed()) {
-      std::cerr << "Failed to select root genealogy: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to select root genealogy: " << sql.getErrorMsg() << std::endl;
       return "";
    }
    g_keywords_root_genealogy = sql.column_str(0);
@@ -385,11 +770,12 @@ std::string findImageUUIDForFilename(::sqlite3 *apertureDB,
 
       if (sql.step()) {
          if (sql.column_int64(1) == 0) {
-            std::cerr << "Warning: More than one UUID for filename " << fileName << ", date " << imageDate << std::endl;
+            g_log.err() << "Warning: More than one UUID for filename " << fileName << ", date " << imageDate << std::endl;
          }
       }
    } else if (!sql.hasFailed()) {
-      std::cerr << "Warning: Did not find UUID for image list statement of file " << fileName << ", " << imageDate << " ";
+      g_metrics.increment(TF_FALLBACK_MATCHES);
+      g_log.err() << "Warning: Did not find UUID for image list statement of file " << fileName << ", " << imageDate << " ";
 
       sql.reset("SELECT uuid "
                 "FROM RKMaster "
@@ -398,90 +784,241 @@ std::string findImageUUIDForFilename(::sqlite3 *apertureDB,
       if (sql.step()) {
          masterUUID = sql.column_str(0);
          if (sql.step()) {
-            std::cerr << std::endl;
-            std::cerr << "Error: Searching for UUID for image list statement of file " << fileName << ", " << imageDate << " was not unique when searching for file creation time only";
+            g_log.err() << std::endl;
+            g_log.err() << "Error: Searching for UUID for image list statement of file " << fileName << ", " << imageDate << " was not unique when searching for file creation time only";
             masterUUID = "";
          } else {
-            std::cerr << "but found by creation date.";
+            g_log.err() << "but found by creation date.";
          }
       } else {
-         std::cerr << std::endl;
-         std::cerr << "Error: Searching for UUID for image list statement of file " << fileName << ", " << imageDate << " did not find UUID";
+         g_log.err() << std::endl;
+         g_log.err() << "Error: Searching for UUID for image list statement of file " << fileName << ", " << imageDate << " did not find UUID";
       }
 
-      std::cerr << std::endl;
+      g_log.err() << std::endl;
    }
 
    if (sql.hasFailed()) {
-      std::cerr << "Failed to read UUID for image list statement of file " << fileName << ", " << imageDate<< ": " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to read UUID for image list statement of file " << fileName << ", " << imageDate<< ": " << sql.getErrorMsg() << std::endl;
       return "";
    }
    return masterUUID;
 }
 
+/// Faces of one image whose rectangles overlap at least this much
+/// (intersection over union) are taken to be the same face.
+const double DUPLICATE_FACE_OVERLAP = 0.7;
+
+/**
+ * Removes duplicate faces of one image: Aperture keeps a second row of a face
+ * when it was rejected and detected again or when detection ran twice.
+ *
+ * Two faces are duplicates if their bounding rectangles overlap by
+ * DUPLICATE_FACE_OVERLAP or more and they do not have different names. Faces
+ * with a name are looked at first, so of two duplicates the named one is
+ * kept. To not compare all pairs, the faces kept are put into a uniform grid
+ * over the image (about one cell per face) and a face is only compared to
+ * the ones in the cells it covers.
+ *
+ * @param faces   The faces.
+ * @param first   The index of the first face of the image in faces.
+ * @return The number of faces removed.
+ */
+size_t removeDuplicateFaces(facelist &faces, size_t first)
+{
+   size_t count = faces.size() - first;
+   if (count < 2) {
+      return 0;
+   }
+
+   struct rectangle
+   {
+      double left, top, right, bottom;
+   };
+   std::vector<rectangle> rectangles(count);
+   for (size_t n = 0; n < count; ++n) {
+      const facedata &face = faces[first + n];
+      rectangle &r = rectangles[n];
+      r.left = std::min(std::min(face.tl_x, face.tr_x), std::min(face.bl_x, face.br_x));
+      r.right = std::max(std::max(face.tl_x, face.tr_x), std::max(face.bl_x, face.br_x));
+      r.top = std::min(std::min(face.tl_y, face.tr_y), std::min(face.bl_y, face.br_y));
+      r.bottom = std::max(std::max(face.tl_y, face.tr_y), std::max(face.bl_y, face.br_y));
+   }
+
+   auto sameFace = [&](size_t a, size_t b) {
+      const TFString &nameA = faces[first + a].name;
+      const TFString &nameB = faces[first + b].name;
+      if (!nameA.empty() && !nameB.empty() && nameA != nameB) {
+         return false;
+      }
+      const rectangle &ra = rectangles[a];
+      const rectangle &rb = rectangles[b];
+      double width = std::min(ra.right, rb.right) - std::max(ra.left, rb.left);
+      double height = std::min(ra.bottom, rb.bottom) - std::max(ra.top, rb.top);
+      if (width < 0 || height < 0) {
+         return false;
+      }
+      double overlap = width * height;
+      double area = (ra.right - ra.left) * (ra.bottom - ra.top)
+                  + (rb.right - rb.left) * (rb.bottom - rb.top) - overlap;
+      return area > 0 ? overlap >= DUPLICATE_FACE_OVERLAP * area : true;
+   };
+
+   // Named faces first.
+   std::vector<size_t> order;
+   order.reserve(count);
+   for (size_t n = 0; n < count; ++n) {
+      if (!faces[first + n].name.empty()) {
+         order.push_back(n);
+      }
+   }
+   for (size_t n = 0; n < count; ++n) {
+      if (faces[first + n].name.empty()) {
+         order.push_back(n);
+      }
+   }
+
+   int cells = std::min(16, (int) std::ceil(std::sqrt((double) count)));
+   auto cellOf = [cells](double position) {
+      return std::min(std::max((int) (position * cells), 0), cells - 1);
+   };
+   std::vector<std::vector<size_t>> grid(cells * cells);
+   std::vector<bool> keep(count, false);
+   for (size_t n : order) {
+      const rectangle &r = rectangles[n];
+      int left = cellOf(r.left), right = cellOf(r.right);
+      int top = cellOf(r.top), bottom = cellOf(r.bottom);
+
+      bool duplicate = false;
+      for (int y = top; y <= bottom && !duplicate; ++y) {
+         for (int x = left; x <= right && !duplicate; ++x) {
+            for (size_t kept : grid[y * cells + x]) {
+               if (sameFace(n, kept)) {
+                  duplicate = true;
+                  break;
+               }
+            }
+         }
+      }
+      if (duplicate) {
+         continue;
+      }
+
+      keep[n] = true;
+      for (int y = top; y <= bottom; ++y) {
+         for (int x = left; x <= right; ++x) {
+            grid[y * cells + x].push_back(n);
+         }
+      }
+   }
+
+   // Keep the order of the faces.
+   size_t next = first;
+   for (size_t n = 0; n < count; ++n) {
+      if (keep[n]) {
+         faces[next++] = faces[first + n];
+      }
+   }
+   faces.erase(faces.begin() + next, faces.end());
+
+   return first + count - next;
+}
+
+/**
+ * Finds all face data stored in Aperture's database for a master image.
+ *
+ * Duplicates are removed, see removeDuplicateFaces().
+ *
+ * @param result        The list to add the faces to.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @param masterUUID    The UUID of the master.
+ * @return @c true on success, @c false else.
+ */
+bool findFacesForMaster(facelist &result,
+                        ::sqlite3 *facesDB,
+                        const std::string &masterUUID)
+{
+   size_t first = result.size();
+
+   TFSql sql(facesDB,
+             "SELECT bottomLeftX, bottomLeftY, bottomRightX, bottomRightY, topLeftX, topLeftY, topRightX, topRightY, faceKey "
+             "FROM RKDetectedFace "
+             "WHERE masterUuid = ? "
+             "AND rejected = 0 ");
+   sql.bind(1, masterUUID);
+   while (sql.step()) {
+      facedata fd;
+      fd.bl_x = sql.column_double(0);
+      fd.bl_y = sql.column_double(1);
+      fd.br_x = sql.column_double(2);
+      fd.br_y = sql.column_double(3);
+      fd.tl_x = sql.column_double(4);
+      fd.tl_y = sql.column_double(5);
+      fd.tr_x = sql.column_double(6);
+      fd.tr_y = sql.column_double(7);
+      fd.name = TFString();
+      fd.oriented = false;
+
+      ::sqlite_int64 faceKey = sql.column_double(8);
+
+      if (!sql.hasFailed()) {
+         TFSql faceNameSql(facesDB,
+                   "SELECT name "
+                   "FROM RKFaceName "
+                   "WHERE faceKey = ?");
+         faceNameSql.bind(1, faceKey);
+         if (faceNameSql.step()) {
+            fd.name = TFString(normalizeUTF8(faceNameSql.column_str(0)));
+         }
+
+         if (!faceNameSql.hasFailed()) {
+            result.push_back(fd);
+         } else {
+            g_log.err() << "Failed to get name of face: " << faceNameSql.getErrorMsg() << std::endl;
+         }
+      }
+   }
+
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to list faces: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   // Counted like the faces inserted: for each image processed, so a master
+   // with several versions counts its duplicates once per version.
+   size_t duplicates = removeDuplicateFaces(result, first);
+   if (duplicates > 0) {
+      g_metrics.increment(TF_DUPLICATE_FACES, duplicates);
+      g_log.out(TF_LOG_DETAIL) << "Dropped " << duplicates << " duplicate faces of master " << masterUUID << std::endl;
+   }
+
+   return true;
+}
+
 /**
  * Finds all face data stored in Aperture's database for a given image.
  *
+ * @param result        The list to add the faces to.
  * @param apertureDB    The handle of the Aperture database.
  * @param facesDB       The handle of the face DB of Aperture.
  * @param fileName      The filename of the image to search.
  * @param imageDate     The date the image was taken (in Aperture's semantic, Mac epoch!).
- * @return A list of facedata structs.
+ * @return @c true on success, @c false else.
  */
-std::deque<facedata> findFacesForImage(::sqlite3 *apertureDB,
-                                      ::sqlite3 *facesDB,
-                                      const std::string &fileName,
-                                      ::sqlite3_int64 imageDate)
+bool findFacesForImage(facelist &result,
+                       ::sqlite3 *apertureDB,
+                       ::sqlite3 *facesDB,
+                       const std::string &fileName,
+                       ::sqlite3_int64 imageDate)
 {
-   std::deque<facedata> result;
 
    std::string masterUUID = findImageUUIDForFilename(apertureDB, fileName, imageDate);
    if (masterUUID != "") {
-      TFSql sql(facesDB,
-                "SELECT bottomLeftX, bottomLeftY, bottomRightX, bottomRightY, topLeftX, topLeftY, topRightX, topRightY, faceKey "
-                "FROM RKDetectedFace "
-                "WHERE masterUuid = ? "
-                "AND rejected = 0 ");
-      sql.bind(1, masterUUID);
-      while (sql.step()) {
-         facedata fd;
-         fd.bl_x = sql.column_double(0);
-         fd.bl_y = sql.column_double(1);
-         fd.br_x = sql.column_double(2);
-         fd.br_y = sql.column_double(3);
-         fd.tl_x = sql.column_double(4);
-         fd.tl_y = sql.column_double(5);
-         fd.tr_x = sql.column_double(6);
-         fd.tr_y = sql.column_double(7);
-         fd.name = "";
-
-         ::sqlite_int64 faceKey = sql.column_double(8);
-
-         if (!sql.hasFailed()) {
-            TFSql faceNameSql(facesDB,
-                      "SELECT name "
-                      "FROM RKFaceName "
-                      "WHERE faceKey = ?");
-            faceNameSql.bind(1, faceKey);
-            if (faceNameSql.step()) {
-               fd.name = normalizeUTF8(faceNameSql.column_str(0));
-            }
-
-            if (!faceNameSql.hasFailed()) {
-               result.push_back(fd);
-            } else {
-               std::cerr << "Failed to get name of face: " << faceNameSql.getErrorMsg() << std::endl;
-            }
-         }
-      }
-
-      if (sql.hasFailed()) {
-         std::cerr << "Failed to list faces: " << sql.getErrorMsg() << std::endl;
-         return result;
-      }
+      g_metrics.increment(TF_IMAGES_MATCHED);
+      return findFacesForMaster(result, facesDB, masterUUID);
    }
 
-   return result;
+   return true;
 }
 
 /**
@@ -494,7 +1031,7 @@ std::deque<facedata> findFacesForImage(::sqlite3 *apertureDB,
  * @param name          The name of the person/keyword to find.
  * @return The ID of the keyword or -1 if no such keyword was found.
  */
-::sqlite3_int64 findExistingKeywordID(::sqlite3 *lightroomDB, std::string &name)
+::sqlite3_int64 findExistingKeywordID(::sqlite3 *lightroomDB, const std::string &name)
 {
    TFSql sql(lightroomDB,
              "SELECT id_local "
@@ -508,7 +1045,7 @@ std::deque<facedata> findFacesForImage(::sqlite3 *apertureDB,
    ::sqlite3_int64 existing_id = -1;
    if (!sql.step()) {
       if (sql.hasFailed()) {
-         std::cerr << "Failed to read existing keyword: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to read existing keyword: " << sql.getErrorMsg() << std::endl;
          return -1;
       }
    } else {
@@ -519,18 +1056,17 @@ std::deque<facedata> findFacesForImage(::sqlite3 *apertureDB,
 }
 
 /**
- * Helper that creates a new random UUID.
+ * Helper that binds a new random UUID, e.g. for an id_global column.
  *
- * @return Newly created UUID.
+ * @param sql     The statement.
+ * @param index   The index of the template parameter (1-based).
+ * @return @c true on success, @c false when in error state.
  */
-std::string uuid(void)
+bool bindNewUUID(TFSql &sql, int index)
 {
-   ::uuid_t uuidStruct;
-   ::uuid_generate_random(uuidStruct);
-   char s[37];
-   ::uuid_unparse(uuidStruct, s);
-
-   return s;
+   char uuid[TFUuidGenerator::LENGTH];
+   g_uuids.generate(uuid);
+   return sql.bind(index, uuid, sizeof(uuid));
 }
 
 /**
@@ -562,7 +1098,7 @@ std::string uuid(void)
              "       ?, "
              "       ?)");
    sql.bind(1, id_local);
-   sql.bind(2, uuid());
+   bindNewUUID(sql, 2);
    if (type) {
       sql.bind(3, std::string(type));
    } else {
@@ -573,9 +1109,10 @@ std::string uuid(void)
    sql.bind(6, root_id);
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to insert keyword: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to insert keyword: " << sql.getErrorMsg() << std::endl;
       return -1;
    }
+   g_metrics.increment(TF_KEYWORDS_CREATED);
 
    // Build genealogy string
    std::stringstream genealogy_stream;
@@ -589,7 +1126,7 @@ std::string uuid(void)
    sql.bind(2, id_local);
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to set genealogy of keyword: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to set genealogy of keyword: " << sql.getErrorMsg() << std::endl;
       return -1;
    }
 
@@ -619,7 +1156,7 @@ std::string uuid(void)
    sql.bind(1, id_local);
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to insert cluster: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to insert cluster: " << sql.getErrorMsg() << std::endl;
       return -1;
    }
 
@@ -627,24 +1164,19 @@ std::string uuid(void)
 }
 
 /**
- * Creates the entries for one face.
+ * Converts the coordinates of a face from Aperture's coordinate system to
+ * Lightroom's, unless that was done already.
  *
- * @param lightroomDB   The handle of the lightroom database.
- * @param facedata      The data (position and person name) of the face to create.
- * @param clusterID     The ID of the AgLibraryFaceCluster entry.
- * @param imageID       The ID of the image that contains the face.
+ * @param facedata      The face.
  * @param orientation   The orientation of the image (AB: portrait, BC:
  *                      clockwise, CD: upside-down, DA: counter-clockwise)
- * @return The ID of the created entry in the AgLibraryFace table.
  */
-::sqlite3_int64 createFace(::sqlite3 *lightroomDB, facedata &facedata,
-                           ::sqlite_int64 clusterID, ::sqlite_int64 imageID,
-                           std::string orientation)
+void orientFace(facedata &facedata, const std::string &orientation)
 {
-   ::sqlite3_int64 id_local = getNextLocalID(lightroomDB);
-   if (id_local < 0) {
-      return -1;
+   if (facedata.oriented) {
+      return;
    }
+   facedata.oriented = true;
 
    double bl_x = facedata.bl_x;
    double bl_y = facedata.bl_y;
@@ -655,70 +1187,88 @@ std::string uuid(void)
    double tr_x = facedata.tr_x;
    double tr_y = facedata.tr_y;
 
-   // Aperture uses a slightly different coordinate system than Lightroom.
-   // Convert here ...
    if (orientation == "AB") {
-      bl_y = 1-facedata.bl_y;
-      br_y = 1-facedata.br_y;
-      tl_y = 1-facedata.tl_y;
-      tr_y = 1-facedata.tr_y;
+      facedata.bl_y = 1-bl_y;
+      facedata.br_y = 1-br_y;
+      facedata.tl_y = 1-tl_y;
+      facedata.tr_y = 1-tr_y;
    } else if (orientation == "BC") {
-      bl_x = facedata.bl_y;
-      br_x = facedata.br_y;
-      tl_x = facedata.tl_y;
-      tr_x = facedata.tr_y;
-      bl_y = facedata.bl_x;
-      br_y = facedata.br_x;
-      tl_y = facedata.tl_x;
-      tr_y = facedata.tr_x;
+      facedata.bl_x = bl_y;
+      facedata.br_x = br_y;
+      facedata.tl_x = tl_y;
+      facedata.tr_x = tr_y;
+      facedata.bl_y = bl_x;
+      facedata.br_y = br_x;
+      facedata.tl_y = tl_x;
+      facedata.tr_y = tr_x;
    } else if (orientation == "CD") {
-      bl_x = 1-facedata.bl_x;
-      br_x = 1-facedata.br_x;
-      tl_x = 1-facedata.tl_x;
-      tr_x = 1-facedata.tr_x;
-      bl_y = facedata.bl_y;
-      br_y = facedata.br_y;
-      tl_y = facedata.tl_y;
-      tr_y = facedata.tr_y;
+      facedata.bl_x = 1-bl_x;
+      facedata.br_x = 1-br_x;
+      facedata.tl_x = 1-tl_x;
+      facedata.tr_x = 1-tr_x;
    } else if (orientation == "DA") {
-      bl_x = 1-facedata.bl_y;
-      br_x = 1-facedata.br_y;
-      tl_x = 1-facedata.tl_y;
-      tr_x = 1-facedata.tr_y;
-      bl_y = 1-facedata.bl_x;
-      br_y = 1-facedata.br_x;
-      tl_y = 1-facedata.tl_x;
-      tr_y = 1-facedata.tr_x;
+      facedata.bl_x = 1-bl_y;
+      facedata.br_x = 1-br_y;
+      facedata.tl_x = 1-tl_y;
+      facedata.tr_x = 1-tr_y;
+      facedata.bl_y = 1-bl_x;
+      facedata.br_y = 1-br_x;
+      facedata.tl_y = 1-tl_x;
+      facedata.tr_y = 1-tr_x;
    }
+}
 
-   TFSql sql(lightroomDB,
-             "INSERT into AgLibraryFace "
-             "            (id_local, "
-             "             bl_x, bl_y, br_x, br_y, tl_x, tl_y, tr_x, tr_y, "
-             "             cluster, compatibleVersion, ignored, image, imageOrientation, "
-             "             orientation, origination, propertiesCache, regionType, "
-             "             skipSuggestion, version) "
-             "VALUES(?, "
-             "       ?, ?, ?, ?, ?, ?, ?, ?, "
-             "       ?, 3.0, NULL, ?, ?, "
+/**
+ * Creates the entries for one face.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param facedata      The data (position and person name) of the face to create.
+ * @param clusterID     The ID of the AgLibraryFaceCluster entry.
+ * @param imageID       The ID of the image that contains the face.
+ * @param orientation   The orientation of the image (AB: portrait, BC:
+ *                      clockwise, CD: upside-down, DA: counter-clockwise)
+ * @return The ID of the created entry in the AgLibraryFace table.
+ */
+::sqlite3_int64 createFace(::sqlite3 *lightroomDB, facedata &facedata,
+                           ::sqlite_int64 clusterID, ::sqlite_int64 imageID,
+                           std::string orientation)
+{
+   ::sqlite3_int64 id_local = getNextLocalID(lightroomDB);
+   if (id_local < 0) {
+      return -1;
+   }
+
+   // Aperture uses a slightly different coordinate system than Lightroom.
+   orientFace(facedata, orientation);
+
+   TFSql sql(lightroomDB,
+             "INSERT into AgLibraryFace "
+             "            (id_local, "
+             "             bl_x, bl_y, br_x, br_y, tl_x, tl_y, tr_x, tr_y, "
+             "             cluster, compatibleVersion, ignored, image, imageOrientation, "
+             "             orientation, origination, propertiesCache, regionType, "
+             "             skipSuggestion, version) "
+             "VALUES(?, "
+             "       ?, ?, ?, ?, ?, ?, ?, ?, "
+             "       ?, 3.0, NULL, ?, ?, "
              "       0, 1.0, NULL, 1.0, "
              "       NULL, 2.0)");
    sql.bind(1, id_local);
-   sql.bind(2, bl_x);
-   sql.bind(3, bl_y);
-   sql.bind(4, br_x);
-   sql.bind(5, br_y);
-   sql.bind(6, tl_x);
-   sql.bind(7, tl_y);
-   sql.bind(8, tr_x);
-   sql.bind(9, tr_y);
+   sql.bind(2, facedata.bl_x);
+   sql.bind(3, facedata.bl_y);
+   sql.bind(4, facedata.br_x);
+   sql.bind(5, facedata.br_y);
+   sql.bind(6, facedata.tl_x);
+   sql.bind(7, facedata.tl_y);
+   sql.bind(8, facedata.tr_x);
+   sql.bind(9, facedata.tr_y);
    sql.bind(10, clusterID);
    sql.bind(11, imageID);
    sql.bind(12, orientation);
 
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to insert face data: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to insert face data: " << sql.getErrorMsg() << std::endl;
       return -1;
    }
 
@@ -752,13 +1302,22 @@ bool createFaceData(::sqlite3 *lightroomDB, ::sqlite3_int64 faceID)
 
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to insert face data: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to insert face data: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
    return true;
 }
 
+/**
+ * If set, incrementKeywordPopularity() only records the keyword ID here.
+ *
+ * The popularity of a keyword depends on the order of all increments. Shard
+ * workers record them and the increments are replayed in image order once
+ * all shards are merged.
+ */
+std::deque<::sqlite3_int64> *g_deferredPopularity = NULL;
+
 /**
  * Whenever you use a keyword in Lightroom, its popularity increases by the
  * current value of "LibraryKeywordSuggestions_popularityIncrement". This
@@ -773,6 +1332,11 @@ bool createFaceData(::sqlite3 *lightroomDB, ::sqlite3_int64 faceID)
  */
 bool incrementKeywordPopularity(::sqlite3 *lightroomDB, ::sqlite3_int64 keywordID)
 {
+   if (g_deferredPopularity) {
+      g_deferredPopularity->push_back(keywordID);
+      return true;
+   }
+
    TFSql sql(lightroomDB,
              "SELECT value "
              "FROM Adobe_variablesTable "
@@ -781,7 +1345,7 @@ bool incrementKeywordPopularity(::sqlite3 *lightroomDB, ::sqlite3_int64 keywordI
    double popularityStep = sql.column_double(0);
 
    if (sql.hasFailed()) {
-      std::cerr << "Failed to read popularity base value: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to read popularity base value: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -791,7 +1355,7 @@ bool incrementKeywordPopularity(::sqlite3 *lightroomDB, ::sqlite3_int64 keywordI
    sql.bind(1, popularityStep * 1.1);
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to update popularity base value: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to update popularity base value: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -805,7 +1369,7 @@ bool incrementKeywordPopularity(::sqlite3 *lightroomDB, ::sqlite3_int64 keywordI
    sql.bind(1, keywordID);
    if (!sql.step()) {
       if (sql.hasFailed()) {
-         std::cerr << "Failed to find keyword in keyword popularity list: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to find keyword in keyword popularity list: " << sql.getErrorMsg() << std::endl;
          return false;
       }
 
@@ -833,7 +1397,7 @@ bool incrementKeywordPopularity(::sqlite3 *lightroomDB, ::sqlite3_int64 keywordI
    sql.step();
 
    if (sql.hasFailed()) {
-      std::cerr << "Failed to update/insert popularity in keyword popularity list: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to update/insert popularity in keyword popularity list: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -862,7 +1426,7 @@ bool createKeywordImage(::sqlite3 *lightroomDB, ::sqlite3_int64 imageID, ::sqlit
    sql.step();
    ::sqlite3_int64 count = sql.column_int64(0);
    if (sql.hasFailed()) {
-      std::cerr << "Failed to select keyword image: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to select keyword image: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -882,9 +1446,10 @@ bool createKeywordImage(::sqlite3 *lightroomDB, ::sqlite3_int64 imageID, ::sqlit
 
       sql.step();
       if (sql.hasFailed()) {
-         std::cerr << "Failed to insert keyword image: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to insert keyword image: " << sql.getErrorMsg() << std::endl;
          return false;
       }
+      g_metrics.increment(TF_LINKS_INSERTED);
 
       if (!incrementKeywordPopularity(lightroomDB, keywordID)) {
          return false;
@@ -921,7 +1486,7 @@ bool createKeywordFace(::sqlite3 *lightroomDB, ::sqlite3_int64 faceID,
 
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to insert keyword face: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to insert keyword face: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -956,7 +1521,7 @@ bool createFaceProcessHistory(::sqlite3 *lightroomDB, ::sqlite_int64 image_id, s
       id_local = sql.column_int64(0);
    }
    if (sql.hasFailed()) {
-      std::cerr << "Failed to find existing process history id: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to find existing process history id: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -986,7 +1551,7 @@ bool createFaceProcessHistory(::sqlite3 *lightroomDB, ::sqlite_int64 image_id, s
 
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to insert process history: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to insert process history: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -1014,7 +1579,7 @@ bool removeLightroomFacesForImage(::sqlite3 *lightroomDB, ::sqlite_int64 image_i
       sql.bind(2, image_id);
       sql.step();
       if (sql.hasFailed()) {
-         std::cerr << "Failed to remove keywords: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to remove keywords: " << sql.getErrorMsg() << std::endl;
          return false;
       }
    }
@@ -1033,7 +1598,7 @@ bool removeLightroomFacesForImage(::sqlite3 *lightroomDB, ::sqlite_int64 image_i
       sql.bind(1, image_id);
       sql.step();
       if (sql.hasFailed()) {
-         std::cerr << "Failed to execute " << removes[i] << ": " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to execute " << removes[i] << ": " << sql.getErrorMsg() << std::endl;
          return false;
       }
    }
@@ -1041,6 +1606,15 @@ bool removeLightroomFacesForImage(::sqlite3 *lightroomDB, ::sqlite_int64 image_i
    return true;
 }
 
+/**
+ * If set, createFaceEntry() takes the keyword IDs of people from here instead
+ * of searching or creating them in the catalog.
+ *
+ * Shard workers work on a copy of the catalog taken before the keywords were
+ * recreated, the parent creates all people beforehand.
+ */
+std::unordered_map<TFString, ::sqlite3_int64> *g_personKeywords = NULL;
+
 /**
  * Main routine to create all data required for one new face entry.
  *
@@ -1053,10 +1627,17 @@ bool removeLightroomFacesForImage(::sqlite3 *lightroomDB, ::sqlite_int64 image_i
 bool createFaceEntry(::sqlite3 *lightroomDB, facedata &facedata, ::sqlite_int64 image_id, std::string orientation)
 {
    ::sqlite3_int64 keywordID = -1;
-   if (facedata.name != "") {
-      keywordID = findExistingKeywordID(lightroomDB, facedata.name);
+   if (!facedata.name.empty() && g_personKeywords) {
+      auto iter = g_personKeywords->find(facedata.name);
+      if (iter == g_personKeywords->end()) {
+         g_log.err() << "No keyword was created for " << facedata.name << std::endl;
+         return false;
+      }
+      keywordID = iter->second;
+   } else if (!facedata.name.empty()) {
+      keywordID = findExistingKeywordID(lightroomDB, facedata.name.str());
       if (keywordID == -1) {
-         keywordID = createNewKeyword(lightroomDB, facedata.name, getRootKeywordId(lightroomDB), "person");
+         keywordID = createNewKeyword(lightroomDB, facedata.name.str(), getRootKeywordId(lightroomDB), "person");
       }
       if (keywordID == -1) {
          return false;
@@ -1113,7 +1694,7 @@ bool insertOrIncreaseCooccurence(::sqlite3 *lightroomDB,
       count = oldCount.column_int64(1);
    }
    if (oldCount.hasFailed()) {
-      std::cerr << "Failed to get old count of coocurrence: " << oldCount.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to get old count of coocurrence: " << oldCount.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -1126,7 +1707,7 @@ bool insertOrIncreaseCooccurence(::sqlite3 *lightroomDB,
       update.bind(2, id_local);
       update.step();
       if (update.hasFailed()) {
-         std::cerr << "Updateing Cooccurrence failed: " << update.getErrorMsg() << std::endl;
+         g_log.err() << "Updateing Cooccurrence failed: " << update.getErrorMsg() << std::endl;
          return false;
       }
    } else {
@@ -1142,7 +1723,7 @@ bool insertOrIncreaseCooccurence(::sqlite3 *lightroomDB,
       insert.bind(3, tag2);
       insert.step();
       if (insert.hasFailed()) {
-         std::cerr << "Inserting Cooccurrence failed: " << insert.getErrorMsg() << std::endl;
+         g_log.err() << "Inserting Cooccurrence failed: " << insert.getErrorMsg() << std::endl;
          return false;
       }
    }
@@ -1162,7 +1743,7 @@ bool rebuildKeywordCoocurrences(::sqlite3 *lightroomDB)
                  "DELETE FROM AgLibraryKeywordCooccurrence");
    cleanup.step();
    if (cleanup.hasFailed()) {
-      std::cerr << "Failed to remove old cooccurrences: " << cleanup.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove old cooccurrences: " << cleanup.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -1196,7 +1777,7 @@ bool rebuildKeywordCoocurrences(::sqlite3 *lightroomDB)
    }
 
    if (images.hasFailed()) {
-      std::cerr << "Failed to set Coocurrences: " << images.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to set Coocurrences: " << images.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -1221,27 +1802,27 @@ bool removeAllKeywords(::sqlite3 *lightroomDB)
    sql6.step();
 
    if (sql1.hasFailed()) {
-      std::cerr << "Failed to remove all keywords: " << sql1.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all keywords: " << sql1.getErrorMsg() << std::endl;
       return false;
    }
    if (sql2.hasFailed()) {
-      std::cerr << "Failed to remove all keywords: " << sql2.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all keywords: " << sql2.getErrorMsg() << std::endl;
       return false;
    }
    if (sql3.hasFailed()) {
-      std::cerr << "Failed to remove all keywords: " << sql3.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all keywords: " << sql3.getErrorMsg() << std::endl;
       return false;
    }
    if (sql4.hasFailed()) {
-      std::cerr << "Failed to remove all keywords: " << sql4.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all keywords: " << sql4.getErrorMsg() << std::endl;
       return false;
    }
    if (sql5.hasFailed()) {
-      std::cerr << "Failed to remove all keywords: " << sql5.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all keywords: " << sql5.getErrorMsg() << std::endl;
       return false;
    }
    if (sql6.hasFailed()) {
-      std::cerr << "Failed to remove all keywords: " << sql6.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all keywords: " << sql6.getErrorMsg() << std::endl;
       return false;
    }
    return true;
@@ -1268,13 +1849,41 @@ bool removeAllKeywords(::sqlite3 *lightroomDB)
    sql.bind(1, masterUUID);
    sql.bind(2, copyNr);
    if (!sql.step()) {
-      std::cerr << "Failed to find version ID from master UUID " << masterUUID << ", copy " << copyName << ":" << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to find version ID from master UUID " << masterUUID << ", copy " << copyName << ":" << sql.getErrorMsg() << std::endl;
       return -1;
    }
    return sql.column_int64(0);
 }
 
-bool findKeywordsForVersion(std::deque<std::string> &result,
+template <typename Keywords>
+bool findKeywordsForMaster(Keywords &result,
+                           ::sqlite3 *apertureDB,
+                           const std::string &masterUUID,
+                           const std::string &copyName)
+{
+   ::sqlite3_int64 versionID = findVersionIDForMaster(apertureDB, masterUUID, copyName);
+   if (versionID >= 0) {
+      TFSql sql(apertureDB,
+                "SELECT K.name "
+                "FROM RKKeyword K, RKKeywordForVersion V "
+                "WHERE K.modelId = V.keywordId "
+                "AND V.versionId = ?");
+      sql.bind(1, versionID);
+
+      while (sql.step()) {
+         result.push_back(TFString(normalizeUTF8(sql.column_str(0))));
+      }
+
+      if (!sql.hasFailed()) {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+template <typename Keywords>
+bool findKeywordsForVersion(Keywords &result,
                             ::sqlite3 *apertureDB,
                             const std::string &fileName,
                             ::sqlite3_int64 imageDate,
@@ -1282,26 +1891,49 @@ bool findKeywordsForVersion(std::deque<std::string> &result,
 {
    std::string masterUUID = findImageUUIDForFilename(apertureDB, fileName, imageDate);
    if (masterUUID != "") {
-      ::sqlite3_int64 versionID = findVersionIDForMaster(apertureDB, masterUUID, copyName);
-      if (versionID >= 0) {
-         TFSql sql(apertureDB,
-                   "SELECT K.name "
-                   "FROM RKKeyword K, RKKeywordForVersion V "
-                   "WHERE K.modelId = V.keywordId "
-                   "AND V.versionId = ?");
-         sql.bind(1, versionID);
+      return findKeywordsForMaster(result, apertureDB, masterUUID, copyName);
+   }
 
-         while (sql.step()) {
-            result.push_back(sql.column_str(0));
-         }
+   return false;
+}
 
-         if (!sql.hasFailed()) {
-            return true;
-         }
-      }
+/// A keyword of Aperture, a node of its keyword tree.
+typedef struct
+{
+   ::sqlite3_int64 modelId;
+   ::sqlite3_int64 parentId;     ///< The keyword it is placed under (-1: none).
+   TFString name;
+} aperturekeyword;
+
+/**
+ * Reads all keywords of Aperture, each with the keyword it is placed under.
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param keywords      Receives the keywords, ordered by their ID.
+ * @return @c true on succes, @c false on any error.
+ */
+bool loadApertureKeywords(::sqlite3 *apertureDB, std::vector<aperturekeyword> &keywords)
+{
+   keywords.clear();
+
+   TFSql sql(apertureDB,
+             "SELECT modelId, parentId, name "
+             "FROM RKKeyword "
+             "ORDER BY modelId");
+   while (sql.step()) {
+      aperturekeyword keyword;
+      keyword.modelId = sql.column_int64(0);
+      keyword.parentId = sql.column_null(1) ? -1 : sql.column_int64(1);
+      keyword.name = TFString(normalizeUTF8(sql.column_str(2)));
+      keywords.push_back(keyword);
    }
 
-   return false;
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read Aperture keywords: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   return true;
 }
 
 bool recreateRootKeyword(::sqlite3 *lightroomDB,
@@ -1314,13 +1946,13 @@ bool recreateRootKeyword(::sqlite3 *lightroomDB,
             "WHERE name = 'AgLibraryKeyword_rootTagID'");
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to create keyword root: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to create keyword root: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
    ::sqlite3_int64 id_local = sql.column_int64(0);
    if (id_local < 0) {
-      std::cerr << "Failed to create keyword root: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to create keyword root: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -1334,10 +1966,10 @@ bool recreateRootKeyword(::sqlite3 *lightroomDB,
              "       NULL, "
              "       NULL)");
    sql.bind(1, id_local);
-   sql.bind(2, uuid());
+   bindNewUUID(sql, 2);
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to create root keyword: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to create root keyword: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -1353,13 +1985,13 @@ bool recreateRootKeyword(::sqlite3 *lightroomDB,
    sql.bind(2, id_local);
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to set genealogy of keyword: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to set genealogy of keyword: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
    ::sqlite3_int64 faceKeywordId = createNewKeyword(lightroomDB, faceKeywordsRoot, id_local, nullptr);
    if (0 > faceKeywordId) {
-      std::cerr << "Failed to create face keywords root: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to create face keywords root: " << sql.getErrorMsg() << std::endl;
       return false;
    }
 
@@ -1376,18 +2008,18 @@ bool recreateRootKeyword(::sqlite3 *lightroomDB,
       sql.reset("INSERT INTO Adobe_variablesTable (id_local, id_global, name, type, value) "
                 "VALUES (?, ?, 'AgLibraryKeywords_newPersonKeywordParent', NULL, ?)");
       sql.bind(1, getNextLocalID(lightroomDB));
-      sql.bind(2, uuid());
+      bindNewUUID(sql, 2);
       sql.bind(3, faceKeywordId);
       sql.step();
    }
    if (sql.hasFailed()) {
-      std::cerr << "Failed to set face keyword group as default for new faces" << std::endl;
+      g_log.err() << "Failed to set face keyword group as default for new faces" << std::endl;
    }
 
    if (tagKeywordsRoot != "") {
       ::sqlite3_int64 tagsKeywordId = createNewKeyword(lightroomDB, tagKeywordsRoot, id_local, nullptr);
       if (tagsKeywordId < 0) {
-         std::cerr << "Failed to create tag keywords root: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to create tag keywords root: " << sql.getErrorMsg() << std::endl;
          return false;
       }
 
@@ -1404,12 +2036,12 @@ bool recreateRootKeyword(::sqlite3 *lightroomDB,
          sql.reset("INSERT INTO Adobe_variablesTable (id_local, id_global, name, type, value) "
                    "VALUES (?, ?, 'AgLibraryKeywords_newKeywordParent', NULL, ?)");
          sql.bind(1, getNextLocalID(lightroomDB));
-         sql.bind(2, uuid());
+         bindNewUUID(sql, 2);
          sql.bind(3, tagsKeywordId);
          sql.step();
       }
       if (sql.hasFailed()) {
-         std::cerr << "Failed to set tag keyword group as default for new tags" << std::endl;
+         g_log.err() << "Failed to set tag keyword group as default for new tags" << std::endl;
       }
    }
 
@@ -1434,25 +2066,278 @@ bool connectKeywordWithImage(::sqlite3 *lightroomDB,
 
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to connect keyword with image: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to connect keyword with image: " << sql.getErrorMsg() << std::endl;
       return false;
    }
+   g_metrics.increment(TF_LINKS_INSERTED);
 
    return incrementKeywordPopularity(lightroomDB, keywordID);
 }
 
+/**
+ * Runs one statement that neither binds parameters nor returns rows.
+ *
+ * @param db   The database handle.
+ * @param sql  The statement.
+ * @return @c true on succes, @c false on any error.
+ */
+bool executeStatement(::sqlite3 *db, const std::string &statement)
+{
+   TFSql sql(db, statement);
+   sql.step();
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to execute " << statement << ": " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+   return true;
+}
+
+/**
+ * Builds the genealogy of a collection or keyword from the one of its parent.
+ *
+ * @param parent   The genealogy of the parent ("" for none).
+ * @param id       The ID of the collection or keyword.
+ * @return The genealogy.
+ */
+std::string childGenealogy(const std::string &parent, ::sqlite3_int64 id)
+{
+   std::string digits = std::to_string(id);
+   return parent + "/" + std::to_string(digits.size()) + digits;
+}
+
+/**
+ * Builds the SQL of an INSERT of many rows at once.
+ *
+ * @param insert  The statement up to VALUES, e.g. "INSERT INTO T(a, b)".
+ * @param row     The values of one row, e.g. "(?, ?)".
+ * @param rows    The number of rows.
+ * @return The SQL.
+ */
+std::string multiRowInsert(const std::string &insert, const std::string &row, size_t rows)
+{
+   std::string sql = insert + " VALUES ";
+   sql.reserve(sql.size() + rows * (row.size() + 2));
+   for (size_t n = 0; n < rows; ++n) {
+      if (n > 0) {
+         sql += ", ";
+      }
+      sql += row;
+   }
+   return sql;
+}
+
+/// Binds the values of one row, starting at the given parameter index.
+typedef std::function<void(TFSql &sql, int index, size_t row)> rowbinder;
+
+/**
+ * Inserts many rows with statements of 100 rows each, in the order given.
+ *
+ * The statement for 100 rows is prepared once and rewound for each batch,
+ * only the last batch gets a statement of its own.
+ *
+ * @param db          The handle of the database.
+ * @param insert      The statement up to VALUES, e.g. "INSERT INTO T(a, b)".
+ * @param row         The values of one row, e.g. "(?, ?)"; at most 9 parameters.
+ * @param parameters  The number of parameters of a row.
+ * @param rows        The number of rows.
+ * @param bindRow     Binds the values of each row.
+ * @return @c true on succes, @c false on any error.
+ */
+bool insertRows(::sqlite3 *db,
+                const std::string &insert,
+                const std::string &row,
+                int parameters,
+                size_t rows,
+                rowbinder bindRow)
+{
+   const size_t BATCH = 100;   // SQLite allows 999 parameters
+   if (rows == 0) {
+      return true;
+   }
+
+   TFSql full(db, multiRowInsert(insert, row, std::min(BATCH, rows)));
+   for (size_t start = 0; start < rows; start += BATCH) {
+      size_t count = std::min(BATCH, rows - start);
+      std::unique_ptr<TFSql> last;
+      TFSql *batch = &full;
+      if (start > 0 && count < BATCH) {
+         last.reset(new TFSql(db, multiRowInsert(insert, row, count)));
+         batch = last.get();
+      } else {
+         batch->rewind();
+      }
+
+      for (size_t r = 0; r < count; ++r) {
+         bindRow(*batch, (int) r * parameters + 1, start + r);
+      }
+      batch->step();
+      if (batch->hasFailed()) {
+         g_log.err() << "Failed to insert rows: " << batch->getErrorMsg() << std::endl;
+         return false;
+      }
+   }
+
+   return true;
+}
+
+/**
+ * Recreates the keyword tree of Aperture below the tag keywords root.
+ *
+ * The tree is built in memory first: the children of all keywords are
+ * collected in one array, in the order of the keywords. A depth-first walk
+ * then gives each keyword its ID, from a block reserved at once, and its
+ * genealogy, which is the one of its parent plus its own ID. The walk visits
+ * parents before their children, so the rows can be inserted in that order
+ * with insertRows().
+ *
+ * Keywords whose parent is unknown are placed directly below the root. Ones
+ * in a cycle of parents cannot be placed and are left out. The keywords of
+ * the images are only known by name, so a name used more than once maps to
+ * the first keyword of that name the walk visits.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param keywords      The keywords of Aperture, see loadApertureKeywords().
+ * @param keywordIDs    Receives the ID of the keyword of each name.
+ * @return @c true on succes, @c false on any error.
+ */
+bool createKeywordTree(::sqlite3 *lightroomDB,
+                       const std::vector<aperturekeyword> &keywords,
+                       std::unordered_map<TFString, ::sqlite3_int64> &keywordIDs)
+{
+   ::sqlite3_int64 root_id = getTagRootKeywordId(lightroomDB);
+   if (root_id == -1) {
+      return false;
+   }
+
+   TFSql sql(lightroomDB,
+             "SELECT genealogy FROM AgLibraryKeyword "
+             "WHERE id_local = ?");
+   sql.bind(1, root_id);
+   if (!sql.step() || sql.hasFailed()) {
+      g_log.err() << "Failed to select tag root genealogy: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+   std::string rootGenealogy = sql.column_str(0);
+
+   // Index count stands for the root. The children of keyword n are
+   // children[firstChild[n]] up to children[firstChild[n + 1]].
+   size_t count = keywords.size();
+   std::unordered_map<::sqlite3_int64, size_t> indexOf;
+   indexOf.reserve(count);
+   for (size_t n = 0; n < count; ++n) {
+      indexOf[keywords[n].modelId] = n;
+   }
+
+   std::vector<size_t> parentOf(count);
+   std::vector<size_t> firstChild(count + 2, 0);
+   for (size_t n = 0; n < count; ++n) {
+      auto iter = indexOf.find(keywords[n].parentId);
+      parentOf[n] = (iter == indexOf.end() || iter->second == n) ? count : iter->second;
+      firstChild[parentOf[n] + 1]++;
+   }
+   for (size_t n = 1; n < firstChild.size(); ++n) {
+      firstChild[n] += firstChild[n - 1];
+   }
+   std::vector<size_t> children(count);
+   std::vector<size_t> next(firstChild.begin(), firstChild.end() - 1);
+   for (size_t n = 0; n < count; ++n) {
+      children[next[parentOf[n]]++] = n;
+   }
+
+   // Children are pushed last to first, so they are visited in order.
+   std::vector<size_t> order;
+   std::vector<size_t> pending;
+   order.reserve(count);
+   for (size_t c = firstChild[count + 1]; c-- > firstChild[count]; ) {
+      pending.push_back(children[c]);
+   }
+   while (!pending.empty()) {
+      size_t n = pending.back();
+      pending.pop_back();
+      order.push_back(n);
+      for (size_t c = firstChild[n + 1]; c-- > firstChild[n]; ) {
+         pending.push_back(children[c]);
+      }
+   }
+   if (order.size() < count) {
+      g_log.err() << "Left out " << (count - order.size()) << " Aperture keywords in a cycle of parents" << std::endl;
+   }
+   if (order.empty()) {
+      return true;
+   }
+
+   ::sqlite3_int64 first = reserveLocalIDs(lightroomDB, order.size());
+   if (first < 0) {
+      return false;
+   }
+
+   std::vector<::sqlite3_int64> idOf(count, -1);
+   std::vector<std::string> genealogyOf(count);
+   for (size_t i = 0; i < order.size(); ++i) {
+      size_t n = order[i];
+      idOf[n] = first + i;
+      genealogyOf[n] = childGenealogy(parentOf[n] == count ? rootGenealogy : genealogyOf[parentOf[n]], idOf[n]);
+   }
+
+   bool inserted = insertRows(lightroomDB,
+      "INSERT INTO AgLibraryKeyword(id_local, id_global, dateCreated, imageCountCache, keywordType, lastApplied, lc_name, name, parent, genealogy)",
+      "(?, ?, "
+      " (julianday('now') - 2440587.5)*86400.0 - strftime('%s','2001-01-01 00:00:00'), "
+      " NULL, NULL, "
+      " (julianday('now') - 2440587.5)*86400.0 - strftime('%s','2001-01-01 00:00:00'), "
+      " lower(?), ?, ?, ?)",
+      6, order.size(),
+      [&](TFSql &sql, int index, size_t row) {
+         size_t n = order[row];
+         const TFString &name = keywords[n].name;
+         sql.bind(index, idOf[n]);
+         bindNewUUID(sql, index + 1);
+         sql.bind(index + 2, name.c_str(), (int) name.size());
+         sql.bind(index + 3, name.c_str(), (int) name.size());
+         sql.bind(index + 4, parentOf[n] == count ? root_id : idOf[parentOf[n]]);
+         sql.bind(index + 5, genealogyOf[n]);
+      });
+   if (!inserted) {
+      g_log.err() << "Failed to insert keywords" << std::endl;
+      return false;
+   }
+   g_metrics.increment(TF_KEYWORDS_CREATED, order.size());
+
+   for (size_t n : order) {
+      if (keywordIDs.insert(std::pair<TFString, ::sqlite3_int64>(keywords[n].name, idOf[n])).second) {
+         g_log.out(TF_LOG_DETAIL) << "Created keyword `" << keywords[n].name << "'" << std::endl;
+      }
+   }
+
+   return true;
+}
+
+/**
+ * Recreates the keywords of the images and assigns them.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param keywordsMap   The keywords of each image.
+ * @param keywordTree   All keywords of Aperture to recreate with their
+ *                      hierarchy first (-H), else empty: each keyword is
+ *                      created directly below the tag keywords root.
+ * @return @c true on succes, @c false on any error.
+ */
 bool recreateKeywords(::sqlite3 *lightroomDB,
-                      std::map<::sqlite3_int64, std::deque<std::string>> keywordsMap)
+                      const std::map<::sqlite3_int64, std::deque<TFString>> &keywordsMap,
+                      const std::vector<aperturekeyword> &keywordTree)
 {
-   std::map<std::string, ::sqlite3_int64> knownKeywords;
+   std::unordered_map<TFString, ::sqlite3_int64> knownKeywords;
+   if (!keywordTree.empty() && !createKeywordTree(lightroomDB, keywordTree, knownKeywords)) {
+      return false;
+   }
 
-   for (std::pair<::sqlite3_int64, std::deque<std::string>> i : keywordsMap) {
+   for (const std::pair<const ::sqlite3_int64, std::deque<TFString>> &i : keywordsMap) {
       ::sqlite3_int64 imageID = i.first;
-      std::deque<std::string> keywords = i.second;
+      const std::deque<TFString> &keywords = i.second;
 
-      for (std::string keyword : keywords) {
-         keyword = normalizeUTF8(keyword);
-         // std::cout << "Recreating keyword " << keyword << std::endl;
+      // The keywords were normalized when they were looked up.
+      for (TFString keyword : keywords) {
+         // g_log.out(TF_LOG_DETAIL) << "Recreating keyword " << keyword << std::endl;
 
          ::sqlite3_int64 keywordID = -1;
 
@@ -1461,21 +2346,21 @@ bool recreateKeywords(::sqlite3 *lightroomDB,
             keywordID = iter->second;
          } else {
             keywordID = createNewKeyword(lightroomDB,
-                                         keyword,
+                                         keyword.str(),
                                          getTagRootKeywordId(lightroomDB),
                                          nullptr);
-            std::cout << "Created keyword `" << keyword << "'" << std::endl;
+            g_log.out(TF_LOG_DETAIL) << "Created keyword `" << keyword << "'" << std::endl;
 
-            knownKeywords.insert(std::pair<std::string, ::sqlite3_int64>(keyword, keywordID));
+            knownKeywords.insert(std::pair<TFString, ::sqlite3_int64>(keyword, keywordID));
          }
 
          if (keywordID == -1) {
-            std::cerr << "Failed to create keyword: " << keyword << std::endl;
+            g_log.err() << "Failed to create keyword: " << keyword << std::endl;
             return false;
          }
 
          if (!connectKeywordWithImage(lightroomDB, imageID, keywordID)) {
-            std::cerr << "Failed to connect image with keyword" << std::endl;
+            g_log.err() << "Failed to connect image with keyword" << std::endl;
          }
       }
    }
@@ -1494,66 +2379,82 @@ bool removeAllStacks(::sqlite3 *lightroomDB)
    sql3.step();
 
    if (sql1.hasFailed()) {
-      std::cerr << "Failed to remove all stacks: " << sql1.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all stacks: " << sql1.getErrorMsg() << std::endl;
       return false;
    }
    if (sql2.hasFailed()) {
-      std::cerr << "Failed to remove all stacks: " << sql2.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all stacks: " << sql2.getErrorMsg() << std::endl;
       return false;
    }
    if (sql3.hasFailed()) {
-      std::cerr << "Failed to remove all stacks: " << sql3.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to remove all stacks: " << sql3.getErrorMsg() << std::endl;
       return false;
    }
 
    return true;
 }
 
-std::string findApertureStackIdOfVersion(::sqlite3 *apertureDB,
-                                         const std::string &fileName,
-                                         ::sqlite3_int64 imageDate,
-                                         const std::string &copyName)
+TFUuidKey findApertureStackIdOfMaster(::sqlite3 *apertureDB,
+                                      const std::string &masterUUID,
+                                      const std::string &fileName,
+                                      const std::string &copyName)
 {
-   std::string stackUuid;
-
-   std::string masterUUID = findImageUUIDForFilename(apertureDB, fileName, imageDate);
-   if (masterUUID != "") {
-      ::sqlite3_int64 copyNr = INT64_MAX;
-      if (copyName.find("VERSION-") == 0) {
-         copyNr = ::atoi(copyName.substr(8).c_str());
-         if (copyNr > 0) {
-            copyNr--;
-         }
-      }
+   TFUuidKey stackUuid = TFUuidKey();
 
-      TFSql sql(apertureDB,
-                "SELECT stackUuid "
-                "FROM RKVersion "
-                "WHERE masterUuid = ? "
-                "AND versionNumber <= ? "
-                "ORDER BY versionNumber DESC");
-      sql.bind(1, masterUUID);
-      sql.bind(2, copyNr);
-      if (sql.step()) {
-         stackUuid = sql.column_str(0);
-      } else {
-         std::cerr << "Didn't find stack UUID for " << fileName << std::endl;
+   ::sqlite3_int64 copyNr = INT64_MAX;
+   if (copyName.find("VERSION-") == 0) {
+      copyNr = ::atoi(copyName.substr(8).c_str());
+      if (copyNr > 0) {
+         copyNr--;
       }
+   }
 
-      if (sql.hasFailed()) {
-         std::cerr << "Failed to get stack UUID" << std::endl;
-         return "";
-      }
+   TFSql sql(apertureDB,
+             "SELECT stackUuid "
+             "FROM RKVersion "
+             "WHERE masterUuid = ? "
+             "AND versionNumber <= ? "
+             "ORDER BY versionNumber DESC");
+   sql.bind(1, masterUUID);
+   sql.bind(2, copyNr);
+   if (sql.step()) {
+      stackUuid = TFUuidKey::fromText(sql.column_str(0));
    } else {
-      std::cerr << "Didn't find master UUID for " << fileName << std::endl;
+      g_log.err() << "Didn't find stack UUID for " << fileName << std::endl;
+   }
+
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to get stack UUID" << std::endl;
+      return TFUuidKey();
    }
 
    return stackUuid;
 }
 
+TFUuidKey findApertureStackIdOfVersion(::sqlite3 *apertureDB,
+                                       const std::string &fileName,
+                                       ::sqlite3_int64 imageDate,
+                                       const std::string &copyName)
+{
+   std::string masterUUID = findImageUUIDForFilename(apertureDB, fileName, imageDate);
+   if (masterUUID != "") {
+      return findApertureStackIdOfMaster(apertureDB, masterUUID, fileName, copyName);
+   }
+
+   g_log.err() << "Didn't find master UUID for " << fileName << std::endl;
+   return TFUuidKey();
+}
+
+/// A Lightroom image and the Aperture stack it belongs to.
+typedef struct
+{
+   TFUuidKey stack;
+   ::sqlite3_int64 image;
+} stackimage;
+
 // TODO: Doc
 bool createStack(::sqlite3 *lightroomDB,
-                 std::deque<::sqlite3_int64> images)
+                 const std::vector<::sqlite3_int64> &images)
 {
    ::sqlite3_int64 id_local_stack = getNextLocalID(lightroomDB);
    if (-1 == id_local_stack) {
@@ -1563,12 +2464,13 @@ bool createStack(::sqlite3 *lightroomDB,
              "INSERT INTO AgLibraryFolderStack(id_local, id_global, collapsed, text) "
              "VALUES (?, ?, 1, '')");
    sql.bind(1, id_local_stack);
-   sql.bind(2, uuid());
+   bindNewUUID(sql, 2);
    sql.step();
    if (sql.hasFailed()) {
-      std::cerr << "Failed to create empty stack: " << sql.getErrorMsg() << std::endl;
+      g_log.err() << "Failed to create empty stack: " << sql.getErrorMsg() << std::endl;
       return false;
    }
+   g_metrics.increment(TF_STACKS_CREATED);
 
    for (int n = 0; n < images.size(); ++n) {
       ::sqlite3_int64 id_local_image = getNextLocalID(lightroomDB);
@@ -1583,7 +2485,7 @@ bool createStack(::sqlite3 *lightroomDB,
       sql.bind(4, id_local_stack);
       sql.step();
       if (sql.hasFailed()) {
-         std::cerr << "Failed to attach image to stack: " << sql.getErrorMsg() << std::endl;
+         g_log.err() << "Failed to attach image to stack: " << sql.getErrorMsg() << std::endl;
          return false;
       }
    }
@@ -1591,16 +2493,31 @@ bool createStack(::sqlite3 *lightroomDB,
    return true;
 }
 
-// TODO: Doc
+/**
+ * Creates a Lightroom stack for each Aperture stack.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param stackedImages The images and their stacks, in the order of the
+ *                      images; sorted by stack here.
+ * @return @c true on succes, @c false on any error.
+ */
 bool createStacks(::sqlite3 *lightroomDB,
-                  std::map<std::string, std::deque<::sqlite3_int64>> stacks)
+                  std::vector<stackimage> &stackedImages)
 {
-   for (auto stack : stacks) {
-      if (!createStack(lightroomDB, stack.second)) {
+   std::stable_sort(stackedImages.begin(), stackedImages.end(),
+                    [](const stackimage &a, const stackimage &b) { return a.stack < b.stack; });
+
+   std::vector<::sqlite3_int64> images;
+   for (size_t first = 0; first < stackedImages.size(); first += images.size()) {
+      images.clear();
+      for (size_t n = first; n < stackedImages.size() && stackedImages[n].stack == stackedImages[first].stack; ++n) {
+         images.push_back(stackedImages[n].image);
+      }
+      if (!createStack(lightroomDB, images)) {
          return false;
       }
 
-      std::cout << "Created stack of " << stacks.size() << " images." << std::endl;
+      g_log.out(TF_LOG_DETAIL) << "Created stack of " << images.size() << " images." << std::endl;
    }
 
    return true;
@@ -1663,13 +2580,6 @@ bool updateXmp(std::string &xmp,
 {
    bool result = false;
 
-   static bool initialized = false;
-   if (!initialized) {
-      initialized = true;
-
-      LIBXML_TEST_VERSION
-   }
-
    xmlDocPtr doc = xmlReadMemory(xmp.c_str(), xmp.size(), "/", NULL, XML_PARSE_NONET);
    if (doc) {
       xmlNode *root_element = xmlDocGetRootElement(doc);
@@ -1751,132 +2661,3795 @@ bool updateXmp(std::string &xmp,
    return result;
 }
 
-bool transferGPS(::sqlite3 *apertureDB,
-                 ::sqlite3 *lightroomDB,
-                 ::sqlite3_int64 image_id,
-                 const std::string &fileName,
-                 ::sqlite3_int64 imageDate,
-                 const std::string &copyName)
+/**
+ * Looks up the GPS location Aperture has for a version of an image.
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param masterUUID    The UUID of the master of the image.
+ * @param copyName      The copy name of the image in Lightroom.
+ * @param latitude      Receives the latitude.
+ * @param longitude     Receives the longitude.
+ * @param failed        Set to @c true if the lookup failed.
+ * @return @c true if there is a location, @c false else.
+ */
+bool findGPSOfVersion(::sqlite3 *apertureDB,
+                      const std::string &masterUUID,
+                      const std::string &copyName,
+                      double &latitude,
+                      double &longitude,
+                      bool &failed)
 {
-   std::string masterUUID = findImageUUIDForFilename(apertureDB, fileName, imageDate);
-   if (masterUUID != "") {
-      ::sqlite3_int64 copyNr = INT64_MAX;
-      if (copyName.find("VERSION-") == 0) {
-         copyNr = ::atoi(copyName.substr(8).c_str());
-         if (copyNr > 0) {
-            copyNr--;
-         }
+   ::sqlite3_int64 copyNr = INT64_MAX;
+   if (copyName.find("VERSION-") == 0) {
+      copyNr = ::atoi(copyName.substr(8).c_str());
+      if (copyNr > 0) {
+         copyNr--;
       }
+   }
 
-      TFSql sql(apertureDB,
-                "SELECT exifLatitude, exifLongitude "
+   TFSql sql(apertureDB,
+             "SELECT exifLatitude, exifLongitude "
+             "FROM RKVersion "
+             "WHERE masterUuid = ? "
+             "AND versionNumber <= ? "
+             "ORDER BY versionNumber DESC");
+   sql.bind(1, masterUUID);
+   sql.bind(2, copyNr);
+   bool found = sql.step() && !sql.column_null(0) && !sql.column_null(1);
+   if (found) {
+      latitude = sql.column_double(0);
+      longitude = sql.column_double(1);
+   }
+   failed = sql.hasFailed();
+
+   return found;
+}
+
+/**
+ * Saves a rewritten XMP packet of an image.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param image_id      The ID of the image.
+ * @param xmp           The XMP packet.
+ * @return @c true on succes, @c false on any error.
+ */
+bool writeXmp(::sqlite3 *lightroomDB,
+              ::sqlite3_int64 image_id,
+              const std::string &xmp)
+{
+   TFSql updateXMP(lightroomDB,
+                   "UPDATE Adobe_AdditionalMetadata "
+                   "SET xmp = ? "
+                   "WHERE image = ?");
+   updateXMP.bind(1, xmp);
+   updateXMP.bind(2, image_id);
+   updateXMP.step();
+   if (updateXMP.hasFailed()) {
+      g_log.err() << "Failed to update XMP data" << std::endl;
+      return false;
+   }
+
+   return true;
+}
+
+/**
+ * Writes a GPS location into the EXIF data of an image in the catalog.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param image_id      The ID of the image.
+ * @param latitude      The latitude.
+ * @param longitude     The longitude.
+ * @return @c true on succes, @c false on any error.
+ */
+bool writeGPSLocation(::sqlite3 *lightroomDB,
+                      ::sqlite3_int64 image_id,
+                      double latitude,
+                      double longitude)
+{
+   TFSql update(lightroomDB,
+                "UPDATE AgHarvestedExifMetadata "
+                "SET gpsLatitude = ?, "
+                "    gpsLongitude = ?, "
+                "    gpsSequence = 1, "
+                "    hasGPS = 1 "
+                "WHERE image = ?");
+   update.bind(1, latitude);
+   update.bind(2, longitude);
+   update.bind(3, image_id);
+   update.step();
+   if (update.hasFailed()) {
+      g_log.err() << "Failed to update GPS information " << update.getErrorMsg() << std::endl;
+      return false;
+   }
+   g_metrics.increment(TF_GPS_REWRITES);
+
+   return true;
+}
+
+/**
+ * Writes a GPS location into the catalog, into the EXIF data and the XMP
+ * packet of the image.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param image_id      The ID of the image.
+ * @param latitude      The latitude.
+ * @param longitude     The longitude.
+ * @return @c true on succes, @c false on any error.
+ */
+bool writeGPS(::sqlite3 *lightroomDB,
+              ::sqlite3_int64 image_id,
+              double latitude,
+              double longitude)
+{
+   if (!writeGPSLocation(lightroomDB, image_id, latitude, longitude)) {
+      return false;
+   }
+
+   // Update Adobe_AdditionalMetadata
+   TFSql findXMP(lightroomDB,
+                 "SELECT xmp "
+                 "FROM Adobe_AdditionalMetadata "
+                 "WHERE image = ?");
+   findXMP.bind(1, image_id);
+   if (findXMP.step()) {
+      std::string xmp = findXMP.column_str(0);
+
+      if (findXMP.hasFailed()) {
+         g_log.err() << "Failed to read XMP data" << std::endl;
+         return false;
+      }
+
+      // g_log.err() << "--- Before ---------------------------------------" << std::endl;
+      // g_log.err() << xmp << std::endl;
+      // g_log.err() << "--------------------------------------------------" << std::endl;
+
+      if (!updateXmp(xmp, latitude, longitude)) {
+         g_log.err() << "Failed to update XMP data" << std::endl;
+         return false;
+      }
+      g_metrics.increment(TF_XMP_BYTES, xmp.size());
+
+      // g_log.err() << "--- After ----------------------------------------" << std::endl;
+      // g_log.err() << xmp << std::endl;
+      // g_log.err() << "--------------------------------------------------" << std::endl;
+
+      if (!writeXmp(lightroomDB, image_id, xmp)) {
+         return false;
+      }
+   } else {
+      g_log.err() << "Warning: Did not find additional metadata" << std::endl;
+   }
+
+   return true;
+}
+
+bool transferGPS(::sqlite3 *apertureDB,
+                 ::sqlite3 *lightroomDB,
+                 ::sqlite3_int64 image_id,
+                 const std::string &fileName,
+                 ::sqlite3_int64 imageDate,
+                 const std::string &copyName)
+{
+   std::string masterUUID = findImageUUIDForFilename(apertureDB, fileName, imageDate);
+   if (masterUUID != "") {
+      double latitude;
+      double longitude;
+      bool failed = false;
+      if (findGPSOfVersion(apertureDB, masterUUID, copyName, latitude, longitude, failed) &&
+          !writeGPS(lightroomDB, image_id, latitude, longitude)) {
+         return false;
+      }
+
+      if (failed) {
+         g_log.err() << "Failed to get GPS location" << std::endl;
+         return false;
+      }
+   } else {
+      g_log.err() << "Didn't find master UUID for " << fileName << std::endl;
+   }
+
+   return true;
+}
+
+/// The steps of the work per image that are timed separately.
+enum imagestep
+{
+   STEP_TOTAL,
+   STEP_FACES_READ,
+   STEP_FACES_WRITE,
+   STEP_KEYWORDS,
+   STEP_STACK,
+   STEP_GPS,
+
+   STEP_COUNT
+};
+
+/// The names of the steps, for reports.
+const char *g_stepNames[STEP_COUNT] = {
+   "total", "faces read", "faces write", "keywords", "stack", "gps"
+};
+
+/// Time spent per image (in nanoseconds), per step.
+TFHistogram g_latency[STEP_COUNT];
+/// The slowest images and why they were slow.
+TFSlowest<std::string> g_slowestImages;
+
+/// What is measured of the allocations per image.
+enum imageallocation
+{
+   IMAGE_ALLOCATIONS,
+   IMAGE_ALLOCATED_BYTES,
+
+   IMAGE_ALLOCATION_COUNT
+};
+
+/// Allocations per image (only recorded with -A).
+TFHistogram g_imageAllocations[IMAGE_ALLOCATION_COUNT];
+
+/**
+ * Forgets all latencies recorded, for a new run.
+ */
+void resetLatencies(void)
+{
+   for (int step = 0; step < STEP_COUNT; ++step) {
+      g_latency[step] = TFHistogram();
+   }
+   g_slowestImages.reset(g_slowestCount);
+   for (int kind = 0; kind < IMAGE_ALLOCATION_COUNT; ++kind) {
+      g_imageAllocations[kind] = TFHistogram();
+   }
+}
+
+/**
+ * Records the time spent on one image.
+ *
+ * @param fileName    The file name of the image.
+ * @param copyName    The copy name of the image (for virtual copies).
+ * @param nanos       The time spent per step.
+ * @param faces       The number of faces found.
+ * @param fallbacks   The number of master lookups that had to fall back to
+ *                    the file date.
+ * @param xmpBytes    The size of the XMP rewritten.
+ */
+void recordImageLatency(const std::string &fileName,
+                        const std::string &copyName,
+                        unsigned long long nanos[STEP_COUNT],
+                        size_t faces,
+                        long long fallbacks,
+                        long long xmpBytes)
+{
+   for (int step = 0; step < STEP_COUNT; ++step) {
+      g_latency[step].record(nanos[step]);
+   }
+
+   if (!g_slowestImages.qualifies(nanos[STEP_TOTAL])) {
+      return;
+   }
+
+   int slowestStep = STEP_FACES_READ;
+   for (int step = STEP_FACES_READ; step < STEP_COUNT; ++step) {
+      if (nanos[step] > nanos[slowestStep]) {
+         slowestStep = step;
+      }
+   }
+
+   std::stringstream reason;
+   reason << fileName;
+   if (copyName != "") {
+      reason << " (" << copyName << ")";
+   }
+   reason << ": mostly " << g_stepNames[slowestStep];
+   if (faces > 0) {
+      reason << ", " << faces << " faces";
+   }
+   if (fallbacks > 0) {
+      reason << ", matched by file date only";
+   }
+   if (xmpBytes > 0) {
+      reason << ", " << xmpBytes / 1024 << " KB XMP";
+   }
+   g_slowestImages.add(nanos[STEP_TOTAL], reason.str());
+}
+
+/**
+ * Prints percentiles of the time spent per image and the slowest images.
+ */
+void printLatencies(void)
+{
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Time per image" << std::endl << std::endl;
+
+   g_log.out(TF_LOG_SUMMARY) << "              count    mean     p50     p90     p99   p99.9     max (ms)" << std::endl;
+   for (int step = 0; step < STEP_COUNT; ++step) {
+      const TFHistogram &histogram = g_latency[step];
+      char line[256];
+      ::snprintf(line, sizeof(line), "%-12s %6lld %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f",
+                 g_stepNames[step],
+                 histogram.count(),
+                 histogram.mean() / 1e6,
+                 histogram.percentile(50) / 1e6,
+                 histogram.percentile(90) / 1e6,
+                 histogram.percentile(99) / 1e6,
+                 histogram.percentile(99.9) / 1e6,
+                 histogram.max() / 1e6);
+      g_log.out(TF_LOG_SUMMARY) << line << std::endl;
+   }
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "Slowest images:" << std::endl;
+   for (auto &slow : g_slowestImages.sorted()) {
+      char duration[64];
+      ::snprintf(duration, sizeof(duration), "%10.2f ms  ", slow.first / 1e6);
+      g_log.out(TF_LOG_SUMMARY) << duration << slow.second << std::endl;
+   }
+}
+
+/// struct to collect what the transfer of the images found
+typedef struct
+{
+   // Lightroom images with the Aperture stack they belong to
+   std::vector<stackimage> stackedImages;
+   // Aperture keywords of each Lightroom image
+   std::map<::sqlite_int64, std::deque<TFString>> keywordsByImage;
+   // All keywords of Aperture, to recreate their hierarchy (-H only)
+   std::vector<aperturekeyword> keywordTree;
+   // Number of faces per person
+   std::map<TFString, int> insertedPeople;
+} transferstate;
+
+/// What the Aperture lookups of an image are keyed by.
+typedef struct
+{
+   std::string fileName;
+   ::sqlite3_int64 imageDate;
+} imagekey;
+
+/// The connections used by the prefetch thread, closed with the last copy.
+struct prefetchdbs
+{
+   ::sqlite3 *apertureDB;
+   ::sqlite3 *facesDB;
+
+   prefetchdbs() : apertureDB(NULL), facesDB(NULL) {}
+   ~prefetchdbs()
+   {
+      ::sqlite3_close(apertureDB);
+      ::sqlite3_close(facesDB);
+   }
+};
+
+/**
+ * Runs the Aperture lookups of an image without using the results, so the
+ * pages they need are in the cache of the operating system by the time the
+ * image is transferred.
+ *
+ * @param dbs  The connections of the prefetch thread.
+ * @param key  The image.
+ */
+void prefetchImage(prefetchdbs &dbs, const imagekey &key)
+{
+   TFSql sql(dbs.apertureDB,
+             "SELECT uuid "
+             "FROM RKMaster "
+             "WHERE fileName = ? "
+             "AND fileModificationDate = ?");
+   sql.bind(1, key.fileName);
+   sql.bind(2, key.imageDate);
+   if (!sql.step()) {
+      // The fallback lookup by date only
+      sql.reset("SELECT uuid "
+                "FROM RKMaster "
+                "WHERE fileModificationDate = ?");
+      sql.bind(1, key.imageDate);
+      if (!sql.step()) {
+         return;
+      }
+   }
+   std::string masterUUID = sql.column_str(0);
+
+   // Only what the selected stages look up.
+   if (stageSelected(STAGE_KEYWORDS)) {
+      sql.reset("SELECT V.modelId, V.stackUuid, V.exifLatitude, V.exifLongitude, K.name "
+                "FROM RKVersion V "
+                "LEFT JOIN RKKeywordForVersion KV ON KV.versionId = V.modelId "
+                "LEFT JOIN RKKeyword K ON K.modelId = KV.keywordId "
+                "WHERE V.masterUuid = ?");
+      sql.bind(1, masterUUID);
+      while (sql.step()) {
+      }
+   } else if (stageSelected(STAGE_STACKS) || stageSelected(STAGE_GPS)) {
+      sql.reset("SELECT modelId, stackUuid, exifLatitude, exifLongitude "
                 "FROM RKVersion "
-                "WHERE masterUuid = ? "
-                "AND versionNumber <= ? "
-                "ORDER BY versionNumber DESC");
+                "WHERE masterUuid = ?");
       sql.bind(1, masterUUID);
-      sql.bind(2, copyNr);
-      if (sql.step() && !sql.column_null(0) && !sql.column_null(1)) {
-         double latitude = sql.column_double(0);
-         double longitude = sql.column_double(1);
-
-         TFSql update(lightroomDB,
-                      "UPDATE AgHarvestedExifMetadata "
-                      "SET gpsLatitude = ?, "
-                      "    gpsLongitude = ?, "
-                      "    gpsSequence = 1, "
-                      "    hasGPS = 1 "
-                      "WHERE image = ?");
-         update.bind(1, latitude);
-         update.bind(2, longitude);
-         update.bind(3, image_id);
-         update.step();
-         if (update.hasFailed()) {
-            std::cerr << "Failed to update GPS information " << update.getErrorMsg() << std::endl;
+      while (sql.step()) {
+      }
+   }
+
+   if (!stageSelected(STAGE_FACES)) {
+      return;
+   }
+   TFSql faces(dbs.facesDB,
+               "SELECT F.faceKey, N.name "
+               "FROM RKDetectedFace F "
+               "LEFT JOIN RKFaceName N ON N.faceKey = F.faceKey "
+               "WHERE F.masterUuid = ?");
+   faces.bind(1, masterUUID);
+   while (faces.step()) {
+   }
+}
+
+/**
+ * Starts prefetching the Aperture data of a range of Lightroom images.
+ *
+ * The prefetch thread gets its own connections to the Aperture databases;
+ * databases that only exist in memory (server mode) are not prefetched.
+ *
+ * @param prefetcher    The prefetcher to start.
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @param firstImage    The lowest id_local of the images to process.
+ * @param lastImage     The highest id_local of the images to process.
+ * @return @c true if prefetching runs, @c false else.
+ */
+bool startPrefetch(TFPrefetcher<imagekey> &prefetcher,
+                   ::sqlite3 *lightroomDB,
+                   ::sqlite3 *apertureDB,
+                   ::sqlite3 *facesDB,
+                   ::sqlite3_int64 firstImage,
+                   ::sqlite3_int64 lastImage)
+{
+   std::shared_ptr<prefetchdbs> dbs = std::make_shared<prefetchdbs>();
+   const char *files[] = { ::sqlite3_db_filename(apertureDB, "main"), ::sqlite3_db_filename(facesDB, "main") };
+   ::sqlite3 **handles[] = { &dbs->apertureDB, &dbs->facesDB };
+   for (int i = 0; i < 2; ++i) {
+      if (!files[i] || !*files[i]) {
+         return false;
+      }
+      if (SQLITE_OK != ::sqlite3_open_v2(files[i], handles[i], SQLITE_OPEN_READONLY, TFIoVfs::name())) {
+         g_log.err() << "Can't open " << files[i] << " for prefetching: " << ::sqlite3_errmsg(*handles[i]) << std::endl;
+         return false;
+      }
+   }
+
+   std::vector<imagekey> keys;
+   TFSql sql(lightroomDB,
+             "SELECT F.originalFilename, F.externalModTime "
+             "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
+             "WHERE F.id_local = I.rootFile "
+             "AND O.id_local = F.folder "
+             "AND R.id_local = O.rootFolder "
+             "AND I.id_local BETWEEN ? AND ? "
+             "ORDER BY I.id_local");
+   sql.bind(1, firstImage);
+   sql.bind(2, lastImage);
+   while (sql.step()) {
+      imagekey key;
+      key.fileName = sql.column_str(0);
+      key.imageDate = sql.column_int64(1);
+      keys.push_back(key);
+   }
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to list images to prefetch: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   prefetcher.start(keys, g_prefetchDepth, [dbs](const imagekey &key) {
+      prefetchImage(*dbs, key);
+   });
+   return true;
+}
+
+/**
+ * Opens a database again, read-only, and starts a read transaction, so all
+ * lookups on the connection see one snapshot.
+ *
+ * @param db   The handle of the database.
+ * @return The new handle, NULL if the database has no file (server mode)
+ *         or cannot be opened.
+ */
+::sqlite3 *openSnapshot(::sqlite3 *db)
+{
+   const char *file = ::sqlite3_db_filename(db, "main");
+   if (!file || !*file) {
+      return NULL;
+   }
+
+   ::sqlite3 *snapshot = NULL;
+   if (SQLITE_OK != ::sqlite3_open_v2(file, &snapshot, SQLITE_OPEN_READONLY, TFIoVfs::name()) ||
+       SQLITE_OK != ::sqlite3_exec(snapshot, "BEGIN; SELECT count(*) FROM sqlite_master", 0, 0, 0)) {
+      g_log.err() << "Warning: Can't open " << file << " for a stage: " << ::sqlite3_errmsg(snapshot) << std::endl;
+      ::sqlite3_close(snapshot);
+      return NULL;
+   }
+   return snapshot;
+}
+
+/// The Aperture databases as seen by the compute half of one stage.
+struct stagedbs
+{
+   ::sqlite3 *apertureDB;
+   ::sqlite3 *facesDB;
+   ::sqlite3 *ownAperture;
+   ::sqlite3 *ownFaces;
+
+   stagedbs(::sqlite3 *aperture, ::sqlite3 *faces)
+   : ownAperture(openSnapshot(aperture)), ownFaces(openSnapshot(faces))
+   {
+      // Databases in memory are shared, SQLite serializes the access.
+      apertureDB = ownAperture ? ownAperture : aperture;
+      facesDB = ownFaces ? ownFaces : faces;
+   }
+   ~stagedbs()
+   {
+      ::sqlite3_close(ownAperture);
+      ::sqlite3_close(ownFaces);
+   }
+};
+
+/**
+ * Replaces the faces of a Lightroom image by the ones found in Aperture.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param faces         The faces found in Aperture.
+ * @param image_id      The ID of the image.
+ * @param fileName      The file name of the image, for the log.
+ * @param orientation   The orientation of the image (in Lightroom style).
+ * @param state         Receives the people inserted.
+ * @return @c true on succes, @c false on any error.
+ */
+bool writeFacesOfImage(::sqlite3 *lightroomDB,
+                       facelist &faces,
+                       ::sqlite3_int64 image_id,
+                       const std::string &fileName,
+                       const std::string &orientation,
+                       transferstate &state)
+{
+   TFLogLine line = g_log.out(TF_LOG_DETAIL);
+   line << fileName << ": ";
+   if (!removeLightroomFacesForImage(lightroomDB, image_id)) {
+      return false;
+   }
+   std::string sep = "";
+   for(facedata &face : faces) {
+      if (!createFaceEntry(lightroomDB, face, image_id, orientation)) {
+         g_log.err() << "Failed to create face entry" << std::endl;
+      } else {
+         g_metrics.increment(TF_FACES_INSERTED);
+
+         if (!face.name.empty()) {
+            auto iter = state.insertedPeople.find(face.name);
+            if (iter == state.insertedPeople.end()) {
+               state.insertedPeople.insert(std::pair<TFString,int>(face.name, 1));
+            } else {
+               iter->second++;
+            }
+         } else {
+            g_metrics.increment(TF_UNKNOWN_FACES);
+         }
+      }
+
+      line << sep;
+      if (face.name.empty()) {
+         line << "[Unnamed]";
+      } else {
+         line << face.name;
+      }
+      sep = ", ";
+   }
+   line << std::endl;
+
+   return true;
+}
+
+/**
+ * Transfers faces and GPS locations of a range of Lightroom images and
+ * collects their keywords and stacks for the later steps.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @param firstImage    The lowest id_local of the images to process.
+ * @param lastImage     The highest id_local of the images to process.
+ * @param state         Receives the collected data and statistics.
+ * @return @c true on succes, @c false on any error.
+ */
+bool transferImages(::sqlite3 *lightroomDB,
+                    ::sqlite3 *apertureDB,
+                    ::sqlite3 *facesDB,
+                    ::sqlite3_int64 firstImage,
+                    ::sqlite3_int64 lastImage,
+                    transferstate &state)
+{
+   TFSql sql(lightroomDB,
+             "SELECT F.originalFilename, I.id_local, I.orientation, F.externalModTime, I.copyName "
+             "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
+             "WHERE F.id_local = I.rootFile "
+             "AND O.id_local = F.folder "
+             "AND R.id_local = O.rootFolder "
+             "AND I.id_local BETWEEN ? AND ? "
+             "ORDER BY I.id_local");
+   sql.bind(1, firstImage);
+   sql.bind(2, lastImage);
+
+   TFPrefetcher<imagekey> prefetcher;
+   if (g_prefetchDepth > 0) {
+      startPrefetch(prefetcher, lightroomDB, apertureDB, facesDB, firstImage, lastImage);
+   }
+
+   while(sql.step()) {
+      prefetcher.consume();
+
+      std::string fileName = sql.column_str(0);
+      ::sqlite3_int64 image_id = sql.column_int64(1);
+      std::string orientation = sql.column_str(2);
+      ::sqlite3_int64 imageDate = sql.column_int64(3);
+      std::string copyName = sql.column_str(4);
+
+      g_metrics.increment(TF_IMAGES_SCANNED);
+
+      unsigned long long nanos[STEP_COUNT] = { 0 };
+      long long fallbacks = g_metrics.value(TF_FALLBACK_MATCHES);
+      long long xmpBytes = g_metrics.value(TF_XMP_BYTES);
+      long long allocations = g_allocations.count();
+      long long allocatedBytes = g_allocations.size();
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      std::chrono::steady_clock::time_point last = start;
+      auto lap = [&last](unsigned long long &nanos) {
+         std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+         nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+         last = now;
+      };
+
+      // Whatever the image before left in the arena is gone by now.
+      g_imageArena.reset();
+      facelist faces(g_imageArena);
+      if (stageSelected(STAGE_FACES)) {
+         faces.reserve(8);
+         findFacesForImage(faces, apertureDB, facesDB, fileName, imageDate);
+      }
+      lap(nanos[STEP_FACES_READ]);
+      if (faces.size()) {
+         if (!writeFacesOfImage(lightroomDB, faces, image_id, fileName, orientation, state)) {
             return false;
          }
+      } else if (stageSelected(STAGE_FACES)) {
+         g_metrics.increment(TF_IMAGES_WITHOUT_FACES);
+      }
+      lap(nanos[STEP_FACES_WRITE]);
+
+      if (stageSelected(STAGE_KEYWORDS)) {
+         keywordlist keywordsForVersion(g_imageArena);
+         if (!findKeywordsForVersion(keywordsForVersion, apertureDB, fileName, imageDate, copyName)) {
+            g_log.err() << "Failed to get keywords for version" << std::endl;
+         }
+         state.keywordsByImage.insert(std::pair<::sqlite3_int64, std::deque<TFString>>(
+            image_id, std::deque<TFString>(keywordsForVersion.begin(), keywordsForVersion.end())));
+      }
+      lap(nanos[STEP_KEYWORDS]);
+
+      if (stageSelected(STAGE_STACKS)) {
+         TFUuidKey apertureStackId = findApertureStackIdOfVersion(apertureDB, fileName, imageDate, copyName);
+         if (!apertureStackId.isNull()) {
+            state.stackedImages.push_back(stackimage{apertureStackId, image_id});
+         }
+      }
+      lap(nanos[STEP_STACK]);
+
+      if (stageSelected(STAGE_GPS) &&
+          !transferGPS(apertureDB, lightroomDB, image_id, fileName, imageDate, copyName)) {
+         g_log.err() << "Failed to transfer GPS location for version " << fileName << ", " << copyName << std::endl;
+      }
+      lap(nanos[STEP_GPS]);
+
+      nanos[STEP_TOTAL] = std::chrono::duration_cast<std::chrono::nanoseconds>(last - start).count();
+      recordImageLatency(fileName, copyName, nanos, faces.size(),
+                         g_metrics.value(TF_FALLBACK_MATCHES) - fallbacks,
+                         g_metrics.value(TF_XMP_BYTES) - xmpBytes);
+      if (g_allocations.isEnabled()) {
+         g_imageAllocations[IMAGE_ALLOCATIONS].record(g_allocations.count() - allocations);
+         g_imageAllocations[IMAGE_ALLOCATED_BYTES].record(g_allocations.size() - allocatedBytes);
+      }
+      if (g_shardProgressSlot) {
+         g_shardProgressSlot[0].store(g_metrics.value(TF_IMAGES_SCANNED), std::memory_order_relaxed);
+         g_shardProgressSlot[1].store(g_metrics.value(TF_FACES_INSERTED), std::memory_order_relaxed);
+      }
+   }
+
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read image: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   prefetcher.stop();
+   g_metrics.increment(TF_IMAGES_PREFETCHED, prefetcher.prefetched());
+   return true;
+}
+
+/// Where an image of -W is in its pipeline.
+enum imagephase
+{
+   PHASE_MATCH,      ///< Find the master in Aperture.
+   PHASE_LOOKUP,     ///< Look up faces, keywords, stack and GPS location.
+   PHASE_PREPARE,    ///< Convert the face coordinates and rewrite the XMP packet.
+   PHASE_WRITE       ///< Wait for the writer.
+};
+
+/// What the workers of -W look up for one image.
+struct imagerecord
+{
+   long long sequence;              ///< The position in the order of writing.
+   ::sqlite3_int64 id;
+   std::string fileName;
+   std::string orientation;
+   ::sqlite3_int64 imageDate;
+   std::string copyName;
+   bool hasXmp;                     ///< Flag whether the image has an XMP packet.
+   std::string xmp;                 ///< The XMP packet, rewritten when prepared.
+
+   std::string masterUUID;
+   TFArena arena;                   ///< Holds the faces.
+   facelist faces;
+   std::deque<TFString> keywords;
+   TFUuidKey stackId;
+   bool hasLocation;
+   double latitude;
+   double longitude;
+   bool xmpRewritten;
+
+   imagephase phase;                ///< The next thing to do.
+   std::atomic<int> remaining;      ///< Lookups of the image still running.
+   unsigned long long nanos[STEP_COUNT];
+
+   imagerecord()
+   : sequence(0), id(0), imageDate(0), hasXmp(false), arena(1024), faces(arena),
+     stackId(), hasLocation(false), latitude(0), longitude(0), xmpRewritten(false),
+     phase(PHASE_MATCH), remaining(0)
+   {
+      for (int step = 0; step < STEP_COUNT; ++step) {
+         nanos[step] = 0;
+      }
+   }
+};
+
+/**
+ * Writes what the workers looked up for one image.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param record        The image.
+ * @param state         Receives the collected data and statistics.
+ * @return @c true on succes, @c false on any error.
+ */
+bool writeImageRecord(::sqlite3 *lightroomDB, imagerecord &record, transferstate &state)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   long long xmpBytes = 0;
+
+   g_metrics.increment(TF_IMAGES_SCANNED);
+   if (record.faces.size()) {
+      if (!writeFacesOfImage(lightroomDB, record.faces, record.id, record.fileName, record.orientation, state)) {
+         return false;
+      }
+   } else if (stageSelected(STAGE_FACES)) {
+      g_metrics.increment(TF_IMAGES_WITHOUT_FACES);
+   }
+   std::chrono::steady_clock::time_point facesWritten = std::chrono::steady_clock::now();
+   record.nanos[STEP_FACES_WRITE] += std::chrono::duration_cast<std::chrono::nanoseconds>(facesWritten - start).count();
+
+   if (stageSelected(STAGE_KEYWORDS)) {
+      state.keywordsByImage.insert(std::pair<::sqlite3_int64, std::deque<TFString>>(record.id, record.keywords));
+   }
+   if (!record.stackId.isNull()) {
+      state.stackedImages.push_back(stackimage{record.stackId, record.id});
+   }
+
+   if (record.hasLocation) {
+      bool written = writeGPSLocation(lightroomDB, record.id, record.latitude, record.longitude);
+      if (written && record.xmpRewritten) {
+         xmpBytes = record.xmp.size();
+         g_metrics.increment(TF_XMP_BYTES, xmpBytes);
+         written = writeXmp(lightroomDB, record.id, record.xmp);
+      } else if (written && !record.hasXmp) {
+         g_log.err() << "Warning: Did not find additional metadata" << std::endl;
+      }
+      if (!written) {
+         g_log.err() << "Failed to transfer GPS location for version " << record.fileName << ", " << record.copyName << std::endl;
+      }
+      record.nanos[STEP_GPS] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - facesWritten).count();
+   }
+
+   for (int step = STEP_TOTAL + 1; step < STEP_COUNT; ++step) {
+      record.nanos[STEP_TOTAL] += record.nanos[step];
+   }
+   // Fallback matches are counted per run only, the lookups of many images overlap.
+   recordImageLatency(record.fileName, record.copyName, record.nanos, record.faces.size(), 0, xmpBytes);
+   return true;
+}
+
+/**
+ * Transfers faces and GPS locations of all Lightroom images and collects
+ * their keywords and stacks, with the Aperture lookups done by a pool of
+ * g_imageThreads work-stealing threads.
+ *
+ * Each image runs through the phases of imagephase. This thread reads the
+ * image and its XMP packet from the catalog and starts it. A worker matches
+ * the master, then the image waits for its faces, keywords, stack and GPS
+ * location, which are looked up by tasks of their own. The worker finishing
+ * the last of them resumes the image: it converts the face coordinates and
+ * rewrites the XMP packet, then hands the image to this thread. No thread
+ * ever blocks on an image, so many images are in flight on a few threads.
+ *
+ * Each worker has its own connections to Aperture. This thread writes the
+ * images in the order of their ids, so the catalog ends up the same as with
+ * transferImages(). At most IMAGES_IN_FLIGHT images per worker are looked
+ * up ahead of the writes.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @param state         Receives the collected data and statistics.
+ * @return @c true on succes, @c false on any error.
+ */
+bool transferImagesStealing(::sqlite3 *lightroomDB,
+                            ::sqlite3 *apertureDB,
+                            ::sqlite3 *facesDB,
+                            transferstate &state)
+{
+   static const long long IMAGES_IN_FLIGHT = 64;
+
+   // Declared before the pool, which outlives none of them. The ring holds
+   // all images in flight, so the workers never wait for the writer.
+   std::vector<std::unique_ptr<stagedbs>> workerDBs(g_imageThreads);
+   TFRing<std::unique_ptr<imagerecord>> finished(IMAGES_IN_FLIGHT * g_imageThreads);
+   TFWorkStealingPool pool;
+   pool.start(g_imageThreads);
+
+   auto timed = [](imagerecord *record, imagestep step, std::function<void(void)> work) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      work();
+      record->nanos[step] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+   };
+   auto dbsOf = [&workerDBs, apertureDB, facesDB](int worker) -> stagedbs & {
+      if (!workerDBs[worker]) {
+         workerDBs[worker].reset(new stagedbs(apertureDB, facesDB));
+      }
+      return *workerDBs[worker];
+   };
+
+   // Runs the next phase of an image, up to where it has to wait.
+   std::function<void(imagerecord *, int)> resume;
+   auto lookedUp = [&resume](imagerecord *record, int worker) {
+      if (record->remaining.fetch_sub(1) == 1) {
+         record->phase = PHASE_PREPARE;
+         resume(record, worker);
+      }
+   };
+
+   resume = [&](imagerecord *record, int worker) {
+      if (record->phase == PHASE_MATCH) {
+         timed(record, STEP_FACES_READ, [&]() {
+            record->masterUUID = findImageUUIDForFilename(dbsOf(worker).apertureDB, record->fileName, record->imageDate);
+         });
+         if (record->masterUUID == "") {
+            g_log.err() << "Didn't find master UUID for " << record->fileName << std::endl;
+            record->phase = PHASE_WRITE;
+            finished.push(std::unique_ptr<imagerecord>(record));
+            return;
+         }
+         g_metrics.increment(TF_IMAGES_MATCHED);
+
+         std::vector<TFWorkStealingPool::task> tasks;
+         if (stageSelected(STAGE_FACES)) {
+            tasks.push_back([&, record](int worker) {
+               timed(record, STEP_FACES_READ, [&]() {
+                  record->faces.reserve(8);
+                  findFacesForMaster(record->faces, dbsOf(worker).facesDB, record->masterUUID);
+               });
+               lookedUp(record, worker);
+            });
+         }
+         if (stageSelected(STAGE_KEYWORDS)) {
+            tasks.push_back([&, record](int worker) {
+               timed(record, STEP_KEYWORDS, [&]() {
+                  if (!findKeywordsForMaster(record->keywords, dbsOf(worker).apertureDB, record->masterUUID, record->copyName)) {
+                     g_log.err() << "Failed to get keywords for version" << std::endl;
+                  }
+               });
+               lookedUp(record, worker);
+            });
+         }
+         if (stageSelected(STAGE_STACKS)) {
+            tasks.push_back([&, record](int worker) {
+               timed(record, STEP_STACK, [&]() {
+                  record->stackId = findApertureStackIdOfMaster(dbsOf(worker).apertureDB, record->masterUUID,
+                                                                record->fileName, record->copyName);
+               });
+               lookedUp(record, worker);
+            });
+         }
+         if (stageSelected(STAGE_GPS)) {
+            tasks.push_back([&, record](int worker) {
+               timed(record, STEP_GPS, [&]() {
+                  bool failed = false;
+                  record->hasLocation = findGPSOfVersion(dbsOf(worker).apertureDB, record->masterUUID, record->copyName,
+                                                         record->latitude, record->longitude, failed);
+                  if (failed) {
+                     g_log.err() << "Failed to get GPS location for version " << record->fileName << ", " << record->copyName << std::endl;
+                  }
+               });
+               lookedUp(record, worker);
+            });
+         }
+
+         // One more than the lookups, so the image is not resumed before all are submitted.
+         record->phase = PHASE_LOOKUP;
+         record->remaining = (int) tasks.size() + 1;
+         for (TFWorkStealingPool::task &task : tasks) {
+            pool.submit(task);
+         }
+         lookedUp(record, worker);
+      } else if (record->phase == PHASE_PREPARE) {
+         timed(record, STEP_FACES_WRITE, [&]() {
+            for (facedata &face : record->faces) {
+               orientFace(face, record->orientation);
+            }
+         });
+         if (record->hasLocation && record->hasXmp) {
+            timed(record, STEP_GPS, [&]() {
+               record->xmpRewritten = updateXmp(record->xmp, record->latitude, record->longitude);
+               if (!record->xmpRewritten) {
+                  g_log.err() << "Failed to update XMP data" << std::endl;
+               }
+            });
+         }
+         record->phase = PHASE_WRITE;
+         finished.push(std::unique_ptr<imagerecord>(record));
+      }
+   };
+
+   TFSql sql(lightroomDB,
+             "SELECT F.originalFilename, I.id_local, I.orientation, F.externalModTime, I.copyName "
+             "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
+             "WHERE F.id_local = I.rootFile "
+             "AND O.id_local = F.folder "
+             "AND R.id_local = O.rootFolder "
+             "ORDER BY I.id_local");
+   long long submitted = 0;
+   long long written = 0;
+   long long wakeups = 0;
+   bool success = true;
+
+   // Images finish in any order, they are written in the order of their ids.
+   std::map<long long, std::unique_ptr<imagerecord>> pending;
+   std::vector<std::unique_ptr<imagerecord>> batch;
+   auto writeNext = [&]() {
+      while (pending.empty() || pending.begin()->first != written) {
+         batch.clear();
+         finished.popBatch(batch, finished.size());
+         wakeups++;
+         for (std::unique_ptr<imagerecord> &record : batch) {
+            long long sequence = record->sequence;
+            pending[sequence] = std::move(record);
+         }
+      }
+      success = writeImageRecord(lightroomDB, *pending.begin()->second, state);
+      pending.erase(pending.begin());
+      written++;
+   };
+
+   while (success && sql.step()) {
+      while (success && submitted - written >= IMAGES_IN_FLIGHT * pool.size()) {
+         writeNext();
+      }
+
+      imagerecord *record = new imagerecord();
+      record->sequence = submitted++;
+      record->fileName = sql.column_str(0);
+      record->id = sql.column_int64(1);
+      record->orientation = sql.column_str(2);
+      record->imageDate = sql.column_int64(3);
+      record->copyName = sql.column_str(4);
+      if (stageSelected(STAGE_GPS)) {
+         TFSql findXMP(lightroomDB,
+                       "SELECT xmp "
+                       "FROM Adobe_AdditionalMetadata "
+                       "WHERE image = ?");
+         findXMP.bind(1, record->id);
+         record->hasXmp = findXMP.step();
+         record->xmp = findXMP.column_str(0);
+         if (findXMP.hasFailed()) {
+            g_log.err() << "Failed to read XMP data" << std::endl;
+         }
+      }
+      pool.submit([&resume, record](int worker) {
+         resume(record, worker);
+      });
+   }
+   while (success && written < submitted) {
+      writeNext();
+   }
+   // The tasks still queued after a failure refer to the lambdas above.
+   pool.stop();
+
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read image: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   g_log.out(TF_LOG_SUMMARY) << "Looked up " << written << " images in " << pool.size() << " threads, "
+                             << pool.steals() << " tasks were stolen, " << wakeups << " batches written" << std::endl;
+   return success;
+}
+
+/**
+ * Measures the hand-off from the resolver threads of -W to the writer:
+ * HANDOFF_PRODUCERS threads push records into a TFRing as fast as they can,
+ * this thread takes them in batches. For comparison, the same is done with
+ * a std::deque behind a mutex. Checks that the records of each producer
+ * arrive in the order pushed.
+ *
+ * @return The exit status.
+ */
+int benchmarkHandOff(void)
+{
+   static const int HANDOFF_PRODUCERS = 16;
+   static const long long HANDOFF_RECORDS = 1000000;   // Per producer.
+   static const size_t HANDOFF_CAPACITY = 1024;
+
+   typedef std::pair<int, long long> handoffrecord;      // Producer, sequence.
+   int result = 0;
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Hand-off queue, " << HANDOFF_PRODUCERS << " producers, "
+                             << HANDOFF_RECORDS << " records each" << std::endl << std::endl;
+
+   for (int locked = 0; locked < 2; ++locked) {
+      TFRing<handoffrecord> ring(HANDOFF_CAPACITY);
+      std::mutex mutex;
+      std::condition_variable changed;
+      std::deque<handoffrecord> queue;
+
+      std::vector<long long> expected(HANDOFF_PRODUCERS, 0);
+      std::vector<handoffrecord> batch;
+      std::vector<std::thread> producers;
+      long long received = 0;
+      long long wakeups = 0;
+      bool ordered = true;
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int producer = 0; producer < HANDOFF_PRODUCERS; ++producer) {
+         producers.push_back(std::thread([&, producer]() {
+            for (long long sequence = 0; sequence < HANDOFF_RECORDS; ++sequence) {
+               if (!locked) {
+                  ring.push(handoffrecord(producer, sequence));
+                  continue;
+               }
+               std::unique_lock<std::mutex> lock(mutex);
+               changed.wait(lock, [&]() { return queue.size() < HANDOFF_CAPACITY; });
+               queue.push_back(handoffrecord(producer, sequence));
+               changed.notify_all();
+            }
+         }));
+      }
+
+      while (received < HANDOFF_PRODUCERS * HANDOFF_RECORDS) {
+         batch.clear();
+         if (!locked) {
+            ring.popBatch(batch, HANDOFF_CAPACITY);
+         } else {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return !queue.empty(); });
+            batch.assign(queue.begin(), queue.end());
+            queue.clear();
+            changed.notify_all();
+         }
+         wakeups++;
+         for (const handoffrecord &record : batch) {
+            ordered = ordered && (record.second == expected[record.first]++);
+         }
+         received += batch.size();
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      for (std::thread &producer : producers) {
+         producer.join();
+      }
+
+      char line[160];
+      ::snprintf(line, sizeof(line), "%20s: %7.2f M records/s, %7.1f records per batch",
+                 locked ? "Mutex and deque" : "Lock-free",
+                 received / seconds / 1e6,
+                 (double) received / wakeups);
+      if (locked) {
+         g_log.out(TF_LOG_SUMMARY) << line << std::endl;
+      } else {
+         g_log.out(TF_LOG_SUMMARY) << line << ", " << ring.stalled() << " pushes waited for room" << std::endl;
+      }
+      if (!ordered) {
+         g_log.err() << "Records of a producer arrived out of order." << std::endl;
+         result = 1;
+      }
+   }
+   return result;
+}
+
+#ifdef SQLITE_ENABLE_SESSION
+/**
+ * Returns the name of the private copy of the catalog for one shard.
+ *
+ * @param shard   The number of the shard.
+ * @return The file name.
+ */
+std::string shardFileName(int shard)
+{
+   std::stringstream shardFile;
+   shardFile << g_lightroomDBFile << ".shard" << shard;
+   return shardFile.str();
+}
+
+/**
+ * Creates the private copies of the catalog for the shard workers.
+ *
+ * This has to be done before the catalog is changed: SQLite cannot copy a
+ * database while a write transaction is open.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param shards        The number of worker processes.
+ * @return @c true on succes, @c false on any error.
+ */
+bool copyCatalogForShards(::sqlite3 *lightroomDB, int shards)
+{
+   for (int shard = 0; shard < shards; ++shard) {
+      ::sqlite3 *copyDB = NULL;
+      ::sqlite3_backup *backup = NULL;
+      ::unlink(shardFileName(shard).c_str());
+      if (SQLITE_OK != ::sqlite3_open(shardFileName(shard).c_str(), &copyDB) ||
+          !(backup = ::sqlite3_backup_init(copyDB, "main", lightroomDB, "main"))) {
+         g_log.err() << "Can't copy catalog for shard: " << ::sqlite3_errmsg(copyDB) << std::endl;
+         ::sqlite3_close(copyDB);
+         return false;
+      }
+      ::sqlite3_backup_step(backup, -1);
+      if (SQLITE_OK != ::sqlite3_backup_finish(backup)) {
+         g_log.err() << "Can't copy catalog for shard: " << ::sqlite3_errmsg(copyDB) << std::endl;
+         ::sqlite3_close(copyDB);
+         return false;
+      }
+      ::sqlite3_close(copyDB);
+   }
+
+   return true;
+}
+
+/**
+ * Removes the private copies of the catalog and the changesets of the
+ * shard workers.
+ *
+ * @param shards        The number of worker processes.
+ */
+void removeShardFiles(int shards)
+{
+   for (int shard = 0; shard < shards; ++shard) {
+      ::unlink(shardFileName(shard).c_str());
+      ::unlink((shardFileName(shard) + ".changeset").c_str());
+   }
+}
+
+/**
+ * Opens a private connection to an Aperture database for a shard worker.
+ *
+ * Connections must not be used across fork(). File based databases are
+ * opened again, in-memory copies (server mode) have no file and are used as
+ * inherited.
+ *
+ * @param db   The handle opened by the parent.
+ * @return The handle to use in the worker.
+ */
+::sqlite3 *reopenForShard(::sqlite3 *db)
+{
+   const char *file = ::sqlite3_db_filename(db, "main");
+   if (!file || !*file) {
+      return db;
+   }
+
+   ::sqlite3 *shardDB = NULL;
+   if (SQLITE_OK != ::sqlite3_open_v2(file, &shardDB, SQLITE_OPEN_READONLY, TFIoVfs::name())) {
+      g_log.err() << "Can't open " << file << ": " << ::sqlite3_errmsg(shardDB) << std::endl;
+      ::sqlite3_close(shardDB);
+      return NULL;
+   }
+   return shardDB;
+}
+
+/// Tables used to pass the results of the shard workers to the parent.
+const char *g_shardTables[] = {
+   "CREATE TABLE tf_shardKeyword(shard, seq, image, name, PRIMARY KEY(shard, seq))",
+   "CREATE TABLE tf_shardStack(shard, seq, stack, image, PRIMARY KEY(shard, seq))",
+   "CREATE TABLE tf_shardPopularity(shard, seq, tag, PRIMARY KEY(shard, seq))",
+   "CREATE TABLE tf_shardPeople(shard, name, count, PRIMARY KEY(shard, name))",
+   "CREATE TABLE tf_shardStats(shard, counter, value, PRIMARY KEY(shard, counter))",
+   "CREATE TABLE tf_shardLatency(shard, step, bucket, count, PRIMARY KEY(shard, step, bucket))",
+   "CREATE TABLE tf_shardSlowest(shard, seq, nanos, reason, PRIMARY KEY(shard, seq))",
+   "CREATE TABLE tf_shardAllocations(shard, stage, source, count, bytes, PRIMARY KEY(shard, stage, source))",
+   "CREATE TABLE tf_shardImageAllocations(shard, kind, bucket, count, PRIMARY KEY(shard, kind, bucket))",
+   "CREATE TABLE tf_shardIo(shard, file, reads, bytesRead, writes, bytesWritten, syncs, readAheads, readAheadBytes, PRIMARY KEY(shard, file))"
+};
+
+/**
+ * Checks a statement on the tf_shard* tables after a step and logs its
+ * error.
+ *
+ * The statements are reset for each row, which clears the error state, so
+ * every row has to be checked.
+ *
+ * @param sql     The statement.
+ * @param action  What the statement does, for the error message.
+ * @return @c true if the statement did not fail, @c false else.
+ */
+bool shardStatementSucceeded(TFSql &sql, const char *action)
+{
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to " << action << ": " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+   return true;
+}
+
+/**
+ * Shard worker: Transfers a range of images into a private copy of the
+ * catalog and writes the changes as a changeset.
+ *
+ * Everything the parent needs besides the changes of Lightroom's tables (the
+ * keywords, stacks, deferred popularity increments and statistics) is
+ * stored in the tf_shard* tables, so it is part of the changeset, too.
+ *
+ * @param shard         The number of the shard.
+ * @param shardFile     The private copy of the catalog.
+ * @param apertureDB    The handle of the Aperture database (of the parent).
+ * @param facesDB       The handle of the face DB of Aperture (of the parent).
+ * @param firstImage    The lowest id_local of the images to process.
+ * @param lastImage     The highest id_local of the images to process.
+ * @param firstID       The first ID of the block reserved for this shard.
+ * @param endID         The first ID after the block reserved for this shard.
+ * @return The exit status of the worker.
+ */
+int runShard(int shard,
+             const std::string &shardFile,
+             ::sqlite3 *apertureDB,
+             ::sqlite3 *facesDB,
+             ::sqlite3_int64 firstImage,
+             ::sqlite3_int64 lastImage,
+             ::sqlite3_int64 firstID,
+             ::sqlite3_int64 endID)
+{
+   ::sqlite3 *shardDB = NULL;
+   ::sqlite3_session *session = NULL;
+   int changesetSize = 0;
+   void *changeset = NULL;
+   FILE *output = NULL;
+
+   transferstate state;
+   std::deque<::sqlite3_int64> popularity;
+
+   apertureDB = reopenForShard(apertureDB);
+   facesDB = reopenForShard(facesDB);
+   if (!apertureDB || !facesDB) {
+      return 1;
+   }
+
+   if (SQLITE_OK != ::sqlite3_open_v2(shardFile.c_str(), &shardDB, SQLITE_OPEN_READWRITE, NULL)) {
+      g_log.err() << "Can't open shard catalog: " << ::sqlite3_errmsg(shardDB) << std::endl;
+      return 1;
+   }
+   if (SQLITE_OK != ::sqlite3session_create(shardDB, "main", &session) ||
+       SQLITE_OK != ::sqlite3session_attach(session, NULL)) {
+      g_log.err() << "Can't record changes of shard: " << ::sqlite3_errmsg(shardDB) << std::endl;
+      return 1;
+   }
+   sqlite3_exec(shardDB, "BEGIN", 0, 0, 0);
+
+   for (size_t i = 0; i < (sizeof(g_shardTables)/sizeof(const char *)); ++i) {
+      if (!executeStatement(shardDB, g_shardTables[i])) {
+         return 1;
+      }
+   }
+
+   setLocalIDBlock(firstID, endID);
+   g_deferredPopularity = &popularity;
+   // Only report what this shard did, the parent adds it up.
+   g_metrics.resetCounters();
+   g_allocations.reset();
+   TFIoVfs::resetStats();
+   g_shardProgressSlot = g_shardProgress ? g_shardProgress + 2 * shard : NULL;
+   resetLatencies();
+
+   if (!transferImages(shardDB, apertureDB, facesDB, firstImage, lastImage, state)) {
+      return 1;
+   }
+
+   {
+      ::sqlite3_int64 seq = 0;
+      TFSql sql(shardDB,
+                "INSERT INTO tf_shardKeyword(shard, seq, image, name) "
+                "VALUES(?, ?, ?, ?)");
+      for (auto &keywords : state.keywordsByImage) {
+         for (TFString keyword : keywords.second) {
+            sql.reset("INSERT INTO tf_shardKeyword(shard, seq, image, name) "
+                      "VALUES(?, ?, ?, ?)");
+            sql.bind(1, (::sqlite3_int64) shard);
+            sql.bind(2, seq++);
+            sql.bind(3, keywords.first);
+            sql.bind(4, keyword.c_str(), (int) keyword.size());
+            sql.step();
+            if (!shardStatementSucceeded(sql, "store shard results")) {
+               return 1;
+            }
+         }
+      }
+      for (const stackimage &stacked : state.stackedImages) {
+         char stack[36];
+         stacked.stack.toHex(stack);
+         sql.reset("INSERT INTO tf_shardStack(shard, seq, stack, image) "
+                   "VALUES(?, ?, ?, ?)");
+         sql.bind(1, (::sqlite3_int64) shard);
+         sql.bind(2, seq++);
+         sql.bind(3, stack, sizeof(stack));
+         sql.bind(4, stacked.image);
+         sql.step();
+         if (!shardStatementSucceeded(sql, "store shard results")) {
+            return 1;
+         }
+      }
+      for (::sqlite3_int64 tag : popularity) {
+         sql.reset("INSERT INTO tf_shardPopularity(shard, seq, tag) "
+                   "VALUES(?, ?, ?)");
+         sql.bind(1, (::sqlite3_int64) shard);
+         sql.bind(2, seq++);
+         sql.bind(3, tag);
+         sql.step();
+         if (!shardStatementSucceeded(sql, "store shard results")) {
+            return 1;
+         }
+      }
+      for (auto &person : state.insertedPeople) {
+         sql.reset("INSERT INTO tf_shardPeople(shard, name, count) "
+                   "VALUES(?, ?, ?)");
+         sql.bind(1, (::sqlite3_int64) shard);
+         sql.bind(2, person.first.c_str(), (int) person.first.size());
+         sql.bind(3, (::sqlite3_int64) person.second);
+         sql.step();
+         if (!shardStatementSucceeded(sql, "store shard results")) {
+            return 1;
+         }
+      }
+      for (int step = 0; step < STEP_COUNT; ++step) {
+         for (int bucket = 0; bucket < TFHistogram::BUCKETS; ++bucket) {
+            if (g_latency[step].countOf(bucket)) {
+               sql.reset("INSERT INTO tf_shardLatency(shard, step, bucket, count) "
+                         "VALUES(?, ?, ?, ?)");
+               sql.bind(1, (::sqlite3_int64) shard);
+               sql.bind(2, (::sqlite3_int64) step);
+               sql.bind(3, (::sqlite3_int64) bucket);
+               sql.bind(4, (::sqlite3_int64) g_latency[step].countOf(bucket));
+               sql.step();
+               if (!shardStatementSucceeded(sql, "store shard results")) {
+                  return 1;
+               }
+            }
+         }
+      }
+      for (auto &slow : g_slowestImages.sorted()) {
+         sql.reset("INSERT INTO tf_shardSlowest(shard, seq, nanos, reason) "
+                   "VALUES(?, ?, ?, ?)");
+         sql.bind(1, (::sqlite3_int64) shard);
+         sql.bind(2, seq++);
+         sql.bind(3, (::sqlite3_int64) slow.first);
+         sql.bind(4, slow.second);
+         sql.step();
+         if (!shardStatementSucceeded(sql, "store shard results")) {
+            return 1;
+         }
+      }
+      for (int stage = 0; stage < g_allocations.stages(); ++stage) {
+         for (int source = 0; source < TF_ALLOC_SOURCE_COUNT; ++source) {
+            if (g_allocations.countOf(stage, (TFAllocSource) source)) {
+               sql.reset("INSERT INTO tf_shardAllocations(shard, stage, source, count, bytes) "
+                         "VALUES(?, ?, ?, ?, ?)");
+               sql.bind(1, (::sqlite3_int64) shard);
+               sql.bind(2, g_allocations.stageName(stage));
+               sql.bind(3, (::sqlite3_int64) source);
+               sql.bind(4, (::sqlite3_int64) g_allocations.countOf(stage, (TFAllocSource) source));
+               sql.bind(5, (::sqlite3_int64) g_allocations.bytesOf(stage, (TFAllocSource) source));
+               sql.step();
+               if (!shardStatementSucceeded(sql, "store shard results")) {
+                  return 1;
+               }
+            }
+         }
+      }
+      for (int kind = 0; kind < IMAGE_ALLOCATION_COUNT; ++kind) {
+         for (int bucket = 0; bucket < TFHistogram::BUCKETS; ++bucket) {
+            if (g_imageAllocations[kind].countOf(bucket)) {
+               sql.reset("INSERT INTO tf_shardImageAllocations(shard, kind, bucket, count) "
+                         "VALUES(?, ?, ?, ?)");
+               sql.bind(1, (::sqlite3_int64) shard);
+               sql.bind(2, (::sqlite3_int64) kind);
+               sql.bind(3, (::sqlite3_int64) bucket);
+               sql.bind(4, (::sqlite3_int64) g_imageAllocations[kind].countOf(bucket));
+               sql.step();
+               if (!shardStatementSucceeded(sql, "store shard results")) {
+                  return 1;
+               }
+            }
+         }
+      }
+      for (const std::pair<const std::string, tfiostats> &file : TFIoVfs::stats()) {
+         const tfiostats &io = file.second;
+         if (io.reads || io.writes || io.syncs) {
+            sql.reset("INSERT INTO tf_shardIo(shard, file, reads, bytesRead, writes, bytesWritten, syncs, readAheads, readAheadBytes) "
+                      "VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?)");
+            sql.bind(1, (::sqlite3_int64) shard);
+            sql.bind(2, file.first);
+            sql.bind(3, (::sqlite3_int64) io.reads);
+            sql.bind(4, (::sqlite3_int64) io.bytesRead);
+            sql.bind(5, (::sqlite3_int64) io.writes);
+            sql.bind(6, (::sqlite3_int64) io.bytesWritten);
+            sql.bind(7, (::sqlite3_int64) io.syncs);
+            sql.bind(8, (::sqlite3_int64) io.readAheads);
+            sql.bind(9, (::sqlite3_int64) io.readAheadBytes);
+            sql.step();
+            if (!shardStatementSucceeded(sql, "store shard results")) {
+               return 1;
+            }
+         }
+      }
+      for (int counter = 0; counter < TF_COUNTER_COUNT; ++counter) {
+         sql.reset("INSERT INTO tf_shardStats(shard, counter, value) "
+                   "VALUES(?, ?, ?)");
+         sql.bind(1, (::sqlite3_int64) shard);
+         sql.bind(2, (::sqlite3_int64) counter);
+         sql.bind(3, (::sqlite3_int64) g_metrics.value((TFCounter) counter));
+         sql.step();
+         if (!shardStatementSucceeded(sql, "store shard results")) {
+            return 1;
+         }
+      }
+   }
+
+   if (SQLITE_OK != ::sqlite3session_changeset(session, &changesetSize, &changeset)) {
+      g_log.err() << "Failed to create changeset of shard: " << ::sqlite3_errmsg(shardDB) << std::endl;
+      return 1;
+   }
+
+   output = ::fopen((shardFile + ".changeset").c_str(), "wb");
+   if (!output ||
+       (changesetSize > 0 && 1 != ::fwrite(changeset, changesetSize, 1, output)) ||
+       0 != ::fclose(output)) {
+      g_log.err() << "Failed to write changeset of shard: " << ::strerror(errno) << std::endl;
+      return 1;
+   }
+
+   // The private copy is not needed anymore, the changeset has it all.
+   ::sqlite3_free(changeset);
+   ::sqlite3session_delete(session);
+   sqlite3_exec(shardDB, "ROLLBACK", 0, 0, 0);
+   ::sqlite3_close(shardDB);
+
+   return 0;
+}
+
+/**
+ * Conflict handler for sqlite3changeset_apply().
+ *
+ * The shards change disjoint images with disjoint IDs. The only expected
+ * conflicts are deletions of rows already removed by the parent (the copies
+ * were taken before the keywords were removed). Any other conflict is an
+ * error.
+ */
+int abortOnConflict(void *, int conflict, ::sqlite3_changeset_iter *iter)
+{
+   const char *table = NULL;
+   int columns = 0;
+   int operation = 0;
+   ::sqlite3changeset_op(iter, &table, &columns, &operation, NULL);
+   if (operation == SQLITE_DELETE && conflict == SQLITE_CHANGESET_NOTFOUND) {
+      return SQLITE_CHANGESET_OMIT;
+   }
+   g_log.err() << "Conflict " << conflict << " when merging changes of " << table << std::endl;
+   return SQLITE_CHANGESET_ABORT;
+}
+
+/**
+ * Applies the changeset written by a shard worker.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param file          The changeset file.
+ * @return @c true on succes, @c false on any error.
+ */
+bool applyShardChangeset(::sqlite3 *lightroomDB, const std::string &file)
+{
+   std::string changeset;
+   FILE *input = ::fopen(file.c_str(), "rb");
+   if (!input) {
+      g_log.err() << "Can't read changeset " << file << ": " << ::strerror(errno) << std::endl;
+      return false;
+   }
+   char buffer[65536];
+   size_t size;
+   while (0 < (size = ::fread(buffer, 1, sizeof(buffer), input))) {
+      changeset.append(buffer, size);
+   }
+   ::fclose(input);
+
+   if (SQLITE_OK != ::sqlite3changeset_apply(lightroomDB,
+                                             changeset.size(),
+                                             &changeset[0],
+                                             NULL,
+                                             abortOnConflict,
+                                             NULL)) {
+      g_log.err() << "Failed to apply changeset " << file << ": " << ::sqlite3_errmsg(lightroomDB) << std::endl;
+      return false;
+   }
+
+   return true;
+}
+
+/**
+ * Shard mode: Transfers the images in several processes and merges their
+ * changes.
+ *
+ * Adobe_images is split into ranges of id_local. Each worker process gets
+ * its own copy of the catalog and its own block of IDs and writes its changes
+ * as a changeset. The changesets are applied in order of the shards.
+ *
+ * Everything that depends on all images is not done by the workers:
+ * - Person keywords are created before the workers start, unused ones are
+ *   removed again after the merge.
+ * - Keyword popularity increments are replayed in image order after the
+ *   merge.
+ * - Stacks, keywords and their cooccurrences are created from the merged
+ *   data, as in a normal run.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @param shards        The number of worker processes.
+ * @param state         Receives the collected data and statistics.
+ * @return @c true on succes, @c false on any error.
+ */
+bool transferImagesSharded(::sqlite3 *lightroomDB,
+                           ::sqlite3 *apertureDB,
+                           ::sqlite3 *facesDB,
+                           int shards,
+                           transferstate &state)
+{
+   ::sqlite3_int64 firstImage = 0;
+   ::sqlite3_int64 lastImage = -1;
+   ::sqlite3_int64 imageCount = 0;
+   ::sqlite3_int64 faceCount = 0;
+   std::deque<::sqlite3_int64> createdPeople;
+   std::unordered_map<TFString, ::sqlite3_int64> personKeywords;
+   std::vector<::pid_t> workers;
+   bool success = true;
+
+   {
+      TFSql sql(lightroomDB,
+                "SELECT min(id_local), max(id_local), count(*) "
+                "FROM Adobe_images");
+      if (sql.step()) {
+         firstImage = sql.column_int64(0);
+         lastImage = sql.column_int64(1);
+         imageCount = sql.column_int64(2);
+      }
+      if (sql.hasFailed()) {
+         g_log.err() << "Failed to find range of images: " << sql.getErrorMsg() << std::endl;
+         return false;
+      }
+
+      // The faces of a master are inserted for each of its versions.
+      std::unordered_map<std::string, ::sqlite3_int64> versionCounts;
+      TFSql versions(apertureDB,
+                     "SELECT masterUuid, count(*) "
+                     "FROM RKVersion "
+                     "GROUP BY masterUuid");
+      while (versions.step()) {
+         versionCounts[versions.column_str(0)] = versions.column_int64(1);
+      }
+      if (versions.hasFailed()) {
+         g_log.err() << "Failed to count versions: " << versions.getErrorMsg() << std::endl;
+         return false;
+      }
+
+      TFSql faces(facesDB,
+                  "SELECT masterUuid, count(*) "
+                  "FROM RKDetectedFace "
+                  "WHERE rejected = 0 "
+                  "GROUP BY masterUuid");
+      while (faces.step()) {
+         auto found = versionCounts.find(faces.column_str(0));
+         faceCount += faces.column_int64(1) * (found == versionCounts.end() ? 1 : std::max<::sqlite3_int64>(found->second, 1));
+      }
+      if (faces.hasFailed()) {
+         g_log.err() << "Failed to count faces: " << faces.getErrorMsg() << std::endl;
+         return false;
+      }
+   }
+
+   // Workers must not create keywords, they would create the same person
+   // more than once.
+   if (stageSelected(STAGE_FACES)) {
+      TFSql sql(facesDB,
+                "SELECT DISTINCT N.name "
+                "FROM RKFaceName N, RKDetectedFace F "
+                "WHERE N.faceKey = F.faceKey "
+                "AND F.rejected = 0");
+      while (sql.step()) {
+         TFString name(normalizeUTF8(sql.column_str(0)));
+         if (name.empty() || personKeywords.count(name)) {
+            continue;
+         }
+         ::sqlite3_int64 keywordID = findExistingKeywordID(lightroomDB, name.str());
+         if (keywordID == -1) {
+            keywordID = createNewKeyword(lightroomDB, name.str(), getRootKeywordId(lightroomDB), "person");
+            if (keywordID == -1) {
+               return false;
+            }
+            createdPeople.push_back(keywordID);
+         }
+         personKeywords[name] = keywordID;
+      }
+      if (sql.hasFailed()) {
+         g_log.err() << "Failed to list people: " << sql.getErrorMsg() << std::endl;
+         return false;
+      }
+   }
+
+   for (size_t i = 0; i < (sizeof(g_shardTables)/sizeof(const char *)); ++i) {
+      if (!executeStatement(lightroomDB, g_shardTables[i])) {
+         return false;
+      }
+   }
+
+   // Per image: one process history entry, per face of each version:
+   // cluster, face, face data, keyword face and keyword image. A shard that
+   // still runs out of IDs fails in getNextLocalID().
+   ::sqlite3_int64 blockSize = 5 * faceCount + imageCount + 1;
+   ::sqlite3_int64 firstID = reserveLocalIDs(lightroomDB, blockSize * shards);
+   if (firstID < 0) {
+      return false;
+   }
+
+   ::sqlite3_int64 rangeSize = (lastImage - firstImage) / shards + 1;
+   g_log.out(TF_LOG_SUMMARY) << "Transferring " << imageCount << " images in " << shards << " shards" << std::endl;
+   g_log.flush();
+
+   for (int shard = 0; success && shard < shards; ++shard) {
+      ::pid_t pid = ::fork();
+      if (pid == 0) {
+         g_log.afterFork();
+         g_uuids.afterFork(shard);
+         TFStringPool::global().afterFork();
+         g_personKeywords = &personKeywords;
+         int status = runShard(shard,
+                               shardFileName(shard),
+                               apertureDB,
+                               facesDB,
+                               firstImage + shard * rangeSize,
+                               firstImage + (shard + 1) * rangeSize - 1,
+                               firstID + shard * blockSize,
+                               firstID + (shard + 1) * blockSize);
+         g_log.flush();
+         ::_exit(status);
+      }
+      if (pid < 0) {
+         g_log.err() << "Failed to start shard worker: " << ::strerror(errno) << std::endl;
+         success = false;
+      } else {
+         workers.push_back(pid);
+      }
+   }
+
+   for (::pid_t pid : workers) {
+      int status = 0;
+      while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+         g_log.err() << "Shard worker " << pid << " failed" << std::endl;
+         success = false;
+      }
+   }
+
+   for (int shard = 0; success && shard < shards; ++shard) {
+      if (!applyShardChangeset(lightroomDB, shardFileName(shard) + ".changeset")) {
+         success = false;
+      }
+   }
+   removeShardFiles(shards);
+   if (!success) {
+      return false;
+   }
+
+   // Reduce the results of the shards.
+   TFSql sql(lightroomDB,
+             "SELECT image, name "
+             "FROM tf_shardKeyword "
+             "ORDER BY shard, seq");
+   while (sql.step()) {
+      state.keywordsByImage[sql.column_int64(0)].push_back(TFString(sql.column_str(1)));
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT stack, image "
+             "FROM tf_shardStack "
+             "ORDER BY shard, seq");
+   while (sql.step()) {
+      state.stackedImages.push_back(stackimage{TFUuidKey::fromText(sql.column_str(0)), sql.column_int64(1)});
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT name, sum(count) "
+             "FROM tf_shardPeople "
+             "GROUP BY name");
+   while (sql.step()) {
+      state.insertedPeople[TFString(sql.column_str(0))] += sql.column_int64(1);
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT counter, sum(value) "
+             "FROM tf_shardStats "
+             "GROUP BY counter");
+   while (sql.step()) {
+      g_metrics.increment((TFCounter) sql.column_int64(0), sql.column_int64(1));
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT step, bucket, sum(count) "
+             "FROM tf_shardLatency "
+             "GROUP BY step, bucket");
+   while (sql.step()) {
+      ::sqlite3_int64 step = sql.column_int64(0);
+      if (step >= 0 && step < STEP_COUNT) {
+         g_latency[step].add(sql.column_int64(1), sql.column_int64(2));
+      }
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT nanos, reason "
+             "FROM tf_shardSlowest");
+   while (sql.step()) {
+      g_slowestImages.add(sql.column_int64(0), sql.column_str(1));
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT stage, source, sum(count), sum(bytes) "
+             "FROM tf_shardAllocations "
+             "GROUP BY stage, source");
+   while (sql.step()) {
+      ::sqlite3_int64 source = sql.column_int64(1);
+      if (source >= 0 && source < TF_ALLOC_SOURCE_COUNT) {
+         g_allocations.add(g_allocations.stageIndex(sql.column_str(0)), (TFAllocSource) source,
+                           sql.column_int64(2), sql.column_int64(3));
+      }
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT file, sum(reads), sum(bytesRead), sum(writes), sum(bytesWritten), sum(syncs), sum(readAheads), sum(readAheadBytes) "
+             "FROM tf_shardIo "
+             "GROUP BY file");
+   while (sql.step()) {
+      tfiostats io;
+      io.reads = sql.column_int64(1);
+      io.bytesRead = sql.column_int64(2);
+      io.writes = sql.column_int64(3);
+      io.bytesWritten = sql.column_int64(4);
+      io.syncs = sql.column_int64(5);
+      io.readAheads = sql.column_int64(6);
+      io.readAheadBytes = sql.column_int64(7);
+      TFIoVfs::addStats(sql.column_str(0), io);
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+   sql.reset("SELECT kind, bucket, sum(count) "
+             "FROM tf_shardImageAllocations "
+             "GROUP BY kind, bucket");
+   while (sql.step()) {
+      ::sqlite3_int64 kind = sql.column_int64(0);
+      if (kind >= 0 && kind < IMAGE_ALLOCATION_COUNT) {
+         g_imageAllocations[kind].add(sql.column_int64(1), sql.column_int64(2));
+      }
+   }
+   if (!shardStatementSucceeded(sql, "read results of shards")) {
+      return false;
+   }
+
+   std::deque<::sqlite3_int64> popularity;
+   sql.reset("SELECT tag "
+             "FROM tf_shardPopularity "
+             "ORDER BY shard, seq");
+   while (sql.step()) {
+      popularity.push_back(sql.column_int64(0));
+   }
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read keyword popularity of shards: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+   for (::sqlite3_int64 tag : popularity) {
+      if (!incrementKeywordPopularity(lightroomDB, tag)) {
+         return false;
+      }
+   }
+
+   for (::sqlite3_int64 keywordID : createdPeople) {
+      sql.reset("DELETE FROM AgLibraryKeyword "
+                "WHERE id_local = ? "
+                "AND NOT EXISTS (SELECT 1 FROM AgLibraryKeywordFace WHERE tag = ?)");
+      sql.bind(1, keywordID);
+      sql.bind(2, keywordID);
+      sql.step();
+      if (!shardStatementSucceeded(sql, "remove unused people")) {
+         return false;
+      }
+   }
+
+   for (size_t i = 0; i < (sizeof(g_shardTables)/sizeof(const char *)); ++i) {
+      std::string table = g_shardTables[i];
+      table = table.substr(13, table.find('(') - 13);
+      if (!executeStatement(lightroomDB, "DROP TABLE " + table)) {
+         return false;
+      }
+   }
+
+   return true;
+}
+#else
+bool copyCatalogForShards(::sqlite3 *, int)
+{
+   g_log.err() << "Shard mode needs SQLite's session extension, compile with -DSQLITE_ENABLE_SESSION -DSQLITE_ENABLE_PREUPDATE_HOOK" << std::endl;
+   return false;
+}
+
+void removeShardFiles(int)
+{
+}
+
+bool transferImagesSharded(::sqlite3 *,
+                           ::sqlite3 *,
+                           ::sqlite3 *,
+                           int,
+                           transferstate &)
+{
+   return false;
+}
+#endif
+
+/**
+ * Opens the Aperture databases read-only.
+ *
+ * In server mode, the databases are copied into memory and get some additional
+ * indexes for the lookups done per image. Since the copies are private, adding
+ * indexes does not touch the Aperture library.
+ *
+ * @param apertureDBFile   The path of the Aperture main database.
+ * @param facesDBFile      The path of the Aperture faces database.
+ * @param apertureDB       Receives the handle of the Aperture main database.
+ * @param facesDB          Receives the handle of the Aperture faces database.
+ * @param inMemory         Flag whether the databases should be loaded into memory.
+ * @return @c true on succes, @c false on any error.
+ */
+bool openApertureDatabases(const std::string &apertureDBFile,
+                           const std::string &facesDBFile,
+                           ::sqlite3 **apertureDB,
+                           ::sqlite3 **facesDB,
+                           bool inMemory)
+{
+   const char *files[] = { apertureDBFile.c_str(), facesDBFile.c_str() };
+   const char *names[] = { "aperture main", "aperture faces" };
+   ::sqlite3 **handles[] = { apertureDB, facesDB };
+
+   for (int i = 0; i < 2; ++i) {
+      if (SQLITE_OK != ::sqlite3_open_v2(files[i], handles[i], SQLITE_OPEN_READONLY, TFIoVfs::name())) {
+         g_log.err() << "Can't open " << names[i] << " database: " << ::sqlite3_errmsg(*handles[i]) << std::endl;
+         return false;
+      }
+
+      if (!inMemory) {
+         continue;
+      }
+
+      ::sqlite3 *memoryDB = NULL;
+      if (SQLITE_OK != ::sqlite3_open(":memory:", &memoryDB)) {
+         g_log.err() << "Can't create in-memory copy of " << names[i] << " database: " << ::sqlite3_errmsg(memoryDB) << std::endl;
+         ::sqlite3_close(memoryDB);
+         return false;
+      }
+
+      ::sqlite3_backup *backup = ::sqlite3_backup_init(memoryDB, "main", *handles[i], "main");
+      if (!backup) {
+         g_log.err() << "Can't load " << names[i] << " database into memory: " << ::sqlite3_errmsg(memoryDB) << std::endl;
+         ::sqlite3_close(memoryDB);
+         return false;
+      }
+      ::sqlite3_backup_step(backup, -1);
+      if (SQLITE_OK != ::sqlite3_backup_finish(backup)) {
+         g_log.err() << "Can't load " << names[i] << " database into memory: " << ::sqlite3_errmsg(memoryDB) << std::endl;
+         ::sqlite3_close(memoryDB);
+         return false;
+      }
+
+      ::sqlite3_close(*handles[i]);
+      *handles[i] = memoryDB;
+   }
+
+   if (inMemory) {
+      const char *indexes[] = {
+         "CREATE INDEX IF NOT EXISTS tf_RKMaster_fileName ON RKMaster(fileName, fileModificationDate)",
+         "CREATE INDEX IF NOT EXISTS tf_RKMaster_fileModificationDate ON RKMaster(fileModificationDate)",
+         "CREATE INDEX IF NOT EXISTS tf_RKVersion_masterUuid ON RKVersion(masterUuid, versionNumber)",
+         "CREATE INDEX IF NOT EXISTS tf_RKKeywordForVersion_versionId ON RKKeywordForVersion(versionId)"
+      };
+      for (size_t i = 0; i < (sizeof(indexes)/sizeof(const char *)); ++i) {
+         TFSql sql(*apertureDB, indexes[i]);
+         sql.step();
+         if (sql.hasFailed()) {
+            g_log.err() << "Failed to execute " << indexes[i] << ": " << sql.getErrorMsg() << std::endl;
+            return false;
+         }
+      }
+
+      const char *faceIndexes[] = {
+         "CREATE INDEX IF NOT EXISTS tf_RKDetectedFace_masterUuid ON RKDetectedFace(masterUuid)",
+         "CREATE INDEX IF NOT EXISTS tf_RKFaceName_faceKey ON RKFaceName(faceKey)"
+      };
+      for (size_t i = 0; i < (sizeof(faceIndexes)/sizeof(const char *)); ++i) {
+         TFSql sql(*facesDB, faceIndexes[i]);
+         sql.step();
+         if (sql.hasFailed()) {
+            g_log.err() << "Failed to execute " << faceIndexes[i] << ": " << sql.getErrorMsg() << std::endl;
+            return false;
+         }
+      }
+   }
+
+   return true;
+}
+
+/**
+ * Marks the start of a new stage of the transfer for the metrics and the
+ * hardware counters.
+ *
+ * @param name The name of the stage ("" to end the current stage only).
+ */
+void enterStage(const std::string &name)
+{
+   g_metrics.stage(name);
+   g_perf.stage(name);
+   g_allocations.stage(name);
+   g_progress.stage(name);
+}
+
+/**
+ * Starts the progress reports, if asked for.
+ *
+ * Counts the images first. In shard mode the workers publish what they did
+ * in shared memory, since their counters only reach this process when they
+ * are done.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ */
+void startProgress(::sqlite3 *lightroomDB)
+{
+   if (g_progressInterval <= 0) {
+      return;
+   }
+
+   TFSql sql(lightroomDB,
+             "SELECT count(*) "
+             "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
+             "WHERE F.id_local = I.rootFile "
+             "AND O.id_local = F.folder "
+             "AND R.id_local = O.rootFolder");
+   if (!sql.step()) {
+      g_log.err() << "Warning: Failed to count images, no progress reports: " << sql.getErrorMsg() << std::endl;
+      return;
+   }
+   long long total = sql.column_int64(0);
+
+   if (g_shards > 1) {
+      void *shared = ::mmap(NULL, 2 * g_shards * sizeof(std::atomic<long long>),
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+      if (shared != MAP_FAILED) {
+         g_shardProgress = (std::atomic<long long> *) shared;
+         for (int i = 0; i < 2 * g_shards; ++i) {
+            new (&g_shardProgress[i]) std::atomic<long long>(0);
+         }
+      }
+   }
+
+   g_progress.start(total, g_progressInterval, g_progressJson,
+      [](long long &images, long long &faces) {
+         images = g_metrics.value(TF_IMAGES_SCANNED);
+         faces = g_metrics.value(TF_FACES_INSERTED);
+         if (g_shardProgress) {
+            // Until the workers are merged, only they know.
+            long long shardImages = 0;
+            long long shardFaces = 0;
+            for (int i = 0; i < g_shards; ++i) {
+               shardImages += g_shardProgress[2 * i].load(std::memory_order_relaxed);
+               shardFaces += g_shardProgress[2 * i + 1].load(std::memory_order_relaxed);
+            }
+            images = std::max(images, shardImages);
+            faces = std::max(faces, shardFaces);
+         }
+      },
+      [](const std::string &line) {
+         g_log.err() << line;
+      });
+}
+
+/**
+ * Stops the progress reports, with a last report.
+ */
+void stopProgress(void)
+{
+   g_progress.stop();
+   if (g_shardProgress) {
+      ::munmap(g_shardProgress, 2 * g_shards * sizeof(std::atomic<long long>));
+      g_shardProgress = NULL;
+   }
+}
+
+/**
+ * Prints the I/O done on the Aperture databases.
+ */
+void printIoStats(void)
+{
+   long long images = std::max(g_metrics.value(TF_IMAGES_SCANNED), 1LL);
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### I/O on the Aperture databases" << std::endl << std::endl;
+   for (const std::pair<const std::string, tfiostats> &file : TFIoVfs::stats()) {
+      const tfiostats &io = file.second;
+      if (!io.reads && !io.writes && !io.syncs) {
+         continue;
+      }
+      g_log.out(TF_LOG_SUMMARY) << file.first << ":" << std::endl;
+      g_log.out(TF_LOG_SUMMARY) << "   " << io.reads << " reads (" << io.bytesRead / 1024 << " KB, "
+                << (double) io.reads / images << " per image), "
+                << io.writes << " writes (" << io.bytesWritten / 1024 << " KB), "
+                << io.syncs << " syncs" << std::endl;
+      g_log.out(TF_LOG_SUMMARY) << "   " << io.readAheads << " read-ahead hints (" << io.readAheadBytes / 1024 << " KB)" << std::endl;
+   }
+}
+
+/**
+ * Prints the allocations of each stage and per image.
+ */
+void printAllocations(void)
+{
+   static const char *sources[TF_ALLOC_SOURCE_COUNT] = { "C++", "SQLite" };
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Allocations" << std::endl << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << "             source      allocations           bytes" << std::endl;
+   for (int stage = 0; stage < g_allocations.stages(); ++stage) {
+      for (int source = 0; source < TF_ALLOC_SOURCE_COUNT; ++source) {
+         char line[256];
+         ::snprintf(line, sizeof(line), "%-12s %-8s %14lld %15lld",
+                    g_allocations.stageName(stage).c_str(), sources[source],
+                    g_allocations.countOf(stage, (TFAllocSource) source),
+                    g_allocations.bytesOf(stage, (TFAllocSource) source));
+         g_log.out(TF_LOG_SUMMARY) << line << std::endl;
+      }
+   }
+
+   if (g_imageAllocations[IMAGE_ALLOCATIONS].count() == 0) {
+      // Concurrent stages (-T) do not handle an image in one piece.
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "Per image: not recorded in this mode" << std::endl;
+      return;
+   }
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "Per image:      mean       p50       p90       p99       max" << std::endl;
+   static const char *kinds[IMAGE_ALLOCATION_COUNT] = { "allocations", "bytes" };
+   for (int kind = 0; kind < IMAGE_ALLOCATION_COUNT; ++kind) {
+      const TFHistogram &histogram = g_imageAllocations[kind];
+      char line[256];
+      ::snprintf(line, sizeof(line), "%-12s %9.0f %9llu %9llu %9llu %9llu",
+                 kinds[kind], histogram.mean(),
+                 histogram.percentile(50), histogram.percentile(90),
+                 histogram.percentile(99), histogram.max());
+      g_log.out(TF_LOG_SUMMARY) << line << std::endl;
+   }
+}
+
+/**
+ * Prints the hardware counters of each stage.
+ */
+void printPerfCounters(void)
+{
+   long long images = std::max(g_metrics.value(TF_IMAGES_SCANNED), 1LL);
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Hardware counters" << std::endl << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << "                 cycles   instructions   IPC  cache misses  branch misses  page faults" << std::endl;
+   for (const TFPerfCounters::stagecounts &counts : g_perf.results()) {
+      const unsigned long long *c = counts.counts;
+      double ipc = c[TF_PERF_CYCLES] ? (double) c[TF_PERF_INSTRUCTIONS] / c[TF_PERF_CYCLES] : 0;
+      char line[256];
+      ::snprintf(line, sizeof(line), "%-12s %12llu %14llu %5.2f %13llu %14llu %12llu",
+                 counts.name.c_str(), c[TF_PERF_CYCLES], c[TF_PERF_INSTRUCTIONS], ipc,
+                 c[TF_PERF_CACHE_MISSES], c[TF_PERF_BRANCH_MISSES], c[TF_PERF_PAGE_FAULTS]);
+      g_log.out(TF_LOG_SUMMARY) << line << std::endl;
+      ::snprintf(line, sizeof(line), "  per image  %12.0f %14.0f       %13.1f %14.1f %12.1f",
+                 (double) c[TF_PERF_CYCLES] / images, (double) c[TF_PERF_INSTRUCTIONS] / images,
+                 (double) c[TF_PERF_CACHE_MISSES] / images, (double) c[TF_PERF_BRANCH_MISSES] / images,
+                 (double) c[TF_PERF_PAGE_FAULTS] / images);
+      g_log.out(TF_LOG_SUMMARY) << line << std::endl;
+   }
+
+   for (int event = 0; event < TF_PERF_EVENT_COUNT; ++event) {
+      if (!g_perf.has((TFPerfEvent) event)) {
+         g_log.out(TF_LOG_SUMMARY) << "Not supported here: " << TFPerfCounters::name((TFPerfEvent) event) << std::endl;
+      }
+   }
+}
+
+/// A Lightroom image, as listed for the stages that look at all images at once.
+typedef struct
+{
+   ::sqlite3_int64 id;
+   std::string fileName;
+   std::string orientation;
+   ::sqlite3_int64 imageDate;
+   std::string copyName;
+} lightroomimage;
+
+/**
+ * Lists all images of the Lightroom catalog.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param images        Receives the images, ordered by their ID.
+ * @return @c true on succes, @c false on any error.
+ */
+bool readLightroomImages(::sqlite3 *lightroomDB, std::vector<lightroomimage> &images)
+{
+   TFSql sql(lightroomDB,
+             "SELECT F.originalFilename, I.id_local, I.orientation, F.externalModTime, I.copyName "
+             "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
+             "WHERE F.id_local = I.rootFile "
+             "AND O.id_local = F.folder "
+             "AND R.id_local = O.rootFolder "
+             "ORDER BY I.id_local");
+   while (sql.step()) {
+      lightroomimage image;
+      image.fileName = sql.column_str(0);
+      image.id = sql.column_int64(1);
+      image.orientation = sql.column_str(2);
+      image.imageDate = sql.column_int64(3);
+      image.copyName = sql.column_str(4);
+      images.push_back(image);
+   }
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read image: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+   return true;
+}
+
+/// A Lightroom image with the Aperture version it was matched to.
+typedef struct
+{
+   ::sqlite3_int64 image;
+   ::sqlite3_int64 version;
+} imageversion;
+
+/**
+ * Matches Lightroom images to their Aperture versions as for the keywords:
+ * the master by file name and date, then the version by the copy name.
+ *
+ * The rules are those of findImageUUIDForFilename() and
+ * findVersionIDForMaster(), but RKMaster and RKVersion are each read once
+ * into maps instead of being queried per image:
+ * - Of the masters with the file name and date of the image, one that is
+ *   not missing is taken.
+ * - Without such a master, the master with the date of the image is taken
+ *   if it is the only one with that date.
+ * - A copy name "VERSION-n" selects the version n - 1 or the highest one
+ *   below it, otherwise the highest version is taken.
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param images        The images of the Lightroom catalog.
+ * @param matches       Receives the images found, in the order of images.
+ * @return @c true on succes, @c false on any error.
+ */
+bool matchImageVersions(::sqlite3 *apertureDB,
+                        const std::vector<lightroomimage> &images,
+                        std::vector<imageversion> &matches)
+{
+   struct master
+   {
+      std::string uuid;
+      ::sqlite3_int64 isMissing;
+   };
+   // By file name and date; the file name cannot contain a '/'.
+   std::unordered_map<std::string, master> mastersByName;
+   // By date, with the number of masters of that date.
+   std::unordered_map<::sqlite3_int64, std::pair<std::string, int>> mastersByDate;
+   // The versions of a master: version number and model ID.
+   std::unordered_map<std::string, std::vector<std::pair<::sqlite3_int64, ::sqlite3_int64>>> versionsOfMaster;
+
+   TFSql sql(apertureDB,
+             "SELECT uuid, fileName, fileModificationDate, isMissing "
+             "FROM RKMaster");
+   while (sql.step()) {
+      std::string uuid = sql.column_str(0);
+      ::sqlite3_int64 date = sql.column_int64(2);
+      ::sqlite3_int64 isMissing = sql.column_int64(3);
+
+      master &byName = mastersByName[sql.column_str(1) + "/" + std::to_string(date)];
+      if (byName.uuid == "" || isMissing < byName.isMissing) {
+         byName.uuid = uuid;
+         byName.isMissing = isMissing;
+      }
+
+      std::pair<std::string, int> &byDate = mastersByDate[date];
+      byDate.first = uuid;
+      byDate.second++;
+   }
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read masters: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   sql.reset("SELECT masterUuid, versionNumber, modelId "
+             "FROM RKVersion");
+   while (sql.step()) {
+      versionsOfMaster[sql.column_str(0)].push_back(std::make_pair(sql.column_int64(1), sql.column_int64(2)));
+   }
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read versions: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   matches.reserve(images.size());
+   for (const lightroomimage &image : images) {
+      std::string masterUUID;
+      auto byName = mastersByName.find(image.fileName + "/" + std::to_string(image.imageDate));
+      if (byName != mastersByName.end()) {
+         masterUUID = byName->second.uuid;
+      } else {
+         g_metrics.increment(TF_FALLBACK_MATCHES);
+         auto byDate = mastersByDate.find(image.imageDate);
+         if (byDate != mastersByDate.end() && byDate->second.second == 1) {
+            masterUUID = byDate->second.first;
+         } else {
+            g_log.err() << "Error: Did not find a unique UUID for file " << image.fileName << ", " << image.imageDate << std::endl;
+            continue;
+         }
+      }
+
+      ::sqlite3_int64 copyNr = INT64_MAX;
+      if (image.copyName.find("VERSION-") == 0) {
+         copyNr = ::atoi(image.copyName.substr(8).c_str());
+         if (copyNr > 0) {
+            copyNr--;
+         }
+      }
+
+      ::sqlite3_int64 versionNumber = -1;
+      ::sqlite3_int64 versionID = -1;
+      for (const std::pair<::sqlite3_int64, ::sqlite3_int64> &version : versionsOfMaster[masterUUID]) {
+         if (version.first <= copyNr && (versionID < 0 || version.first > versionNumber)) {
+            versionNumber = version.first;
+            versionID = version.second;
+         }
+      }
+      if (versionID >= 0) {
+         matches.push_back(imageversion{image.id, versionID});
+      } else {
+         g_log.err() << "Failed to find version ID from master UUID " << masterUUID << ", copy " << image.copyName << std::endl;
+      }
+   }
+   return true;
+}
+
+/// An album of Aperture with the Lightroom images of its versions.
+typedef struct
+{
+   std::string name;
+   std::vector<::sqlite3_int64> images;   ///< In the order of the album.
+} aperturealbum;
+
+/**
+ * Finds the albums of Aperture and the Lightroom images in them.
+ *
+ * Each Lightroom image is matched to its Aperture version with
+ * matchImageVersions(). The albums and their versions are then read in one
+ * scan, ordered by album, and the versions are mapped to the images in memory. Nothing is
+ * looked up per album or per version, albums can hold 100k versions.
+ *
+ * Only the albums made by the user (album type 1, subclass 3) are taken,
+ * not the built-in ones nor smart albums. Albums without any image of the
+ * catalog are left out.
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param images        The images of the Lightroom catalog.
+ * @param albums        Receives the albums, ordered by their ID in Aperture.
+ * @return @c true on succes, @c false on any error.
+ */
+bool findAlbumImages(::sqlite3 *apertureDB,
+                     const std::vector<lightroomimage> &images,
+                     std::vector<aperturealbum> &albums)
+{
+   std::vector<imageversion> matches;
+   if (!matchImageVersions(apertureDB, images, matches)) {
+      return false;
+   }
+
+   // Several Lightroom images may be copies of one version.
+   std::unordered_multimap<::sqlite3_int64, ::sqlite3_int64> imagesOfVersion;
+   imagesOfVersion.reserve(matches.size());
+   for (const imageversion &match : matches) {
+      imagesOfVersion.insert(std::pair<::sqlite3_int64, ::sqlite3_int64>(match.version, match.image));
+   }
+
+   TFSql sql(apertureDB,
+             "SELECT A.modelId, A.name, AV.versionId "
+             "FROM RKAlbum A, RKAlbumVersion AV "
+             "WHERE AV.albumId = A.modelId "
+             "AND A.albumType = 1 "
+             "AND A.albumSubclass = 3 "
+             "ORDER BY A.modelId, AV.modelId");
+   ::sqlite3_int64 albumID = -1;
+   while (sql.step()) {
+      if (albums.empty() || sql.column_int64(0) != albumID) {
+         if (!albums.empty() && albums.back().images.empty()) {
+            albums.pop_back();
+         }
+         albumID = sql.column_int64(0);
+         albums.push_back(aperturealbum());
+         albums.back().name = normalizeUTF8(sql.column_str(1));
+      }
+      auto range = imagesOfVersion.equal_range(sql.column_int64(2));
+      for (auto iter = range.first; iter != range.second; ++iter) {
+         albums.back().images.push_back(iter->second);
+      }
+   }
+   if (!albums.empty() && albums.back().images.empty()) {
+      albums.pop_back();
+   }
+
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read Aperture albums: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   return true;
+}
+
+/**
+ * Recreates the albums of Aperture as collections, in the collection set
+ * g_albumsCollectionSet.
+ *
+ * Collections left in the set by an earlier run are removed first. The IDs of
+ * all rows are reserved at once, the collections and their images are then
+ * inserted with insertRows().
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param albums        The albums, see findAlbumImages().
+ * @return @c true on succes, @c false on any error.
+ */
+bool createCollections(::sqlite3 *lightroomDB, const std::vector<aperturealbum> &albums)
+{
+   ::sqlite3_int64 setID = -1;
+   std::string setGenealogy;
+
+   TFSql sql(lightroomDB,
+             "SELECT id_local, genealogy "
+             "FROM AgLibraryCollection "
+             "WHERE name = ? "
+             "AND parent IS NULL "
+             "AND creationId = 'com.adobe.ag.library.group'");
+   sql.bind(1, g_albumsCollectionSet);
+   if (sql.step()) {
+      setID = sql.column_int64(0);
+      setGenealogy = sql.column_str(1);
+
+      TFSql images(lightroomDB,
+                   "DELETE FROM AgLibraryCollectionImage "
+                   "WHERE collection IN (SELECT id_local FROM AgLibraryCollection WHERE parent = ?)");
+      images.bind(1, setID);
+      images.step();
+      TFSql collections(lightroomDB,
+                        "DELETE FROM AgLibraryCollection "
+                        "WHERE parent = ?");
+      collections.bind(1, setID);
+      collections.step();
+      if (images.hasFailed() || collections.hasFailed()) {
+         g_log.err() << "Failed to remove collections of an earlier run: " << images.getErrorMsg() << collections.getErrorMsg() << std::endl;
+         return false;
+      }
+   } else if (sql.hasFailed()) {
+      g_log.err() << "Failed to find the collection set of the albums: " << sql.getErrorMsg() << std::endl;
+      return false;
+   } else {
+      setID = getNextLocalID(lightroomDB);
+      if (setID < 0) {
+         return false;
+      }
+      setGenealogy = childGenealogy("", setID);
+      sql.reset("INSERT INTO AgLibraryCollection(id_local, creationId, genealogy, imageCount, name, parent, systemOnly) "
+                "VALUES(?, 'com.adobe.ag.library.group', ?, NULL, ?, NULL, 0)");
+      sql.bind(1, setID);
+      sql.bind(2, setGenealogy);
+      sql.bind(3, g_albumsCollectionSet);
+      sql.step();
+      if (sql.hasFailed()) {
+         g_log.err() << "Failed to create the collection set of the albums: " << sql.getErrorMsg() << std::endl;
+         return false;
+      }
+   }
+
+   // Where the images of each album start in the list of all of them.
+   std::vector<size_t> firstImage(albums.size() + 1, 0);
+   for (size_t n = 0; n < albums.size(); ++n) {
+      firstImage[n + 1] = firstImage[n] + albums[n].images.size();
+   }
+   size_t imageCount = firstImage.back();
+   if (albums.empty()) {
+      return true;
+   }
+
+   // Collections first, then the images, all IDs in one block.
+   ::sqlite3_int64 first = reserveLocalIDs(lightroomDB, albums.size() + imageCount);
+   if (first < 0) {
+      return false;
+   }
+
+   bool inserted = insertRows(lightroomDB,
+      "INSERT INTO AgLibraryCollection(id_local, creationId, genealogy, imageCount, name, parent, systemOnly)",
+      "(?, 'com.adobe.ag.library.collection', ?, ?, ?, ?, 0)",
+      5, albums.size(),
+      [&](TFSql &sql, int index, size_t row) {
+         sql.bind(index, first + (::sqlite3_int64) row);
+         sql.bind(index + 1, childGenealogy(setGenealogy, first + row));
+         sql.bind(index + 2, (::sqlite3_int64) albums[row].images.size());
+         sql.bind(index + 3, albums[row].name);
+         sql.bind(index + 4, setID);
+      });
+   if (!inserted) {
+      g_log.err() << "Failed to insert collections" << std::endl;
+      return false;
+   }
+
+   // The album of each image, advanced as the rows are bound in order.
+   size_t album = 0;
+   inserted = insertRows(lightroomDB,
+      "INSERT INTO AgLibraryCollectionImage(id_local, collection, image, pick)",
+      "(?, ?, ?, 0)",
+      3, imageCount,
+      [&](TFSql &sql, int index, size_t row) {
+         while (row >= firstImage[album + 1]) {
+            album++;
+         }
+         sql.bind(index, first + (::sqlite3_int64) (albums.size() + row));
+         sql.bind(index + 1, first + (::sqlite3_int64) album);
+         sql.bind(index + 2, albums[album].images[row - firstImage[album]]);
+      });
+   if (!inserted) {
+      g_log.err() << "Failed to insert collection images" << std::endl;
+      return false;
+   }
+
+   g_metrics.increment(TF_COLLECTIONS_CREATED, albums.size());
+   g_metrics.increment(TF_COLLECTION_IMAGES, imageCount);
+   for (const aperturealbum &created : albums) {
+      g_log.out(TF_LOG_DETAIL) << "Created collection `" << created.name << "' with " << created.images.size() << " images" << std::endl;
+   }
+
+   return true;
+}
+
+/// The rating, flag and color label of a Lightroom image, as in Aperture.
+typedef struct
+{
+   ::sqlite3_int64 image;
+   int rating;                ///< 1 to 5 stars, 0: none.
+   int pick;                  ///< 1: flagged, -1: rejected, 0: neither.
+   const char *colorLabel;    ///< The label, "": none.
+} imagerating;
+
+/**
+ * Finds the ratings, flags and color labels of the Lightroom images in
+ * Aperture.
+ *
+ * The images are matched with matchImageVersions(). The versions of Aperture
+ * are then read in one scan by their ID and merged with the matches sorted
+ * the same way.
+ *
+ * Aperture's rejected images (rating -1) become rejected in Lightroom, its
+ * flag becomes the pick flag. Lightroom has no orange and gray labels, they
+ * are kept as custom labels of that name.
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param images        The images of the Lightroom catalog.
+ * @param ratings       Receives the ratings, ordered by version.
+ * @return @c true on succes, @c false on any error.
+ */
+bool findImageRatings(::sqlite3 *apertureDB,
+                      const std::vector<lightroomimage> &images,
+                      std::vector<imagerating> &ratings)
+{
+   static const char *labels[] = {
+      "", "Red", "Orange", "Yellow", "Green", "Blue", "Purple", "Gray"
+   };
+
+   std::vector<imageversion> matches;
+   if (!matchImageVersions(apertureDB, images, matches)) {
+      return false;
+   }
+   std::stable_sort(matches.begin(), matches.end(), [](const imageversion &a, const imageversion &b) {
+      return a.version < b.version;
+   });
+
+   TFSql sql(apertureDB,
+             "SELECT modelId, mainRating, isFlagged, colorLabelIndex "
+             "FROM RKVersion "
+             "ORDER BY modelId");
+   size_t next = 0;
+   while (next < matches.size() && sql.step()) {
+      ::sqlite3_int64 version = sql.column_int64(0);
+      while (next < matches.size() && matches[next].version < version) {
+         next++;
+      }
+      for (; next < matches.size() && matches[next].version == version; ++next) {
+         imagerating rating;
+         rating.image = matches[next].image;
+         ::sqlite3_int64 stars = sql.column_int64(1);
+         rating.rating = (stars > 0 && stars <= 5) ? (int) stars : 0;
+         rating.pick = stars < 0 ? -1 : (sql.column_int64(2) ? 1 : 0);
+         ::sqlite3_int64 label = sql.column_int64(3);
+         rating.colorLabel = (label > 0 && label < 8) ? labels[label] : "";
+         ratings.push_back(rating);
+      }
+   }
+
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to read ratings of Aperture versions: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+
+   return true;
+}
+
+/**
+ * Writes the ratings, flags and color labels to the images of the catalog.
+ *
+ * The values are staged in a temporary table, then one UPDATE ... FROM joins
+ * it with Adobe_images and writes only the images whose values differ.
+ * SQLite before 3.33 has no UPDATE ... FROM, there correlated subqueries do
+ * the same, a little slower.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param ratings       The ratings, see findImageRatings().
+ * @return @c true on succes, @c false on any error.
+ */
+bool writeImageRatings(::sqlite3 *lightroomDB, const std::vector<imagerating> &ratings)
+{
+   if (!executeStatement(lightroomDB, "DROP TABLE IF EXISTS temp.tf_ratings") ||
+       !executeStatement(lightroomDB,
+                         "CREATE TEMP TABLE tf_ratings("
+                         "image INTEGER PRIMARY KEY, rating INTEGER, pick INTEGER, colorLabels TEXT)")) {
+      return false;
+   }
+
+   bool inserted = insertRows(lightroomDB,
+      "INSERT OR REPLACE INTO temp.tf_ratings(image, rating, pick, colorLabels)",
+      "(?, ?, ?, ?)",
+      4, ratings.size(),
+      [&](TFSql &sql, int index, size_t row) {
+         const imagerating &rating = ratings[row];
+         sql.bind(index, rating.image);
+         if (rating.rating > 0) {
+            sql.bind(index + 1, (::sqlite3_int64) rating.rating);
+         } else {
+            sql.bind(index + 1);
+         }
+         sql.bind(index + 2, (::sqlite3_int64) rating.pick);
+         sql.bind(index + 3, rating.colorLabel, -1);
+      });
+   if (!inserted) {
+      g_log.err() << "Failed to stage ratings" << std::endl;
+      return false;
+   }
+
+   TFSql sql(lightroomDB,
+             ::sqlite3_libversion_number() >= 3033000 ?
+             "UPDATE Adobe_images "
+             "SET rating = R.rating, pick = R.pick, colorLabels = R.colorLabels "
+             "FROM temp.tf_ratings R "
+             "WHERE Adobe_images.id_local = R.image "
+             "AND (Adobe_images.rating IS NOT R.rating "
+             "     OR Adobe_images.pick IS NOT R.pick "
+             "     OR Adobe_images.colorLabels IS NOT R.colorLabels)" :
+             "UPDATE Adobe_images "
+             "SET rating = (SELECT R.rating FROM temp.tf_ratings R WHERE R.image = Adobe_images.id_local), "
+             "    pick = (SELECT R.pick FROM temp.tf_ratings R WHERE R.image = Adobe_images.id_local), "
+             "    colorLabels = (SELECT R.colorLabels FROM temp.tf_ratings R WHERE R.image = Adobe_images.id_local) "
+             "WHERE EXISTS (SELECT 1 FROM temp.tf_ratings R "
+             "              WHERE R.image = Adobe_images.id_local "
+             "              AND (Adobe_images.rating IS NOT R.rating "
+             "                   OR Adobe_images.pick IS NOT R.pick "
+             "                   OR Adobe_images.colorLabels IS NOT R.colorLabels))");
+   sql.step();
+   if (sql.hasFailed()) {
+      g_log.err() << "Failed to update ratings: " << sql.getErrorMsg() << std::endl;
+      return false;
+   }
+   g_metrics.increment(TF_RATINGS_UPDATED, ::sqlite3_changes(lightroomDB));
+
+   return executeStatement(lightroomDB, "DROP TABLE temp.tf_ratings");
+}
+
+/**
+ * Runs the selected stages one after the other: faces, keywords, stacks and
+ * GPS locations image by image, then stacks, keywords and cooccurrences.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @param state         Receives the collected data and statistics.
+ * @return @c true on succes, @c false on any error.
+ */
+bool transferStagesInOrder(::sqlite3 *lightroomDB,
+                           ::sqlite3 *apertureDB,
+                           ::sqlite3 *facesDB,
+                           transferstate &state)
+{
+   if (g_stages & (STAGE_FACES | STAGE_KEYWORDS | STAGE_STACKS | STAGE_GPS)) {
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Transfering face information" << std::endl << std::endl;
+      enterStage("images");
+      if (g_shards > 1) {
+         if (!transferImagesSharded(lightroomDB, apertureDB, facesDB, g_shards, state)) {
+            return false;
+         }
+      } else if (g_imageThreads > 0) {
+         if (!transferImagesStealing(lightroomDB, apertureDB, facesDB, state)) {
+            return false;
+         }
+      } else if (!transferImages(lightroomDB, apertureDB, facesDB, 0, INT64_MAX, state)) {
+         return false;
+      }
+   }
+
+   if (stageSelected(STAGE_STACKS)) {
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Creating Stacks" << std::endl << std::endl;
+      enterStage("stacks");
+
+      if (!createStacks(lightroomDB, state.stackedImages)) {
+         g_log.err() << "Failed to create image stacks" << std::endl;
+         return false;
+      }
+   }
+
+   if (stageSelected(STAGE_KEYWORDS)) {
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Recreating keywords" << std::endl << std::endl;
+      enterStage("keywords");
+
+      if (g_keywordTree && !loadApertureKeywords(apertureDB, state.keywordTree)) {
+         return false;
+      }
+      if (!recreateKeywords(lightroomDB, state.keywordsByImage, state.keywordTree)) {
+         g_log.err() << "Failed to recreate keywords." << std::endl;
+         return false;
+      }
+
+      enterStage("utf8");
+      if (!fixKeywordsUTF8(lightroomDB)) {
+         g_log.err() << "Failed to fix keyword UTF-8 encoding to be composed" << std::endl;
+         return false;
+      }
+   }
+
+   if (stageSelected(STAGE_ALBUMS)) {
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Creating collections from albums" << std::endl << std::endl;
+      enterStage("albums");
+
+      std::vector<lightroomimage> images;
+      std::vector<aperturealbum> albums;
+      if (!readLightroomImages(lightroomDB, images) ||
+          !findAlbumImages(apertureDB, images, albums) ||
+          !createCollections(lightroomDB, albums)) {
+         g_log.err() << "Failed to create collections from albums" << std::endl;
+         return false;
+      }
+   }
+
+   if (stageSelected(STAGE_RATINGS)) {
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Transfering ratings, flags and color labels" << std::endl << std::endl;
+      enterStage("ratings");
+
+      std::vector<lightroomimage> images;
+      std::vector<imagerating> ratings;
+      if (!readLightroomImages(lightroomDB, images) ||
+          !findImageRatings(apertureDB, images, ratings) ||
+          !writeImageRatings(lightroomDB, ratings)) {
+         g_log.err() << "Failed to transfer ratings" << std::endl;
+         return false;
+      }
+   }
+
+   if (stageSelected(STAGE_COOCCURRENCE)) {
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Cleaning up keyword coocurrences" << std::endl << std::endl;
+      enterStage("cooccurrence");
+
+      if (!rebuildKeywordCoocurrences(lightroomDB)) {
+         g_log.err() << "Failed to fix keyword coocurrences" << std::endl;
+         return false;
+      }
+   }
+
+   return true;
+}
+
+/// The faces Aperture has for one image.
+typedef struct
+{
+   // Index into the list of images
+   size_t image;
+   facelist faces;
+} imagefaces;
+
+/// The GPS location Aperture has for one image.
+typedef struct
+{
+   ::sqlite3_int64 image;
+   double latitude;
+   double longitude;
+} imagelocation;
+
+/**
+ * Runs the selected stages with the stage graph: Each stage looks up what
+ * it writes for all images on a worker thread of its own, with its own
+ * connections to Aperture. The writes are done on this thread, one stage
+ * after the other as their lookups finish. Keywords are written after the
+ * faces (both count keyword popularity) and cooccurrences last.
+ *
+ * @param lightroomDB   The handle of the lightroom database.
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @param state         Receives the collected data and statistics.
+ * @return @c true on succes, @c false on any error.
+ */
+bool transferStagesConcurrently(::sqlite3 *lightroomDB,
+                                ::sqlite3 *apertureDB,
+                                ::sqlite3 *facesDB,
+                                transferstate &state)
+{
+   std::vector<lightroomimage> images;
+   if (!readLightroomImages(lightroomDB, images)) {
+      return false;
+   }
+
+   // The first stage that looks at each image counts the images.
+   transferstage counting = STAGE_FACES;
+   while (counting < STAGE_RATINGS && (counting == STAGE_COOCCURRENCE || !stageSelected(counting))) {
+      counting = (transferstage) (counting << 1);
+   }
+
+   TFArena faceArena;
+   std::deque<imagefaces> facesByImage;
+   std::vector<imagelocation> locations;
+   std::vector<aperturealbum> albums;
+   std::vector<imagerating> ratings;
+
+   TFStageGraph graph;
+   std::vector<size_t> keywordWriters;
+
+   if (stageSelected(STAGE_FACES)) {
+      keywordWriters.push_back(graph.add("faces", std::vector<size_t>(),
+         [&]() {
+            stagedbs dbs(apertureDB, facesDB);
+            for (size_t n = 0; n < images.size(); ++n) {
+               if (counting == STAGE_FACES) {
+                  g_metrics.increment(TF_IMAGES_SCANNED);
+               }
+               facelist faces(faceArena);
+               findFacesForImage(faces, dbs.apertureDB, dbs.facesDB, images[n].fileName, images[n].imageDate);
+               if (faces.size()) {
+                  facesByImage.push_back(imagefaces{n, std::move(faces)});
+               } else {
+                  g_metrics.increment(TF_IMAGES_WITHOUT_FACES);
+               }
+            }
+            return true;
+         },
+         [&]() {
+            for (imagefaces &found : facesByImage) {
+               const lightroomimage &image = images[found.image];
+               if (!writeFacesOfImage(lightroomDB, found.faces, image.id, image.fileName, image.orientation, state)) {
+                  return false;
+               }
+            }
+            return true;
+         }));
+   }
+
+   if (stageSelected(STAGE_GPS)) {
+      graph.add("gps", std::vector<size_t>(),
+         [&]() {
+            stagedbs dbs(apertureDB, facesDB);
+            for (const lightroomimage &image : images) {
+               if (counting == STAGE_GPS) {
+                  g_metrics.increment(TF_IMAGES_SCANNED);
+               }
+               std::string masterUUID = findImageUUIDForFilename(dbs.apertureDB, image.fileName, image.imageDate);
+               if (masterUUID == "") {
+                  g_log.err() << "Didn't find master UUID for " << image.fileName << std::endl;
+                  continue;
+               }
+               imagelocation location;
+               location.image = image.id;
+               bool failed = false;
+               if (findGPSOfVersion(dbs.apertureDB, masterUUID, image.copyName, location.latitude, location.longitude, failed)) {
+                  locations.push_back(location);
+               }
+               if (failed) {
+                  g_log.err() << "Failed to get GPS location for version " << image.fileName << ", " << image.copyName << std::endl;
+               }
+            }
+            return true;
+         },
+         [&]() {
+            for (const imagelocation &location : locations) {
+               if (!writeGPS(lightroomDB, location.image, location.latitude, location.longitude)) {
+                  g_log.err() << "Failed to transfer GPS location for image " << location.image << std::endl;
+               }
+            }
+            return true;
+         });
+   }
+
+   if (stageSelected(STAGE_STACKS)) {
+      graph.add("stacks", std::vector<size_t>(),
+         [&]() {
+            stagedbs dbs(apertureDB, facesDB);
+            for (const lightroomimage &image : images) {
+               if (counting == STAGE_STACKS) {
+                  g_metrics.increment(TF_IMAGES_SCANNED);
+               }
+               TFUuidKey apertureStackId = findApertureStackIdOfVersion(dbs.apertureDB, image.fileName, image.imageDate, image.copyName);
+               if (!apertureStackId.isNull()) {
+                  state.stackedImages.push_back(stackimage{apertureStackId, image.id});
+               }
+            }
+            return true;
+         },
+         [&]() {
+            if (!createStacks(lightroomDB, state.stackedImages)) {
+               g_log.err() << "Failed to create image stacks" << std::endl;
+               return false;
+            }
+            return true;
+         });
+   }
+
+   if (stageSelected(STAGE_KEYWORDS)) {
+      keywordWriters.push_back(graph.add("keywords", keywordWriters,
+         [&]() {
+            stagedbs dbs(apertureDB, facesDB);
+            for (const lightroomimage &image : images) {
+               if (counting == STAGE_KEYWORDS) {
+                  g_metrics.increment(TF_IMAGES_SCANNED);
+               }
+               std::deque<TFString> &keywords = state.keywordsByImage[image.id];
+               if (!findKeywordsForVersion(keywords, dbs.apertureDB, image.fileName, image.imageDate, image.copyName)) {
+                  g_log.err() << "Failed to get keywords for version" << std::endl;
+               }
+            }
+            return !g_keywordTree || loadApertureKeywords(dbs.apertureDB, state.keywordTree);
+         },
+         [&]() {
+            if (!recreateKeywords(lightroomDB, state.keywordsByImage, state.keywordTree)) {
+               g_log.err() << "Failed to recreate keywords." << std::endl;
+               return false;
+            }
+            if (!fixKeywordsUTF8(lightroomDB)) {
+               g_log.err() << "Failed to fix keyword UTF-8 encoding to be composed" << std::endl;
+               return false;
+            }
+            return true;
+         }));
+   }
+
+   if (stageSelected(STAGE_ALBUMS)) {
+      graph.add("albums", std::vector<size_t>(),
+         [&]() {
+            stagedbs dbs(apertureDB, facesDB);
+            if (counting == STAGE_ALBUMS) {
+               g_metrics.increment(TF_IMAGES_SCANNED, images.size());
+            }
+            return findAlbumImages(dbs.apertureDB, images, albums);
+         },
+         [&]() {
+            if (!createCollections(lightroomDB, albums)) {
+               g_log.err() << "Failed to create collections from albums" << std::endl;
+               return false;
+            }
+            return true;
+         });
+   }
+
+   if (stageSelected(STAGE_RATINGS)) {
+      graph.add("ratings", std::vector<size_t>(),
+         [&]() {
+            stagedbs dbs(apertureDB, facesDB);
+            if (counting == STAGE_RATINGS) {
+               g_metrics.increment(TF_IMAGES_SCANNED, images.size());
+            }
+            return findImageRatings(dbs.apertureDB, images, ratings);
+         },
+         [&]() {
+            if (!writeImageRatings(lightroomDB, ratings)) {
+               g_log.err() << "Failed to transfer ratings" << std::endl;
+               return false;
+            }
+            return true;
+         });
+   }
+
+   if (stageSelected(STAGE_COOCCURRENCE)) {
+      graph.add("cooccurrence", keywordWriters,
+         TFStageGraph::stepfunction(),
+         [&]() {
+            if (!rebuildKeywordCoocurrences(lightroomDB)) {
+               g_log.err() << "Failed to fix keyword coocurrences" << std::endl;
+               return false;
+            }
+            return true;
+         });
+   }
+
+   g_log.out(TF_LOG_SUMMARY) << "Looking up " << images.size() << " images in " << g_stageThreads << " threads" << std::endl;
+   return graph.run(g_stageThreads, [](const std::string &name) {
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Writing " << name << std::endl << std::endl;
+      enterStage(name);
+   });
+}
+
+/**
+ * Transfers everything from the Aperture databases into the Lightroom catalog
+ * configured by the run options.
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @return The exit status: 0 on success, 1 on any error.
+ */
+int transferIntoCatalog(::sqlite3 *apertureDB, ::sqlite3 *facesDB)
+{
+   int result = 1;
+   ::sqlite3 *lightroomDB = NULL;
+
+   resetKeywordRootCache();
+   resetLatencies();
+   g_metrics.reset();
+   if (g_metricsFile != "") {
+      g_metrics.startWriter(g_metricsFile, g_metricsInterval);
+   }
+   g_allocations.reset();
+   g_allocations.enable(g_allocationProfile);
+   TFIoVfs::resetStats();
+   if (g_uuidSeeded) {
+      g_uuids.seed(g_uuidSeed);
+   } else {
+      // A job before this one may have seeded the generator.
+      g_uuids.randomize();
+   }
+   if (g_perfCounters) {
+      std::string error;
+      if (!g_perf.open(error)) {
+         g_log.err() << "Warning: No hardware counters, " << error << "." << std::endl;
+      }
+   }
+
+   g_log.out(TF_LOG_SUMMARY) << "              Lightroom Catalog: " << g_lightroomDBFile << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << "Parent folder for face keywords: " << g_keywordsRoot << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << " Parent folder for tag keywords: " << g_tagKeywordsRoot << std::endl;
+
+   if (SQLITE_OK != ::sqlite3_open_v2(g_lightroomDBFile.c_str(), &lightroomDB, SQLITE_OPEN_READWRITE, NULL)) {
+      g_log.err() << "Can't open lightroom database: " << ::sqlite3_errmsg(lightroomDB) << std::endl;
+      goto fail;
+   }
+   if (g_shards > 1 && !copyCatalogForShards(lightroomDB, g_shards)) {
+      goto fail;
+   }
+   sqlite3_exec(lightroomDB, "BEGIN", 0, 0, 0);
+   startProgress(lightroomDB);
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Preparing database" << std::endl << std::endl;
+   enterStage("prepare");
+
+   if (stageSelected(STAGE_KEYWORDS)) {
+      g_log.out(TF_LOG_SUMMARY) << "Removing keywords" << std::endl;
+      if (!removeAllKeywords(lightroomDB)) {
+         g_log.err() << "Failed to remove all keywords from lightroom" << std::endl;
+         goto fail;
+      }
+
+      g_log.out(TF_LOG_SUMMARY) << "Recreating keyword roots" << std::endl;
+      if (!recreateRootKeyword(lightroomDB, g_keywordsRoot, g_tagKeywordsRoot)) {
+         g_log.err() << "Failed to create keywords roots" << std::endl;
+         goto fail;
+      }
+   } else if (stageSelected(STAGE_FACES) && getRootKeywordId(lightroomDB) < 0) {
+      // The keywords are kept, people go under the root of an earlier run.
+      g_log.err() << "No keyword " << g_keywordsRoot << " to put people into, run the keywords stage, too" << std::endl;
+      goto fail;
+   }
+
+   if (stageSelected(STAGE_STACKS)) {
+      g_log.out(TF_LOG_SUMMARY) << "Removing stacks" << std::endl;
+      if (!removeAllStacks(lightroomDB)) {
+         g_log.err() << "Failed to remove all keywords from lightroom" << std::endl;
+         goto fail;
+      }
+   }
+
+   {
+      transferstate state;
+
+      if (g_stageThreads > 0) {
+         if (!transferStagesConcurrently(lightroomDB, apertureDB, facesDB, state)) {
+            goto fail;
+         }
+      } else if (!transferStagesInOrder(lightroomDB, apertureDB, facesDB, state)) {
+         goto fail;
+      }
+
+      enterStage("commit");
+      g_log.out(TF_LOG_SUMMARY) << std::endl << "### Statistics" << std::endl << std::endl;
+      g_log.out(TF_LOG_SUMMARY) << "Analysed " << g_metrics.value(TF_IMAGES_SCANNED) << " images, " << g_metrics.value(TF_IMAGES_WITHOUT_FACES) << " did not have any face information." << std::endl;
+      g_log.out(TF_LOG_SUMMARY) << "Inserted " << g_metrics.value(TF_FACES_INSERTED) << " faces from " << state.insertedPeople.size() << " people: ";
+      g_log.out(TF_LOG_SUMMARY) << "[Unknown faces] (" << g_metrics.value(TF_UNKNOWN_FACES) << ")";
+      for (std::pair<TFString, int> p : state.insertedPeople) {
+         g_log.out(TF_LOG_SUMMARY) << ", " << p.first << " (" << p.second << ")";
+      }
+      g_log.out(TF_LOG_SUMMARY) << std::endl;
+      if (g_slowestCount > 0) {
+         printLatencies();
+         g_log.out(TF_LOG_SUMMARY) << std::endl;
+      }
+      g_log.out(TF_LOG_SUMMARY) << "Created " << g_metrics.value(TF_KEYWORDS_CREATED) << " keywords, " << g_metrics.value(TF_LINKS_INSERTED) << " keyword assignments, " << g_metrics.value(TF_STACKS_CREATED) << " stacks and " << g_metrics.value(TF_GPS_REWRITES) << " GPS locations." << std::endl;
+      if (stageSelected(STAGE_ALBUMS)) {
+         g_log.out(TF_LOG_SUMMARY) << "Created " << g_metrics.value(TF_COLLECTIONS_CREATED) << " collections from albums with " << g_metrics.value(TF_COLLECTION_IMAGES) << " images." << std::endl;
+      }
+      if (stageSelected(STAGE_RATINGS)) {
+         g_log.out(TF_LOG_SUMMARY) << "Updated the rating, flag or color label of " << g_metrics.value(TF_RATINGS_UPDATED) << " images." << std::endl;
+      }
+   }
+
+   if (stringPoolExhausted()) {
+      goto fail;
+   }
+   sqlite3_exec(lightroomDB, "COMMIT", 0, 0, 0);
+   result = 0;
+
+   enterStage("");
+   stopProgress();
+   if (g_perf.isOpen()) {
+      printPerfCounters();
+   }
+   if (g_allocations.isEnabled()) {
+      printAllocations();
+   }
+   if (g_ioStats) {
+      printIoStats();
+   }
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Done" << std::endl << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << "Looks good." << std::endl;
+fail:
+   if (g_shards > 1) {
+      removeShardFiles(g_shards);
+   }
+   ::sqlite3_close(lightroomDB);
+   enterStage("");
+   stopProgress();
+   g_metrics.stopWriter();
+   g_perf.close();
+   g_allocations.enable(false);
+
+   return result;
+}
+
+/**
+ * Counts the rows of a table of the Lightroom catalog.
+ *
+ * @param lightroomDB   The handle of the Lightroom database.
+ * @param table         The name of the table.
+ * @return The number of rows, 0 on errors.
+ */
+::sqlite3_int64 countRows(::sqlite3 *lightroomDB, const std::string &table)
+{
+   TFSql sql(lightroomDB, "SELECT count(*) FROM " + table);
+   if (!sql.step()) {
+      return 0;
+   }
+   return sql.column_int64(0);
+}
+
+/**
+ * Dry run: Finds out what a transfer into the catalog would do, with the
+ * same lookups as transferImages(), and prints the predicted time, row writes
+ * and journal size. The catalog is opened read-only.
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @return The exit status.
+ */
+int estimateTransfer(::sqlite3 *apertureDB, ::sqlite3 *facesDB)
+{
+   ::sqlite3 *lightroomDB = NULL;
+   TFEstimate estimate;
+   tfestimatecounts &counts = estimate.counts;
+   std::unordered_set<TFString> people;
+   std::unordered_set<TFString> tags;
+   std::unordered_set<TFUuidKey> stacks;
+   // The keyword pairs, both handles in one value, the lower one first.
+   std::unordered_set<uint64_t> keywordPairs;
+   ::sqlite3_int64 pageSize = 0;
+   ::sqlite3_int64 pageCount = 0;
+   bool wal = false;
+   long long journal = 0;
+   double readSeconds = 0;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   resetKeywordRootCache();
+   g_metrics.reset();
+
+   g_log.out(TF_LOG_SUMMARY) << "              Lightroom Catalog: " << g_lightroomDBFile << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Estimating the transfer (nothing is written)" << std::endl << std::endl;
+
+   if (SQLITE_OK != ::sqlite3_open_v2(g_lightroomDBFile.c_str(), &lightroomDB, SQLITE_OPEN_READONLY, NULL)) {
+      g_log.err() << "Can't open lightroom database: " << ::sqlite3_errmsg(lightroomDB) << std::endl;
+      ::sqlite3_close(lightroomDB);
+      return 1;
+   }
+
+   {
+      TFSql sql(lightroomDB, "PRAGMA page_size");
+      if (sql.step()) {
+         pageSize = sql.column_int64(0);
+      }
+      sql.reset("PRAGMA page_count");
+      if (sql.step()) {
+         pageCount = sql.column_int64(0);
+      }
+      sql.reset("PRAGMA journal_mode");
+      if (sql.step()) {
+         wal = (sql.column_str(0) == "wal");
+      }
+   }
+
+   // What removeAllKeywords() and removeAllStacks() clear.
+   const char *clearedKeywords[] = {
+      "AgLibraryKeyword", "AgLibraryKeywordCooccurrence", "AgLibraryKeywordFace",
+      "AgLibraryKeywordImage", "AgLibraryKeywordPopularity", "AgLibraryKeywordSynonym"
+   };
+   const char *clearedStacks[] = {
+      "AgLibraryFolderStack", "AgLibraryFolderStackData", "AgLibraryFolderStackImage"
+   };
+   if (stageSelected(STAGE_KEYWORDS)) {
+      for (const char *table : clearedKeywords) {
+         counts.clearedRows += countRows(lightroomDB, table);
+      }
+      // The two keyword roots.
+      counts.keywords = 2;
+   }
+   if (stageSelected(STAGE_STACKS)) {
+      for (const char *table : clearedStacks) {
+         counts.clearedRows += countRows(lightroomDB, table);
+      }
+   }
+
+   {
+      TFSql sql(lightroomDB,
+                "SELECT F.originalFilename, I.id_local, F.externalModTime, I.copyName "
+                "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
+                "WHERE F.id_local = I.rootFile "
+                "AND O.id_local = F.folder "
+                "AND R.id_local = O.rootFolder "
+                "ORDER BY I.id_local");
+
+      while (sql.step()) {
+         std::string fileName = sql.column_str(0);
+         ::sqlite3_int64 image_id = sql.column_int64(1);
+         ::sqlite3_int64 imageDate = sql.column_int64(2);
+         std::string copyName = sql.column_str(3);
+
+         counts.images++;
+         g_metrics.increment(TF_IMAGES_SCANNED);
+
+         g_imageArena.reset();
+         facelist faces(g_imageArena);
+         if (stageSelected(STAGE_FACES)) {
+            findFacesForImage(faces, apertureDB, facesDB, fileName, imageDate);
+         }
+
+         // createKeywordImage() assigns each person once per image.
+         std::unordered_set<TFString> peopleOfImage;
+         if (faces.size()) {
+            counts.imagesWithFaces++;
+            counts.faces += faces.size();
+            for (facedata &face : faces) {
+               if (!face.name.empty()) {
+                  counts.namedFaces++;
+                  people.insert(face.name);
+                  peopleOfImage.insert(face.name);
+               }
+            }
+
+            TFSql oldFaces(lightroomDB,
+                           "SELECT count(*) FROM AgLibraryFace WHERE image = ?");
+            oldFaces.bind(1, image_id);
+            if (oldFaces.step()) {
+               counts.oldFaces += oldFaces.column_int64(0);
+            }
+         }
+
+         keywordlist keywordsForVersion(g_imageArena);
+         if (stageSelected(STAGE_KEYWORDS)) {
+            findKeywordsForVersion(keywordsForVersion, apertureDB, fileName, imageDate, copyName);
+         }
+         tags.insert(keywordsForVersion.begin(), keywordsForVersion.end());
+         long long links = peopleOfImage.size() + keywordsForVersion.size();
+         counts.links += links;
+         if (links > 1 && stageSelected(STAGE_COOCCURRENCE)) {
+            // rebuildKeywordCoocurrences() writes both directions of each
+            // pair, a pair seen on an earlier image only updates its count.
+            counts.cooccurrenceWrites += links * (links - 1);
+            std::vector<uint32_t> handles;
+            for (const TFString &person : peopleOfImage) {
+               handles.push_back(person.handle());
+            }
+            for (const TFString &keyword : keywordsForVersion) {
+               handles.push_back(keyword.handle());
+            }
+            std::sort(handles.begin(), handles.end());
+            handles.erase(std::unique(handles.begin(), handles.end()), handles.end());
+            for (size_t i = 0; i < handles.size(); ++i) {
+               for (size_t j = i + 1; j < handles.size(); ++j) {
+                  keywordPairs.insert(((uint64_t) handles[i] << 32) | handles[j]);
+               }
+            }
+         }
+
+         if (stageSelected(STAGE_STACKS)) {
+            TFUuidKey apertureStackId = findApertureStackIdOfVersion(apertureDB, fileName, imageDate, copyName);
+            if (!apertureStackId.isNull()) {
+               stacks.insert(apertureStackId);
+               counts.stackedImages++;
+            }
+         }
+
+         std::string masterUUID = findImageUUIDForFilename(apertureDB, fileName, imageDate);
+         if (masterUUID != "") {
+            counts.matched++;
+
+            double latitude;
+            double longitude;
+            bool failed = false;
+            if (stageSelected(STAGE_GPS) &&
+                findGPSOfVersion(apertureDB, masterUUID, copyName, latitude, longitude, failed)) {
+               counts.gpsUpdates++;
+               TFSql xmp(lightroomDB,
+                         "SELECT length(xmp) FROM Adobe_AdditionalMetadata WHERE image = ?");
+               xmp.bind(1, image_id);
+               if (xmp.step()) {
+                  counts.xmpBytes += xmp.column_int64(0);
+               }
+            }
+         }
+      }
+
+      if (sql.hasFailed()) {
+         g_log.err() << "Failed to read image: " << sql.getErrorMsg() << std::endl;
+         ::sqlite3_close(lightroomDB);
+         return 1;
+      }
+   }
+
+   std::vector<lightroomimage> lightroomImages;
+   if ((stageSelected(STAGE_ALBUMS) || stageSelected(STAGE_RATINGS)) &&
+       !readLightroomImages(lightroomDB, lightroomImages)) {
+      ::sqlite3_close(lightroomDB);
+      return 1;
+   }
+   if (stageSelected(STAGE_ALBUMS)) {
+      std::vector<aperturealbum> albums;
+      if (!findAlbumImages(apertureDB, lightroomImages, albums)) {
+         ::sqlite3_close(lightroomDB);
+         return 1;
+      }
+      counts.collections = albums.size();
+      for (const aperturealbum &album : albums) {
+         counts.collectionImages += album.images.size();
+      }
+
+      // An earlier run left its collection set, createCollections() empties it.
+      TFSql sql(lightroomDB,
+                "SELECT id_local "
+                "FROM AgLibraryCollection "
+                "WHERE name = ? "
+                "AND parent IS NULL "
+                "AND creationId = 'com.adobe.ag.library.group'");
+      sql.bind(1, g_albumsCollectionSet);
+      if (sql.step()) {
+         ::sqlite3_int64 setID = sql.column_int64(0);
+         sql.reset("SELECT (SELECT COUNT(*) FROM AgLibraryCollection WHERE parent = ?1) + "
+                   "(SELECT COUNT(*) FROM AgLibraryCollectionImage "
+                   " WHERE collection IN (SELECT id_local FROM AgLibraryCollection WHERE parent = ?1))");
+         sql.bind(1, setID);
+         if (sql.step()) {
+            counts.clearedRows += sql.column_int64(0);
+         }
+      } else {
+         counts.collections++;
+      }
+      if (sql.hasFailed()) {
+         g_log.err() << "Failed to find the collection set of the albums: " << sql.getErrorMsg() << std::endl;
+         ::sqlite3_close(lightroomDB);
+         return 1;
+      }
+   }
+   if (stageSelected(STAGE_RATINGS)) {
+      std::vector<imagerating> ratings;
+      if (!findImageRatings(apertureDB, lightroomImages, ratings)) {
+         ::sqlite3_close(lightroomDB);
+         return 1;
+      }
+      counts.ratings = ratings.size();
+      std::stable_sort(ratings.begin(), ratings.end(), [](const imagerating &a, const imagerating &b) {
+         return a.image < b.image;
+      });
+
+      // Compared as writeImageRatings() does, no rating is NULL.
+      TFSql sql(lightroomDB,
+                "SELECT id_local, rating, pick, colorLabels "
+                "FROM Adobe_images "
+                "ORDER BY id_local");
+      size_t next = 0;
+      while (next < ratings.size() && sql.step()) {
+         ::sqlite3_int64 image = sql.column_int64(0);
+         while (next < ratings.size() && ratings[next].image < image) {
+            next++;
+         }
+         // Of two versions of an image, the staging keeps the last.
+         while (next + 1 < ratings.size() && ratings[next + 1].image == image) {
+            next++;
+         }
+         if (next < ratings.size() && ratings[next].image == image) {
+            const imagerating &rating = ratings[next];
+            bool sameRating = rating.rating > 0 ?
+                              (!sql.column_null(1) && sql.column_double(1) == rating.rating) :
+                              sql.column_null(1);
+            bool samePick = !sql.column_null(2) && sql.column_double(2) == rating.pick;
+            bool sameLabel = !sql.column_null(3) && sql.column_str(3) == rating.colorLabel;
+            if (!sameRating || !samePick || !sameLabel) {
+               counts.ratingUpdates++;
+            }
+         }
+      }
+      if (sql.hasFailed()) {
+         g_log.err() << "Failed to read ratings of images: " << sql.getErrorMsg() << std::endl;
+         ::sqlite3_close(lightroomDB);
+         return 1;
+      }
+   }
+   ::sqlite3_close(lightroomDB);
+   if (stringPoolExhausted()) {
+      return 1;
+   }
+
+   counts.keywords += people.size() + tags.size();
+   counts.stacks = stacks.size();
+   counts.cooccurrences = 2 * (long long) keywordPairs.size();
+   readSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   journal = estimate.journalBytes(pageSize, pageCount, wal);
+   long long seconds = (long long) ::ceil(estimate.seconds(readSeconds, journal, pageSize));
+
+   g_log.out(TF_LOG_QUIET) << "Images:      " << counts.images << " (" << counts.matched << " found in Aperture, "
+                           << counts.imagesWithFaces << " with faces)" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "Faces:       " << counts.faces << " (" << counts.namedFaces << " named, "
+                           << people.size() << " people), " << counts.oldFaces << " old faces to remove" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "Keywords:    " << counts.keywords << " to create, " << counts.links << " assignments, "
+                           << counts.cooccurrences << " co-occurrences" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "Stacks:      " << counts.stacks << " (" << counts.stackedImages << " images)" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "GPS:         " << counts.gpsUpdates << " locations (" << counts.xmpBytes << " bytes of XMP)" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "Albums:      " << counts.collections << " collections (" << counts.collectionImages << " images)" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "Ratings:     " << counts.ratingUpdates << " images to update (" << counts.ratings
+                           << " found in Aperture)" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "Row writes:  " << estimate.insertedRows() << " inserted, " << estimate.updatedRows()
+                           << " updated, " << estimate.deletedRows() << " deleted" << std::endl;
+   g_log.out(TF_LOG_QUIET) << "Journal:     " << journal / 1024 << " KiB (" << (wal ? "write-ahead log" : "rollback journal")
+                           << ", catalog " << pageSize * pageCount / 1024 << " KiB)" << std::endl;
+   char duration[32];
+   ::snprintf(duration, sizeof(duration), "%lld:%02lld:%02lld", seconds / 3600, seconds / 60 % 60, seconds % 60);
+   g_log.out(TF_LOG_QUIET) << "Time:        about " << duration << " (" << readSeconds
+                           << " s of it reading, as measured now)" << std::endl;
+
+   return 0;
+}
+
+/**
+ * Appends text to XML, escaped for an attribute value.
+ *
+ * @param out     The XML.
+ * @param text    The text.
+ */
+void appendXmlEscaped(std::string &out, const std::string &text)
+{
+   for (char c : text) {
+      switch (c) {
+         case '&': out += "&amp;"; break;
+         case '<': out += "&lt;"; break;
+         case '>': out += "&gt;"; break;
+         case '"': out += "&quot;"; break;
+         default: out += c; break;
+      }
+   }
+}
+
+/**
+ * Builds an XMP sidecar with the faces of an image as MWG regions.
+ *
+ * The faces are converted with orientFace() like for the catalog, then each
+ * one becomes a region of type Face, given by its center and size relative
+ * to the image.
+ *
+ * @param xmp           Receives the packet; its capacity is kept, so a
+ *                      buffer reused for many images is rarely reallocated.
+ * @param faces         The faces found in Aperture.
+ * @param orientation   The orientation of the image (in Lightroom style).
+ * @param width         The width of the image in pixels (0: unknown).
+ * @param height        The height of the image in pixels (0: unknown).
+ */
+void buildFaceSidecar(std::string &xmp,
+                      facelist &faces,
+                      const std::string &orientation,
+                      ::sqlite3_int64 width,
+                      ::sqlite3_int64 height)
+{
+   char line[512];
+
+   xmp.clear();
+   xmp += "<?xpacket begin=\"\xEF\xBB\xBF\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n"
+          "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n"
+          " <rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">\n"
+          "  <rdf:Description rdf:about=\"\"\n"
+          "    xmlns:mwg-rs=\"http://www.metadataworkinggroup.com/schemas/regions/\"\n"
+          "    xmlns:stDim=\"http://ns.adobe.com/xap/1.0/sType/Dimensions#\"\n"
+          "    xmlns:stArea=\"http://ns.adobe.com/xmp/sType/Area#\">\n"
+          "   <mwg-rs:Regions rdf:parseType=\"Resource\">\n";
+
+   if (width > 0 && height > 0) {
+      // The regions are relative to the image as shown.
+      if (orientation == "BC" || orientation == "DA") {
+         std::swap(width, height);
+      }
+      ::snprintf(line, sizeof(line),
+                 "    <mwg-rs:AppliedToDimensions stDim:w=\"%lld\" stDim:h=\"%lld\" stDim:unit=\"pixel\"/>\n",
+                 (long long) width, (long long) height);
+      xmp += line;
+   }
+
+   xmp += "    <mwg-rs:RegionList>\n"
+          "     <rdf:Bag>\n";
+   for (facedata &face : faces) {
+      orientFace(face, orientation);
+
+      double left = std::min(std::min(face.tl_x, face.tr_x), std::min(face.bl_x, face.br_x));
+      double right = std::max(std::max(face.tl_x, face.tr_x), std::max(face.bl_x, face.br_x));
+      double top = std::min(std::min(face.tl_y, face.tr_y), std::min(face.bl_y, face.br_y));
+      double bottom = std::max(std::max(face.tl_y, face.tr_y), std::max(face.bl_y, face.br_y));
+
+      xmp += "      <rdf:li>\n"
+             "       <rdf:Description mwg-rs:Type=\"Face\"";
+      if (!face.name.empty()) {
+         xmp += " mwg-rs:Name=\"";
+         appendXmlEscaped(xmp, face.name.str());
+         xmp += "\"";
+      }
+      ::snprintf(line, sizeof(line),
+                 ">\n"
+                 "        <mwg-rs:Area stArea:x=\"%.6f\" stArea:y=\"%.6f\" stArea:w=\"%.6f\" stArea:h=\"%.6f\" stArea:unit=\"normalized\"/>\n"
+                 "       </rdf:Description>\n"
+                 "      </rdf:li>\n",
+                 (left + right) / 2, (top + bottom) / 2, right - left, bottom - top);
+      xmp += line;
+   }
+   xmp += "     </rdf:Bag>\n"
+          "    </mwg-rs:RegionList>\n"
+          "   </mwg-rs:Regions>\n"
+          "  </rdf:Description>\n"
+          " </rdf:RDF>\n"
+          "</x:xmpmeta>\n"
+          "<?xpacket end=\"w\"?>\n";
+}
+
+/**
+ * Creates a directory and its parents, as far as they do not exist yet.
+ *
+ * @param path    The directory.
+ * @return @c true if the directory exists now, @c false else.
+ */
+bool makeDirectories(const std::string &path)
+{
+   for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+      std::string part = path.substr(0, slash);
+      if (part != "" && 0 != ::mkdir(part.c_str(), 0755) && errno != EEXIST) {
+         g_log.err() << "Can't create directory " << part << ": " << ::strerror(errno) << std::endl;
+         return false;
+      }
+      if (slash == std::string::npos) {
+         return true;
+      }
+   }
+}
+
+/**
+ * Replaces a file atomically: the content is written to a temporary file
+ * next to it, which is then renamed, so readers see the old or the new file
+ * but never a partial one. The temporary name is unique per call, so
+ * threads writing the same file do not write into each other's temporary.
+ *
+ * @param path      The file.
+ * @param content   The new content.
+ * @return @c true on succes, @c false on any error.
+ */
+bool writeFileAtomically(const std::string &path, const std::string &content)
+{
+   static std::atomic<unsigned long long> calls(0);
+   std::string temporary = path + ".tf-" + std::to_string(::getpid()) + "-" + std::to_string(calls++);
+   int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+   if (fd < 0) {
+      g_log.err() << "Can't create " << temporary << ": " << ::strerror(errno) << std::endl;
+      return false;
+   }
 
-         // Update Adobe_AdditionalMetadata
-         TFSql findXMP(lightroomDB,
-                       "SELECT xmp "
-                       "FROM Adobe_AdditionalMetadata "
-                       "WHERE image = ?");
-         findXMP.bind(1, image_id);
-         if (findXMP.step()) {
-            std::string xmp = findXMP.column_str(0);
+   size_t written = 0;
+   while (written < content.size()) {
+      ssize_t n = ::write(fd, content.data() + written, content.size() - written);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         g_log.err() << "Can't write " << temporary << ": " << ::strerror(errno) << std::endl;
+         ::close(fd);
+         ::unlink(temporary.c_str());
+         return false;
+      }
+      written += n;
+   }
 
-            if (findXMP.hasFailed()) {
-               std::cerr << "Failed to read XMP data" << std::endl;
-               return false;
-            }
+   if (0 != ::close(fd) || 0 != ::rename(temporary.c_str(), path.c_str())) {
+      g_log.err() << "Can't write " << path << ": " << ::strerror(errno) << std::endl;
+      ::unlink(temporary.c_str());
+      return false;
+   }
+   return true;
+}
 
-            // std::cerr << "--- Before ---------------------------------------" << std::endl;
-            // std::cerr << xmp << std::endl;
-            // std::cerr << "--------------------------------------------------" << std::endl;
+/// A Lightroom image with where its sidecar goes.
+typedef struct
+{
+   lightroomimage image;
+   std::string directory;      ///< Root folder name and path from the root.
+   std::string baseName;       ///< The file name without extension.
+   std::string extension;      ///< The extension of the file.
+   std::string sidecar;        ///< The path of the sidecar.
+   ::sqlite3_int64 width;
+   ::sqlite3_int64 height;
+} sidecarimage;
 
-            if (!updateXmp(xmp, latitude, longitude)) {
-               std::cerr << "Failed to update XMP data" << std::endl;
-               return false;
-            }
+/**
+ * Output mode: Writes an XMP sidecar with the faces of Aperture as MWG
+ * regions for each image of the catalog that has faces, instead of changing
+ * the catalog. The catalog is opened read-only.
+ *
+ * The sidecars go to g_sidecarDir, in the folders of the images below their
+ * root folder. The images are looked up and written by a pool of threads
+ * (as many as -W gives, else one per core), each with its own connections to
+ * Aperture and its own buffer for the packets. Virtual copies are skipped,
+ * they share the file of their master.
+ *
+ * A sidecar is named like the image without its extension. Files that would
+ * share a sidecar that way, like the RAW and the JPEG of a pair, get one
+ * named like the whole file instead (IMG_1.CR2.xmp and IMG_1.JPG.xmp).
+ *
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @return The exit status: 0 on success, 1 on any error.
+ */
+int writeFaceSidecars(::sqlite3 *apertureDB, ::sqlite3 *facesDB)
+{
+   ::sqlite3 *lightroomDB = NULL;
+   std::vector<sidecarimage> images;
 
-            // std::cerr << "--- After ----------------------------------------" << std::endl;
-            // std::cerr << xmp << std::endl;
-            // std::cerr << "--------------------------------------------------" << std::endl;
+   g_metrics.reset();
+   g_log.out(TF_LOG_SUMMARY) << "              Lightroom Catalog: " << g_lightroomDBFile << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << "             Sidecars are put in: " << g_sidecarDir << std::endl;
 
-            // Save updated XMP
-            TFSql updateXMP(lightroomDB,
-                            "UPDATE Adobe_AdditionalMetadata "
-                            "SET xmp = ? "
-                            "WHERE image = ?");
-            updateXMP.bind(1, xmp);
-            updateXMP.bind(2, image_id);
-            updateXMP.step();
-            if (updateXMP.hasFailed()) {
-               std::cerr << "Failed to update XMP data" << std::endl;
-               return false;
-            }
-         } else {
-            std::cerr << "Warning: Did not find additional metadata" << std::endl;
-         }
-      }
+   if (SQLITE_OK != ::sqlite3_open_v2(g_lightroomDBFile.c_str(), &lightroomDB, SQLITE_OPEN_READONLY, NULL)) {
+      g_log.err() << "Can't open lightroom database: " << ::sqlite3_errmsg(lightroomDB) << std::endl;
+      ::sqlite3_close(lightroomDB);
+      return 1;
+   }
 
+   {
+      TFSql sql(lightroomDB,
+                "SELECT F.originalFilename, I.id_local, I.orientation, F.externalModTime, "
+                "       R.name, O.pathFromRoot, F.baseName, F.extension, I.fileWidth, I.fileHeight "
+                "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
+                "WHERE F.id_local = I.rootFile "
+                "AND O.id_local = F.folder "
+                "AND R.id_local = O.rootFolder "
+                "AND (I.copyName IS NULL OR I.copyName = '') "
+                "ORDER BY I.id_local");
+      while (sql.step()) {
+         sidecarimage image;
+         image.image.fileName = sql.column_str(0);
+         image.image.id = sql.column_int64(1);
+         image.image.orientation = sql.column_str(2);
+         image.image.imageDate = sql.column_int64(3);
+         image.directory = g_sidecarDir + "/" + sql.column_str(4) + "/" + sql.column_str(5);
+         image.baseName = sql.column_str(6);
+         image.extension = sql.column_str(7);
+         image.width = sql.column_int64(8);
+         image.height = sql.column_int64(9);
+         images.push_back(image);
+      }
       if (sql.hasFailed()) {
-         std::cerr << "Failed to get GPS location" << std::endl;
-         return false;
+         g_log.err() << "Failed to read image: " << sql.getErrorMsg() << std::endl;
+         ::sqlite3_close(lightroomDB);
+         return 1;
       }
-   } else {
-      std::cerr << "Didn't find master UUID for " << fileName << std::endl;
    }
 
-   return true;
+   {
+      std::unordered_map<std::string, int> imagesOfBaseName;
+      for (const sidecarimage &image : images) {
+         imagesOfBaseName[image.directory + image.baseName]++;
+      }
+      for (sidecarimage &image : images) {
+         image.sidecar = image.directory + image.baseName;
+         if (imagesOfBaseName[image.sidecar] > 1 && image.extension != "") {
+            image.sidecar += "." + image.extension;
+         }
+         image.sidecar += ".xmp";
+      }
+   }
+   ::sqlite3_close(lightroomDB);
+
+   int threads = g_imageThreads > 0 ? g_imageThreads : (int) std::max(1u, std::thread::hardware_concurrency());
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Writing sidecars of " << images.size() << " images in " << threads << " threads" << std::endl << std::endl;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   // Per worker: connections, an arena for the faces and the buffer of the packets.
+   std::vector<std::unique_ptr<stagedbs>> dbs;
+   std::vector<std::unique_ptr<TFArena>> arenas;
+   std::vector<std::string> buffers(threads);
+   for (int n = 0; n < threads; ++n) {
+      dbs.push_back(std::unique_ptr<stagedbs>(new stagedbs(apertureDB, facesDB)));
+      arenas.push_back(std::unique_ptr<TFArena>(new TFArena()));
+      buffers[n].reserve(64 * 1024);
+   }
+   std::mutex directoriesMutex;
+   std::unordered_set<std::string> directories;
+   std::atomic<long long> written(0);
+   std::atomic<long long> failed(0);
+
+   const size_t CHUNK = 64;   // Images per task
+   TFWorkStealingPool pool;
+   pool.start(threads);
+   for (size_t first = 0; first < images.size(); first += CHUNK) {
+      size_t last = std::min(images.size(), first + CHUNK);
+      pool.submit([&, first, last](int worker) {
+         for (size_t n = first; n < last; ++n) {
+            const sidecarimage &image = images[n];
+            g_metrics.increment(TF_IMAGES_SCANNED);
+
+            arenas[worker]->reset();
+            facelist faces(*arenas[worker]);
+            if (!findFacesForImage(faces, dbs[worker]->apertureDB, dbs[worker]->facesDB, image.image.fileName, image.image.imageDate)) {
+               failed++;
+               continue;
+            }
+            if (faces.empty()) {
+               g_metrics.increment(TF_IMAGES_WITHOUT_FACES);
+               continue;
+            }
+
+            bool created;
+            {
+               std::lock_guard<std::mutex> lock(directoriesMutex);
+               created = directories.count(image.directory) > 0 ||
+                         (makeDirectories(image.directory) && directories.insert(image.directory).second);
+            }
+            buildFaceSidecar(buffers[worker], faces, image.image.orientation, image.width, image.height);
+            if (!created || TFStringPool::global().isExhausted() || !writeFileAtomically(image.sidecar, buffers[worker])) {
+               failed++;
+               continue;
+            }
+            written++;
+            g_metrics.increment(TF_FACES_INSERTED, faces.size());
+            g_log.out(TF_LOG_DETAIL) << "Wrote " << faces.size() << " faces of " << image.image.fileName << std::endl;
+         }
+      });
+   }
+   pool.stop();
+
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Statistics" << std::endl << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << "Wrote " << written << " sidecars with " << g_metrics.value(TF_FACES_INSERTED) << " faces, "
+                             << g_metrics.value(TF_IMAGES_WITHOUT_FACES) << " images did not have any face information";
+   if (seconds > 0) {
+      g_log.out(TF_LOG_SUMMARY) << " (" << (long long) (written / seconds) << " sidecars/s)";
+   }
+   g_log.out(TF_LOG_SUMMARY) << "." << std::endl;
+   if (failed > 0) {
+      g_log.err() << failed << " images failed." << std::endl;
+      stringPoolExhausted();
+      return 1;
+   }
+   return 0;
 }
 
 /**
- * Main.
+ * The getopt() option string of a transfer run. A ':' marks options that
+ * take a value.
+ */
+const char *const RUN_OPTIONS = "l:a:k:S:c:j:m:M:T:W:L:PAIC:EQHX:o:x:p:v:r:R:u:";
+
+/**
+ * Parses the options of one transfer run.
  *
- * Parses command line arguments, iterates over all images in the Lightroom
- * database, searches for the image in the Aperture database, extracts all face
-* information for the images and transfers them into the Lightroom database.
+ * Used for the command line and for jobs sent to the server. Options that
+ * only make sense on the command line are rejected for jobs.
+ *
+ * @param argc       Number of arguments.
+ * @param argv       The arguments (argv[0] is the program name).
+ * @param isJob      Flag whether the arguments came from a server job.
+ * @param apertureLibrary  Receives the Aperture library bundle (-a).
+ * @param serverSocket     Receives the socket to listen on (-S).
+ * @param clientSocket     Receives the socket to send the job to (-c).
+ * @return @c true if the options are fine, @c false else.
  */
-int main(int argc, char *argv[])
+bool parseRunOptions(int argc, char *argv[], bool isJob,
+                     std::string &apertureLibrary,
+                     std::string &serverSocket,
+                     std::string &clientSocket)
 {
-   std::string lightroomDBFile = "./Lightroom Catalog.lrcat";
-   std::string apertureDBFile =
-      std::string(::getenv("HOME")) + "/Pictures/Aperture Library.aplibrary/Database/Library.apdb";
-   std::string facesDBFile =
-      std::string(::getenv("HOME")) + "/Pictures/Aperture Library.aplibrary/Database/Faces.db";
+   // Restart option parsing, getopt() keeps its state in globals.
+#if defined(__APPLE__) || defined(__FreeBSD__)
+   optreset = 1;
+   optind = 1;
+#else
+   optind = 0;
+#endif
 
    int optchar;
-   while (-1 != (optchar = getopt(argc, argv, "l:a:k:"))) {
+   while (-1 != (optchar = getopt(argc, argv, RUN_OPTIONS))) {
       switch(optchar) {
          case 'l':
-            lightroomDBFile = optarg;
+            g_lightroomDBFile = optarg;
             break;
          case 'a':
-            apertureDBFile = optarg;
-            apertureDBFile += "/Database/Library.apdb";
-            facesDBFile = optarg;
-            facesDBFile += "/Database/Faces.db";
+            if (isJob) {
+               g_log.err() << "The Aperture library is chosen when the server is started." << std::endl;
+               return false;
+            }
+            apertureLibrary = optarg;
             break;
          case 'f':
             g_keywordsRoot = optarg;
@@ -1884,199 +6457,533 @@ int main(int argc, char *argv[])
          case 't':
             g_tagKeywordsRoot = optarg;
             break;
+         case 'j':
+            g_shards = ::atoi(optarg);
+            if (g_shards < 1) {
+               g_log.err() << "Number of shards must be at least 1." << std::endl;
+               return false;
+            }
+            break;
+         case 'T':
+            g_stageThreads = ::atoi(optarg);
+            if (g_stageThreads < 1) {
+               g_log.err() << "Number of stage threads must be at least 1." << std::endl;
+               return false;
+            }
+            break;
+         case 'W':
+            g_imageThreads = ::atoi(optarg);
+            if (g_imageThreads < 1) {
+               g_log.err() << "Number of image threads must be at least 1." << std::endl;
+               return false;
+            }
+            break;
+         case 'm':
+            g_metricsFile = optarg;
+            break;
+         case 'M':
+            g_metricsInterval = ::atoi(optarg);
+            if (g_metricsInterval < 1) {
+               g_log.err() << "Metrics interval must be at least one second." << std::endl;
+               return false;
+            }
+            break;
+         case 'L':
+            g_slowestCount = ::atoi(optarg);
+            if (g_slowestCount < 0) {
+               g_log.err() << "Number of slowest images must not be negative." << std::endl;
+               return false;
+            }
+            break;
+         case 'P':
+            g_perfCounters = true;
+            break;
+         case 'A':
+            g_allocationProfile = true;
+            break;
+         case 'I':
+            g_ioStats = true;
+            break;
+         case 'E':
+            g_estimateOnly = true;
+            break;
+         case 'Q':
+            g_queueBenchmark = true;
+            break;
+         case 'H':
+            g_keywordTree = true;
+            break;
+         case 'X':
+            g_sidecarDir = optarg;
+            while (g_sidecarDir.size() > 1 && g_sidecarDir[g_sidecarDir.size() - 1] == '/') {
+               g_sidecarDir.erase(g_sidecarDir.size() - 1);
+            }
+            break;
+         case 'u':
+            g_uuidSeeded = true;
+            g_uuidSeed = ::strtoull(optarg, NULL, 10);
+            break;
+         case 'o':
+         case 'x':
+            {
+               int stages = 0;
+               if (!parseStages(optarg, stages)) {
+                  g_log.err() << "Unknown stage in " << optarg << ", use faces, keywords, stacks, gps, cooccurrence, albums or ratings." << std::endl;
+                  return false;
+               }
+               g_stages = (optchar == 'o') ? stages : (g_stages & ~stages);
+            }
+            break;
+         case 'v':
+            if (std::string(optarg) == "quiet") {
+               g_logLevel = TF_LOG_QUIET;
+            } else if (std::string(optarg) == "summary") {
+               g_logLevel = TF_LOG_SUMMARY;
+            } else if (std::string(optarg) == "images") {
+               g_logLevel = TF_LOG_DETAIL;
+            } else {
+               g_log.err() << "Unknown output level " << optarg << ", use quiet, summary or images." << std::endl;
+               return false;
+            }
+            break;
+         case 'r':
+         case 'R':
+            g_progressInterval = ::atoi(optarg);
+            g_progressJson = (optchar == 'R');
+            if (g_progressInterval < 1) {
+               g_log.err() << "Progress interval must be at least one second." << std::endl;
+               return false;
+            }
+            break;
+         case 'C':
+            g_sqliteCacheMB = ::atoi(optarg);
+            if (g_sqliteCacheMB < 0) {
+               g_log.err() << "SQLite cache size must not be negative." << std::endl;
+               return false;
+            }
+            break;
+         case 'p':
+            g_prefetchDepth = ::atoi(optarg);
+            if (g_prefetchDepth < 0) {
+               g_log.err() << "Prefetch depth must not be negative." << std::endl;
+               return false;
+            }
+            break;
+         case 'S':
+         case 'c':
+            if (isJob) {
+               g_log.err() << "Jobs cannot start or contact servers." << std::endl;
+               return false;
+            }
+            (optchar == 'S' ? serverSocket : clientSocket) = optarg;
+            break;
          case 'h':
          default:
-            std::cerr << "Usage: " << std::endl;
-            std::cerr << "   " << argv[0] << " -l <Lightroom Catalog.lrcat> -a <Aperture Library.aplibrary> -k <Parent Of Keywords>" << std::endl;
-            std::cerr << std::endl;
-            std::cerr << "-l <file>   The Lightroom Catalog main file" << std::endl;
-            std::cerr << "            (default: Lightroom Catalog.lrcat)" << std::endl;
-            std::cerr << "-a <file>   The Aperture library bundle" << std::endl;
-            std::cerr << "            (default: $HOME/Pictures/Aperture Library.aplibrary)" << std::endl;
-            std::cerr << "-f <folder> The keywords folder to place face tags into" << std::endl;
-            std::cerr << "            (default: Faces from Aperture)" << std::endl;
-            std::cerr << "-t <folder> The keywords folder to place other keywords tags into" << std::endl;
-            std::cerr << "            (default: Tags from Aperture)" << std::endl;
-            ::exit(1);
+            g_log.err() << "Usage: " << std::endl;
+            g_log.err() << "   " << argv[0] << " -l <Lightroom Catalog.lrcat> -a <Aperture Library.aplibrary> -k <Parent Of Keywords>" << std::endl;
+            g_log.err() << "   " << argv[0] << " -a <Aperture Library.aplibrary> -S <socket>" << std::endl;
+            g_log.err() << "   " << argv[0] << " -c <socket> -l <Lightroom Catalog.lrcat> ..." << std::endl;
+            g_log.err() << std::endl;
+            g_log.err() << "-l <file>   The Lightroom Catalog main file" << std::endl;
+            g_log.err() << "            (default: Lightroom Catalog.lrcat)" << std::endl;
+            g_log.err() << "-a <file>   The Aperture library bundle" << std::endl;
+            g_log.err() << "            (default: $HOME/Pictures/Aperture Library.aplibrary)" << std::endl;
+            g_log.err() << "-f <folder> The keywords folder to place face tags into" << std::endl;
+            g_log.err() << "            (default: Faces from Aperture)" << std::endl;
+            g_log.err() << "-t <folder> The keywords folder to place other keywords tags into" << std::endl;
+            g_log.err() << "            (default: Tags from Aperture)" << std::endl;
+            g_log.err() << "-j <count>  Shard mode: Transfer the images in <count> worker processes" << std::endl;
+            g_log.err() << "            that merge their changes (default: 1, no workers)" << std::endl;
+            g_log.err() << "-T <count>  Look up the data of the stages concurrently in <count> threads," << std::endl;
+            g_log.err() << "            then write them stage by stage (cannot be combined with -j or -L)" << std::endl;
+            g_log.err() << "-W <count>  Look up the images in <count> work-stealing threads, the" << std::endl;
+            g_log.err() << "            catalog is still written image by image (cannot be combined" << std::endl;
+            g_log.err() << "            with -j or -T)" << std::endl;
+            g_log.err() << "-m <file>   Write metrics for the Prometheus node_exporter textfile" << std::endl;
+            g_log.err() << "            collector to <file>" << std::endl;
+            g_log.err() << "-M <secs>   Interval to write the metrics file in (default: 15)" << std::endl;
+            g_log.err() << "-L <count>  Print percentiles of the time spent per image and the" << std::endl;
+            g_log.err() << "            <count> slowest images (default: 0, no report)" << std::endl;
+            g_log.err() << "-P          Print hardware performance counters per stage (Linux only)" << std::endl;
+            g_log.err() << "-A          Print the allocations (C++ and SQLite) per stage and per image" << std::endl;
+            g_log.err() << "            (SQLite is only covered if the process was started with -A)" << std::endl;
+            g_log.err() << "-I          Print the reads, writes and syncs on the Aperture databases" << std::endl;
+            g_log.err() << "-C <MB>     Preallocate <MB> of page cache and larger lookaside buffers for" << std::endl;
+            g_log.err() << "            SQLite (default: 0, off; only when the process is started with it)" << std::endl;
+            g_log.err() << "-o <stages> Only run the given stages, a comma separated list of faces," << std::endl;
+            g_log.err() << "            keywords, stacks, gps, cooccurrence, albums and ratings (default: all)" << std::endl;
+            g_log.err() << "-x <stages> Skip the given stages" << std::endl;
+            g_log.err() << "-E          Estimate only: Predict time, row writes and journal size of" << std::endl;
+            g_log.err() << "            the transfer without changing the catalog" << std::endl;
+            g_log.err() << "-Q          Measure the throughput of the queue that hands the images" << std::endl;
+            g_log.err() << "            looked up by -W to the writer, then exit" << std::endl;
+            g_log.err() << "-H          Recreate all Aperture keywords with their hierarchy below the" << std::endl;
+            g_log.err() << "            tag keywords root (default: only the ones assigned, flat)" << std::endl;
+            g_log.err() << "-X <dir>    Write the faces as MWG regions into XMP sidecars below <dir>" << std::endl;
+            g_log.err() << "            instead of changing the catalog (threads: -W, else one per core)" << std::endl;
+            g_log.err() << "-u <seed>   Create the UUIDs of new rows from <seed>, so the same catalog" << std::endl;
+            g_log.err() << "            gets the same UUIDs each time (for benchmarks and tests)" << std::endl;
+            g_log.err() << "-v <level>  What to print: quiet (errors only), summary (stages and" << std::endl;
+            g_log.err() << "            statistics) or images (a line per image, the default)" << std::endl;
+            g_log.err() << "-r <secs>   Report progress (images, rates, ETA) to stderr every <secs>" << std::endl;
+            g_log.err() << "-R <secs>   Like -r, but as JSON lines" << std::endl;
+            g_log.err() << "-p <count>  Look up the Aperture data of the next <count> images in a" << std::endl;
+            g_log.err() << "            background thread, to have it cached in time (default: 0, off)" << std::endl;
+            g_log.err() << "-S <socket> Server mode: Load the Aperture library once and run" << std::endl;
+            g_log.err() << "            the transfer jobs sent to the given UNIX domain socket" << std::endl;
+            g_log.err() << "-c <socket> Client mode: Let the server listening on the given" << std::endl;
+            g_log.err() << "            socket run the transfer (all other options are sent along)" << std::endl;
+            return false;
       }
    }
 
-   std::cout << std::endl << "### Opening database" << std::endl << std::endl;
-
-   std::cout << "              Lightroom Catalog: " << lightroomDBFile << std::endl;
-   std::cout << "      Aperture Library database: " << apertureDBFile << std::endl;
-   std::cout << "        Aperture Faces database: " << facesDBFile << std::endl;
-   std::cout << "Parent folder for face keywords: " << g_keywordsRoot << std::endl;
-   std::cout << " Parent folder for tag keywords: " << g_tagKeywordsRoot << std::endl;
-
-   ::sqlite3 *lightroomDB = NULL;
-   ::sqlite3 *apertureDB = NULL;
-   ::sqlite3 *facesDB = NULL;
-
-   if (SQLITE_OK != ::sqlite3_open_v2(lightroomDBFile.c_str(), &lightroomDB, SQLITE_OPEN_READWRITE, NULL)) {
-      std::cerr << "Can't open lightroom database: " << ::sqlite3_errmsg(lightroomDB) << std::endl;
-      goto fail;
+   if (g_shards > 1 && g_stageThreads > 0) {
+      g_log.err() << "Shard mode (-j) and concurrent stages (-T) cannot be combined." << std::endl;
+      return false;
    }
-   sqlite3_exec(lightroomDB, "BEGIN", 0, 0, 0);
-
-   if (SQLITE_OK != ::sqlite3_open_v2(apertureDBFile.c_str(), &apertureDB, SQLITE_OPEN_READONLY, NULL)) {
-      std::cerr << "Can't open aperture main database: " << ::sqlite3_errmsg(apertureDB) << std::endl;
-      goto fail;
+   if (g_imageThreads > 0 && (g_shards > 1 || g_stageThreads > 0)) {
+      g_log.err() << "Image threads (-W) cannot be combined with -j or -T." << std::endl;
+      return false;
    }
-
-   if (SQLITE_OK != ::sqlite3_open_v2(facesDBFile.c_str(), &facesDB, SQLITE_OPEN_READONLY, NULL)) {
-      std::cerr << "Can't open aperture faces database: " << ::sqlite3_errmsg(facesDB) << std::endl;
-      goto fail;
+   if (g_slowestCount > 0 && g_stageThreads > 0) {
+      // The stages of an image run on different threads at different times,
+      // there is no time per image to report.
+      g_log.err() << "The per-image report (-L) cannot be combined with concurrent stages (-T)." << std::endl;
+      return false;
+   }
+   if (stageSelected(STAGE_KEYWORDS) && !stageSelected(STAGE_FACES)) {
+      // The keywords stage starts by removing all keywords, the people and
+      // their links to the faces included; only the faces stage brings them
+      // back.
+      g_log.err() << "The keywords stage removes the people, too, it needs the faces stage." << std::endl;
+      return false;
    }
 
-   std::cout << std::endl << "### Preparing database" << std::endl << std::endl;
+   return true;
+}
 
-   std::cout << "Removing keywords" << std::endl;
-   if (!removeAllKeywords(lightroomDB)) {
-      std::cerr << "Failed to remove all keywords from lightroom" << std::endl;
-      goto fail;
-   }
+/**
+ * Seconds the server waits for a client to send its complete job, or to
+ * take more of the output of its job.
+ */
+const int CLIENT_TIMEOUT = 10;
 
-   std::cout << "Recreating keyword roots" << std::endl;
-   if (!recreateRootKeyword(lightroomDB, g_keywordsRoot, g_tagKeywordsRoot)) {
-      std::cerr << "Failed to create keywords roots" << std::endl;
-      goto fail;
+/**
+ * Server mode: Waits for transfer jobs on a UNIX domain socket and runs them,
+ * one after the other, against the already opened Aperture databases.
+ *
+ * A job is a request as read by tfReadRequest(): the working directory of the
+ * client followed by the command line arguments of the run. All output of the
+ * run is streamed back to the client. The last line sent is
+ * "### Exit status: <n>".
+ *
+ * @param socketPath    The path of the socket to listen on.
+ * @param apertureDB    The handle of the Aperture database.
+ * @param facesDB       The handle of the face DB of Aperture.
+ * @return The exit status (the server only returns on error).
+ */
+int serveTransferJobs(const std::string &socketPath, ::sqlite3 *apertureDB, ::sqlite3 *facesDB)
+{
+   TFLogLevel serverLevel = g_logLevel;
+   struct ::sockaddr_un address;
+   if (!tfSocketAddress(address, socketPath)) {
+      g_log.err() << "Socket path too long: " << socketPath << std::endl;
+      return 1;
    }
 
-   std::cout << "Removing stacks" << std::endl;
-   if (!removeAllStacks(lightroomDB)) {
-      std::cerr << "Failed to remove all keywords from lightroom" << std::endl;
-      goto fail;
+   int listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+   ::unlink(socketPath.c_str());
+   if (listenFd < 0 ||
+       0 != ::bind(listenFd, (struct ::sockaddr *) &address, sizeof(address)) ||
+       0 != ::listen(listenFd, 16)) {
+      g_log.err() << "Can't listen on " << socketPath << ": " << ::strerror(errno) << std::endl;
+      return 1;
    }
 
-   {
-      std::map<std::string, std::deque<::sqlite_int64>> stacksByApertureStackID;
-      std::map<::sqlite_int64, std::deque<std::string>> keywordsByImage;
-      std::map<std::string, int> insertedPeople;
-      ::sqlite_int64 insertedFaces = 0;
-      ::sqlite_int64 imagesCount = 0;
-      ::sqlite_int64 imagesWithoutFaces = 0;
-      ::sqlite_int64 unknownFaces = 0;
-
-      std::cout << std::endl << "### Transfering face information" << std::endl << std::endl;
-      TFSql sql(lightroomDB,
-                "SELECT F.originalFilename, I.id_local, I.orientation, F.externalModTime, I.copyName "
-                "FROM Adobe_images I, AgLibraryFile F, AgLibraryFolder O, AgLibraryRootFolder R "
-                "WHERE F.id_local = I.rootFile "
-                "AND O.id_local = F.folder "
-                "AND R.id_local = O.rootFolder");
+   // Clients going away must not kill the server.
+   ::signal(SIGPIPE, SIG_IGN);
 
-      while(sql.step()) {
-         std::string fileName = sql.column_str(0);
-         ::sqlite3_int64 image_id = sql.column_int64(1);
-         std::string orientation = sql.column_str(2);
-         ::sqlite3_int64 imageDate = sql.column_int64(3);
-         std::string copyName = sql.column_str(4);
+   char serverDirectory[PATH_MAX];
+   if (!::getcwd(serverDirectory, sizeof(serverDirectory))) {
+      g_log.err() << "Can't get working directory: " << ::strerror(errno) << std::endl;
+      return 1;
+   }
 
-         imagesCount++;
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Waiting for jobs on " << socketPath << std::endl << std::endl;
 
-         std::deque<facedata> faces = findFacesForImage(apertureDB, facesDB, fileName, imageDate);
-         if (faces.size()) {
-            std::cout << fileName << ": ";
-            if (!removeLightroomFacesForImage(lightroomDB, image_id)) {
-               return false;
-            }
-            std::string sep = "";
-            for(facedata &face : faces) {
-               if (!createFaceEntry(lightroomDB, face, image_id, orientation)) {
-                  std::cerr << "Failed to create face entry" << std::endl;
-               } else {
-                  insertedFaces++;
-
-                  if (face.name != "") {
-                     auto iter = insertedPeople.find(face.name);
-                     if (iter == insertedPeople.end()) {
-                        insertedPeople.insert(std::pair<std::string,int>(face.name, 1));
-                     } else {
-                        iter->second++;
-                     }
-                  } else {
-                     unknownFaces++;
-                  }
-               }
+   for (;;) {
+      int clientFd = ::accept(listenFd, NULL, NULL);
+      if (clientFd < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         g_log.err() << "Failed to accept job: " << ::strerror(errno) << std::endl;
+         ::close(listenFd);
+         return 1;
+      }
 
-               std::cout << sep;
-               if (face.name == "") {
-                  std::cout << "[Unnamed]";
-                  unknownFaces++;
+      // A client that never completes its request, or stops reading the
+      // output of its job, must not block the server. The output of a job
+      // whose client timed out is discarded, the job itself runs to its end.
+      struct ::timeval timeout;
+      timeout.tv_sec = CLIENT_TIMEOUT;
+      timeout.tv_usec = 0;
+      ::setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      ::setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+      std::deque<std::string> request;
+      errno = 0;
+      if (!tfReadRequest(clientFd, request)) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            g_log.err() << "Timed out reading job." << std::endl;
+         }
+      } else if (request.size() >= 1) {
+         std::vector<char *> jobArgv;
+         jobArgv.push_back((char *) "transferFaces");
+         for (size_t n = 1; n < request.size(); ++n) {
+            jobArgv.push_back(&request[n][0]);
+         }
+         jobArgv.push_back(NULL);
+
+         int status = 1;
+         {
+            TFFdStreambuf clientOutput(clientFd);
+            g_log.redirect(&clientOutput, &clientOutput);
+
+            resetRunOptions();
+            std::string ignored;
+            if (0 != ::chdir(request[0].c_str())) {
+               g_log.err() << "Can't change to directory " << request[0] << ": " << ::strerror(errno) << std::endl;
+            } else if (parseRunOptions(jobArgv.size() - 1, &jobArgv[0], true, ignored, ignored, ignored)) {
+               g_log.setLevel(g_logLevel);
+               g_log.out(TF_LOG_SUMMARY) << std::endl << "### Running job" << std::endl << std::endl;
+               if (g_queueBenchmark) {
+                  status = benchmarkHandOff();
+               } else if (g_estimateOnly) {
+                  status = estimateTransfer(apertureDB, facesDB);
+               } else if (g_sidecarDir != "") {
+                  status = writeFaceSidecars(apertureDB, facesDB);
                } else {
-                  std::cout << face.name;
+                  status = transferIntoCatalog(apertureDB, facesDB);
                }
-               sep = ", ";
             }
-            std::cout << std::endl;
-         } else {
-            imagesWithoutFaces++;
-         }
+            g_log.out(TF_LOG_QUIET) << "### Exit status: " << status << std::endl;
 
-         std::deque<std::string> keywordsForVersion;
-         if (!findKeywordsForVersion(keywordsForVersion, apertureDB, fileName, imageDate, copyName)) {
-            std::cerr << "Failed to get keywords for version" << std::endl;
+            g_log.redirect(NULL, NULL);
+            g_log.setLevel(serverLevel);
          }
-         keywordsByImage.insert(std::pair<::sqlite3_int64, std::deque<std::string>>(image_id, keywordsForVersion));
 
-         std::string apertureStackId = findApertureStackIdOfVersion(apertureDB, fileName, imageDate, copyName);
-         if (apertureStackId != "") {
-            stacksByApertureStackID[apertureStackId].push_back(image_id);
+         if (0 != ::chdir(serverDirectory)) {
+            g_log.err() << "Can't change back to directory " << serverDirectory << ": " << ::strerror(errno) << std::endl;
          }
+         g_log.out(TF_LOG_SUMMARY) << "Job for " << g_lightroomDBFile << " finished with exit status " << status << std::endl;
+      }
 
-         if (!transferGPS(apertureDB, lightroomDB, image_id, fileName, imageDate, copyName)) {
-            std::cerr << "Failed to transfer GPS location for version " << fileName << ", " << copyName << std::endl;
+      ::close(clientFd);
+   }
+}
+
+/**
+ * Client mode: Sends the command line to a server and prints its output.
+ *
+ * @param socketPath    The path of the socket the server listens on.
+ * @param argc          Number of arguments.
+ * @param argv          The arguments (-c and its value are not sent).
+ * @return The exit status of the job.
+ */
+int sendTransferJob(const std::string &socketPath, int argc, char *argv[])
+{
+   char directory[PATH_MAX];
+   if (!::getcwd(directory, sizeof(directory))) {
+      g_log.err() << "Can't get working directory: " << ::strerror(errno) << std::endl;
+      return 1;
+   }
+
+   std::deque<std::string> request;
+   request.push_back(directory);
+   for (int n = 1; n < argc; ++n) {
+      std::string arg = argv[n];
+      if (arg == "--") {
+         for (; n < argc; ++n) {
+            request.push_back(argv[n]);
          }
+         break;
+      }
+      if (arg.size() < 2 || arg[0] != '-') {
+         request.push_back(arg);
+         continue;
       }
 
-      if (sql.hasFailed()) {
-         std::cerr << "Failed to read image: " << sql.getErrorMsg() << std::endl;
-         goto fail;
+      // An option group like "-PA" or "-Pcsocket": find the first option
+      // taking a value, the rest of the group or the next argument is it.
+      size_t i = 1;
+      for (; i < arg.size(); ++i) {
+         const char *option = ::strchr(RUN_OPTIONS, arg[i]);
+         if (option && option[1] == ':') {
+            break;
+         }
+      }
+      if (i < arg.size() && arg[i] == 'c') {
+         if (i > 1) {
+            request.push_back(arg.substr(0, i));
+         }
+         if (i + 1 == arg.size()) {
+            ++n;
+         }
+         continue;
+      }
+      request.push_back(arg);
+      if (i + 1 == arg.size() && ++n < argc) {
+         request.push_back(argv[n]);
       }
+   }
 
-      std::cout << std::endl << "### Creating Stacks" << std::endl << std::endl;
+   struct ::sockaddr_un address;
+   int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+   if (!tfSocketAddress(address, socketPath) ||
+       fd < 0 ||
+       0 != ::connect(fd, (struct ::sockaddr *) &address, sizeof(address)) ||
+       !tfWriteRequest(fd, request)) {
+      g_log.err() << "Can't send job to " << socketPath << ": " << ::strerror(errno) << std::endl;
+      if (fd >= 0) {
+         ::close(fd);
+      }
+      return 1;
+   }
 
-      if (!createStacks(lightroomDB, stacksByApertureStackID)) {
-         std::cerr << "Failed to create image stacks" << std::endl;
-         goto fail;
+   int status = 1;
+   std::string line;
+   char buffer[4096];
+   ssize_t size;
+   while (0 < (size = ::read(fd, buffer, sizeof(buffer))) || (size < 0 && errno == EINTR)) {
+      for (ssize_t n = 0; n < size; ++n) {
+         line += buffer[n];
+         if (buffer[n] == '\n') {
+            if (line.find("### Exit status: ") == 0) {
+               status = ::atoi(line.substr(17).c_str());
+            } else {
+               std::cout << line << std::flush;
+            }
+            line = "";
+         }
       }
+   }
+   std::cout << line << std::flush;
+   ::close(fd);
 
-      std::cout << std::endl << "### Recreating keywords" << std::endl << std::endl;
+   return status;
+}
 
-      if (!recreateKeywords(lightroomDB, keywordsByImage)) {
-         std::cerr << "Failed to recreate keywords." << std::endl;
-         goto fail;
-      }
+/**
+ * Gives SQLite a preallocated page cache and larger lookaside buffers (-C).
+ *
+ * The per-image queries prepare many small statements; the lookaside slots
+ * serve most of their allocations and the page cache keeps page reads off
+ * malloc(). Pages larger than a cache line (or more pages than lines) still
+ * go to malloc(), so this is a tuning and never a limit.
+ *
+ * Must be called before SQLite is used for the first time.
+ *
+ * @param megabytes  The size of the page cache.
+ * @return @c true on success, @c false if SQLite was already initialised.
+ */
+bool configureSQLiteMemory(int megabytes)
+{
+   static const int pageSize = 4096;
+   const int pages = megabytes * (1024 * 1024 / pageSize);
+   static const int lookasideSlotSize = 1200;
+   static const int lookasideSlots = 256;
 
-      if (!fixKeywordsUTF8(lightroomDB)) {
-         std::cerr << "Failed to fix keyword UTF-8 encoding to be composed" << std::endl;
-         goto fail;
-      }
+   int headerSize = 0;
+   if (SQLITE_OK != ::sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &headerSize)) {
+      return false;
+   }
 
-      std::cout << std::endl << "### Cleaning up keyword coocurrences" << std::endl << std::endl;
+   // Aligned to 8 bytes, SQLite expects that of every cache line.
+   int lineSize = (pageSize + headerSize + 7) & ~7;
+   void *pageCache = ::malloc((size_t) lineSize * pages);
+   if (!pageCache) {
+      return false;
+   }
 
-      if (!rebuildKeywordCoocurrences(lightroomDB)) {
-         std::cerr << "Failed to fix keyword coocurrences" << std::endl;
-         goto fail;
-      }
+   return SQLITE_OK == ::sqlite3_config(SQLITE_CONFIG_PAGECACHE, pageCache, lineSize, pages) &&
+          SQLITE_OK == ::sqlite3_config(SQLITE_CONFIG_LOOKASIDE, lookasideSlotSize, lookasideSlots);
+}
 
-      std::cout << std::endl << "### Statistics" << std::endl << std::endl;
-      std::cout << "Analysed " << imagesCount << " images, " << imagesWithoutFaces << " did not have any face information." << std::endl;
-      std::cout << "Inserted " << insertedFaces << " faces from " << insertedPeople.size() << " people: ";
-      std::cout << "[Unknown faces] (" << unknownFaces << ")";
-      for (std::pair<std::string, int> p : insertedPeople) {
-         std::cout << ", " << p.first << " (" << p.second << ")";
-      }
-      std::cout << std::endl;
+/**
+ * Main.
+ *
+ * Parses command line arguments, iterates over all images in the Lightroom
+ * database, searches for the image in the Aperture database, extracts all face
+* information for the images and transfers them into the Lightroom database.
+ */
+int main(int argc, char *argv[])
+{
+   std::string apertureLibrary =
+      std::string(::getenv("HOME")) + "/Pictures/Aperture Library.aplibrary";
+   std::string serverSocket;
+   std::string clientSocket;
+
+   resetRunOptions();
+   if (!parseRunOptions(argc, argv, false, apertureLibrary, serverSocket, clientSocket)) {
+      ::exit(1);
    }
 
-   sqlite3_exec(lightroomDB, "COMMIT", 0, 0, 0);
+   if (clientSocket != "") {
+      return sendTransferJob(clientSocket, argc, argv);
+   }
+
+   g_log.setLevel(g_logLevel);
+   g_log.start();
+
+   // libxml2 must be initialised before its parser is used by threads.
+   LIBXML_TEST_VERSION
+   ::xmlInitParser();
+
+   // SQLite's memory can only be configured before SQLite is used.
+   if (g_sqliteCacheMB > 0 && !configureSQLiteMemory(g_sqliteCacheMB)) {
+      g_log.err() << "Warning: Cannot configure the memory of SQLite." << std::endl;
+   }
+   if (g_allocationProfile && !g_allocations.installSQLiteHooks()) {
+      g_log.err() << "Warning: Cannot count allocations of SQLite." << std::endl;
+   }
+   if (!TFIoVfs::registerVfs()) {
+      g_log.err() << "Warning: Can't register the I/O accounting VFS of SQLite, -I will not count anything." << std::endl;
+   }
+
+   if (g_queueBenchmark && serverSocket == "") {
+      int result = benchmarkHandOff();
+      g_log.stop();
+      return result;
+   }
+
+   std::string apertureDBFile = apertureLibrary + "/Database/Library.apdb";
+   std::string facesDBFile = apertureLibrary + "/Database/Faces.db";
+
+   g_log.out(TF_LOG_SUMMARY) << std::endl << "### Opening database" << std::endl << std::endl;
+
+   g_log.out(TF_LOG_SUMMARY) << "      Aperture Library database: " << apertureDBFile << std::endl;
+   g_log.out(TF_LOG_SUMMARY) << "        Aperture Faces database: " << facesDBFile << std::endl;
+
+   int result = 1;
+   ::sqlite3 *apertureDB = NULL;
+   ::sqlite3 *facesDB = NULL;
+
+   if (openApertureDatabases(apertureDBFile, facesDBFile, &apertureDB, &facesDB, serverSocket != "")) {
+      if (serverSocket != "") {
+         result = serveTransferJobs(serverSocket, apertureDB, facesDB);
+      } else if (g_estimateOnly) {
+         result = estimateTransfer(apertureDB, facesDB);
+      } else if (g_sidecarDir != "") {
+         result = writeFaceSidecars(apertureDB, facesDB);
+      } else {
+         result = transferIntoCatalog(apertureDB, facesDB);
+      }
+   }
 
-   std::cout << std::endl << "### Done" << std::endl << std::endl;
-   std::cout << "Looks good." << std::endl;
-fail:
-   ::sqlite3_close(lightroomDB);
    ::sqlite3_close(apertureDB);
    ::sqlite3_close(facesDB);
+   g_log.stop();
+
+   return result;
 }